@@ -0,0 +1,299 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Ahead-of-time translation of a known hot set of functions. MAMBO_AOT names
+  a file with one entry per line, either a function name or an address range
+  START-END, in hexadecimal with the 0x prefix, as in the executable's symbol
+  table. Lines starting with # are comments.
+
+  The names are resolved through the symbol tables of the executable when
+  it's loaded. Before the application starts, the main thread translates the
+  basic blocks reachable through direct branches from the start of each
+  function without leaving the listed functions, then links them. Functions
+  in libraries loaded by the dynamic linker aren't known at that point.
+
+  Code caches are private to each thread, so other threads don't benefit
+  from this translation. With MAMBO_AOT_ALL_THREADS=1, each new thread also
+  translates the hot set into its own code cache before it starts running,
+  which the threads do in parallel.
+*/
+
+#ifdef DBM_AOT
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include "dbm.h"
+
+#define AOT_MAX_BLOCKS 8192
+
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+} aot_range;
+
+typedef struct {
+  char *name;
+  bool found;
+} aot_name;
+
+static aot_name *aot_names;
+static int aot_name_count;
+// link-time addresses from the list, relocated by aot_add_elf()
+static aot_range *aot_link_ranges;
+static int aot_link_range_count;
+// sorted by start address, without overlaps
+static aot_range *aot_ranges;
+static int aot_range_count;
+// the start of each function or range from the list, at runtime
+static uintptr_t *aot_entries;
+static int aot_entry_count;
+static bool aot_all_threads;
+static bool aot_elf_added;
+
+// Arrays grow in powers of two
+static void *aot_grow(void *array, int count, size_t entry_size) {
+  if ((count & (count - 1)) == 0) {
+    array = realloc(array, (count == 0 ? 1 : count * 2) * entry_size);
+    assert(array != NULL);
+  }
+  return array;
+}
+
+static void aot_add_range(aot_range **ranges, int *count, uintptr_t start, uintptr_t end) {
+  *ranges = aot_grow(*ranges, *count, sizeof(aot_range));
+  (*ranges)[*count].start = start;
+  (*ranges)[*count].end = end;
+  (*count)++;
+}
+
+static void aot_add_function(uintptr_t start, uintptr_t end) {
+  aot_add_range(&aot_ranges, &aot_range_count, start, end);
+  aot_entries = aot_grow(aot_entries, aot_entry_count, sizeof(uintptr_t));
+  aot_entries[aot_entry_count++] = start;
+}
+
+static int aot_name_cmp(const void *a, const void *b) {
+  return strcmp(((const aot_name *)a)->name, ((const aot_name *)b)->name);
+}
+
+static int aot_range_cmp(const void *a, const void *b) {
+  uintptr_t start_a = ((const aot_range *)a)->start;
+  uintptr_t start_b = ((const aot_range *)b)->start;
+  return (start_a > start_b) - (start_a < start_b);
+}
+
+// Reads the list named by MAMBO_AOT, called once at startup before the executable is loaded
+void aot_init() {
+  char *path = getenv("MAMBO_AOT");
+  char *line = NULL;
+  size_t size = 0;
+
+  if (path == NULL) {
+    return;
+  }
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "MAMBO: couldn't open the AOT list %s\n", path);
+    return;
+  }
+  char *all_threads = getenv("MAMBO_AOT_ALL_THREADS");
+  aot_all_threads = (all_threads != NULL && atoi(all_threads) != 0);
+
+  while (getline(&line, &size, file) > 0) {
+    char *entry = strtok(line, " \t\r\n");
+    unsigned long long start, end;
+    if (entry == NULL || entry[0] == '#') {
+      continue;
+    }
+    if (strncmp(entry, "0x", 2) == 0) {
+      if (sscanf(entry, "%llx-%llx", &start, &end) != 2 || end <= start) {
+        fprintf(stderr, "MAMBO: invalid AOT address range %s\n", entry);
+        continue;
+      }
+      aot_add_range(&aot_link_ranges, &aot_link_range_count, start, end);
+    } else {
+      aot_names = aot_grow(aot_names, aot_name_count, sizeof(aot_name));
+      aot_names[aot_name_count].name = strdup(entry);
+      assert(aot_names[aot_name_count].name != NULL);
+      aot_names[aot_name_count].found = false;
+      aot_name_count++;
+    }
+  }
+  free(line);
+  fclose(file);
+
+  qsort(aot_names, aot_name_count, sizeof(aot_name), aot_name_cmp);
+}
+
+/* Called for the executable segment of the application's executable, mapped
+   at addr from offset in the file. Resolves the list to runtime addresses. */
+void aot_add_elf(int fd, uintptr_t addr, off_t offset) {
+  Elf_Scn *scn = NULL;
+  GElf_Ehdr ehdr;
+  GElf_Shdr shdr;
+  GElf_Sym sym;
+  uintptr_t base = 0;
+
+  if (aot_elf_added || (aot_name_count == 0 && aot_link_range_count == 0)) {
+    return;
+  }
+  aot_elf_added = true;
+
+  Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+  if (elf == NULL || gelf_getehdr(elf, &ehdr) == NULL) {
+    fprintf(stderr, "MAMBO: couldn't read the symbols for AOT translation\n");
+    elf_end(elf);
+    return;
+  }
+
+  // the segment was mapped from its page-aligned offset, at its page-aligned address
+  if (ehdr.e_type == ET_DYN) {
+    size_t phnum;
+    int ret = elf_getphdrnum(elf, &phnum);
+    assert(ret == 0);
+    for (int i = 0; i < phnum; i++) {
+      GElf_Phdr phdr;
+      gelf_getphdr(elf, i, &phdr);
+      uintptr_t page_offset = phdr.p_vaddr & (PAGE_SIZE - 1);
+      if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) && (phdr.p_offset - page_offset) == offset) {
+        base = addr - (phdr.p_vaddr - page_offset);
+      }
+    }
+  }
+
+  for (int i = 0; i < aot_link_range_count; i++) {
+    aot_add_function(base + aot_link_ranges[i].start, base + aot_link_ranges[i].end);
+  }
+
+  while((scn = elf_nextscn(elf, scn)) != NULL) {
+    gelf_getshdr(scn, &shdr);
+    if ((shdr.sh_type == SHT_SYMTAB || shdr.sh_type == SHT_DYNSYM) && aot_name_count > 0) {
+      Elf_Data *edata = elf_getdata(scn, NULL);
+      assert(edata != NULL);
+      int sym_count = shdr.sh_size / shdr.sh_entsize;
+
+      for (int i = 0; i < sym_count; i++) {
+        gelf_getsym(edata, i, &sym);
+        if (sym.st_value != 0 && ELF32_ST_TYPE(sym.st_info) == STT_FUNC) {
+          aot_name key = { .name = elf_strptr(elf, shdr.sh_link, sym.st_name) };
+          aot_name *name = bsearch(&key, aot_names, aot_name_count, sizeof(aot_name), aot_name_cmp);
+          if (name != NULL) {
+            // the same function can be in both symbol tables
+            if (!name->found) {
+              uintptr_t start = base + sym.st_value;
+              aot_add_function(start, start + max(sym.st_size, 4));
+            }
+            name->found = true;
+          }
+        }
+      }
+    }
+  }
+  int ret = elf_end(elf);
+  assert(ret == 0);
+
+  for (int i = 0; i < aot_name_count; i++) {
+    if (!aot_names[i].found) {
+      fprintf(stderr, "MAMBO: AOT function %s not found\n", aot_names[i].name);
+    }
+  }
+
+  // merge the overlapping ranges
+  qsort(aot_ranges, aot_range_count, sizeof(aot_range), aot_range_cmp);
+  int merged = 0;
+  for (int i = 1; i < aot_range_count; i++) {
+    if (aot_ranges[i].start <= aot_ranges[merged].end) {
+      aot_ranges[merged].end = max(aot_ranges[merged].end, aot_ranges[i].end);
+    } else {
+      aot_ranges[++merged] = aot_ranges[i];
+    }
+  }
+  if (aot_range_count > 0) {
+    aot_range_count = merged + 1;
+  }
+}
+
+static bool aot_in_range(uintptr_t addr) {
+  // the last range starting at or before addr
+  int low = 0;
+  int high = aot_range_count - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    if (aot_ranges[mid].start <= addr) {
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return high >= 0 && addr < aot_ranges[high].end;
+}
+
+static void aot_scan(dbm_thread *thread_data, uintptr_t target, int *blocks, int *count) {
+  if (*count >= AOT_MAX_BLOCKS || thread_data->was_flushed
+      || thread_data->free_block >= (CODE_CACHE_SIZE - 2 * CODE_CACHE_OVERP)
+      || translated_block(thread_data, target) != 0) {
+    return;
+  }
+  uintptr_t block_address = lookup_or_scan(thread_data, target, NULL);
+  if (!thread_data->was_flushed) {
+    stats_inc(thread_data, STATS_PRETRANSLATIONS);
+    blocks[(*count)++] = addr_to_bb_id(thread_data, block_address);
+  }
+}
+
+/* Translates and links the hot set in the code cache of a thread which hasn't
+   started running application code. If the code cache is flushed in the
+   meantime, thread_data->was_flushed is set. */
+void aot_translate(dbm_thread *thread_data, bool new_thread) {
+  uintptr_t targets[2];
+  int count = 0;
+
+  if (aot_entry_count == 0 || (new_thread && !aot_all_threads)) {
+    return;
+  }
+  int *blocks = malloc(AOT_MAX_BLOCKS * sizeof(int));
+  assert(blocks != NULL);
+  thread_data->was_flushed = false;
+
+  for (int i = 0; i < aot_entry_count; i++) {
+    aot_scan(thread_data, aot_entries[i], blocks, &count);
+  }
+  for (int i = 0; i < count; i++) {
+    int target_count = direct_exit_targets(&thread_data->code_cache_meta[blocks[i]], targets);
+    for (int t = 0; t < target_count; t++) {
+      if (aot_in_range(targets[t])) {
+        aot_scan(thread_data, targets[t], blocks, &count);
+      }
+    }
+  }
+
+  if (!thread_data->was_flushed) {
+    for (int i = 0; i < count; i++) {
+      link_direct_exit(thread_data, blocks[i]);
+    }
+  }
+  free(blocks);
+}
+
+#endif // DBM_AOT
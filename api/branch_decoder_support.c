@@ -235,12 +235,15 @@ mambo_branch_type mambo_get_branch_type(mambo_context *ctx) {
       type = BRANCH_DIRECT | BRANCH_COND | BRANCH_COND_TBZ;
       break;
     case A64_BR:
+    case A64_BRA:
       type = BRANCH_INDIRECT;
       break;
     case A64_BLR:
+    case A64_BLRA:
       type = BRANCH_INDIRECT | BRANCH_CALL;
       break;
     case A64_RET:
+    case A64_RETA:
       type = BRANCH_INDIRECT | BRANCH_RETURN;
       break;
     case A64_B_BL: {
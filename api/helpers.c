@@ -207,11 +207,58 @@ static inline int emit_thumb_add_sub(mambo_context *ctx, int rd, int rn, int rm)
 #endif // __arm__
 
 #ifdef __aarch64__
+/*
+  Rewrites the pop sequence emitted by emit_a64_pop() at write_p for the same
+  registers into loads which don't update SP. The values stay on the stack,
+  which then matches the state after the pop followed by a push.
+*/
+static void a64_pop_to_reload(uint32_t *write_p, uint32_t regs)
+{
+  uint32_t to_pop[2];
+  int reg_no;
+  int offset = 0;
+
+  while (regs != 0)
+  {
+    reg_no = get_lowest_n_regs(regs, to_pop, 2);
+    if (reg_no == 2)
+    {
+      // LDP to_pop[0], to_pop[1], [SP, #offset]
+      a64_LDP_STP(&write_p, 2, 0, 2, 1, offset / 8, to_pop[1], sp, to_pop[0]);
+      regs &= ~((1 << to_pop[0]) | (1 << to_pop[1]));
+    }
+    else
+    {
+      // LDR to_pop[0], [SP, #offset]
+      a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, offset / 8, sp, to_pop[0]);
+      regs &= ~(1 << to_pop[0]);
+    }
+    write_p++;
+    offset += 16;
+  }
+}
+
 void emit_a64_push(mambo_context *ctx, uint32_t regs)
 {
   int reg_no = count_bits(regs);
   ctx->code.plugin_pushed_reg_count += reg_no;
 
+  /* A pop immediately followed by a push of the same registers, possibly with
+     independent loads and stores in between (see scan_a64()), is replaced
+     by loads from the stack */
+  dbm_thread *thread_data = ctx->thread_data;
+  if (regs != 0 && thread_data->pending_pop_end == ctx->code.write_p
+      && thread_data->pending_pop_regs == regs)
+  {
+    a64_pop_to_reload(thread_data->pending_pop_start, regs);
+    thread_data->pending_pop_end = NULL;
+    stats_inc(thread_data, STATS_MERGED_PUSH_POPS);
+#ifdef DBM_LIVENESS_STATS
+    atomic_increment_u64(&global_data.merged_push_pop_insts, (reg_no + 1) / 2);
+#endif
+    return;
+  }
+
   uint32_t *write_p = ctx->code.write_p;
   uint32_t to_push[2];
 
@@ -243,6 +290,9 @@ void emit_a64_pop(mambo_context *ctx, uint32_t regs)
   uint32_t to_pop[2];
   int reg_no;
 
+  ctx->thread_data->pending_pop_start = write_p;
+  ctx->thread_data->pending_pop_regs = regs;
+
   while (regs != 0)
   {
     reg_no = get_lowest_n_regs(regs, to_pop, 2);
@@ -260,6 +310,21 @@ void emit_a64_pop(mambo_context *ctx, uint32_t regs)
   }
 
   ctx->code.write_p = write_p;
+  ctx->thread_data->pending_pop_end = write_p;
+}
+
+void emit_a64_push_nzcv(mambo_context *ctx, enum reg tmp_reg)
+{
+  // MRS tmp_reg, NZCV
+  emit_a64_MRS_MSR_reg(ctx, 1, 1, 3, 4, 2, 0, tmp_reg);
+  emit_a64_push(ctx, 1 << tmp_reg);
+}
+
+void emit_a64_pop_nzcv(mambo_context *ctx, enum reg tmp_reg)
+{
+  emit_a64_pop(ctx, 1 << tmp_reg);
+  // MSR NZCV, tmp_reg
+  emit_a64_MRS_MSR_reg(ctx, 0, 1, 3, 4, 2, 0, tmp_reg);
 }
 
 static inline int emit_a64_add_sub_shift(mambo_context *ctx, int rd, int rn, int rm,
@@ -324,6 +389,49 @@ void emit_pop(mambo_context *ctx, uint32_t regs)
 #endif
 }
 
+/* The flags are only saved if they're live at the current location,
+   emit_push_flags and emit_pop_flags must be used in pairs */
+void emit_push_flags(mambo_context *ctx, enum reg tmp_reg)
+{
+  if (!mambo_are_flags_live(ctx))
+  {
+    return;
+  }
+#ifdef __arm__
+  if (mambo_get_inst_type(ctx) == ARM_INST)
+  {
+    emit_arm_push_cpsr(ctx, tmp_reg);
+  }
+  else
+  {
+    emit_thumb_push_cpsr(ctx, tmp_reg);
+  }
+#elif __aarch64__
+  emit_a64_push_nzcv(ctx, tmp_reg);
+#endif
+}
+
+void emit_pop_flags(mambo_context *ctx, enum reg tmp_reg)
+{
+  // the save avoided was counted by emit_push_flags
+  if (!ctx->code.flags_live)
+  {
+    return;
+  }
+#ifdef __arm__
+  if (mambo_get_inst_type(ctx) == ARM_INST)
+  {
+    emit_arm_pop_cpsr(ctx, tmp_reg);
+  }
+  else
+  {
+    emit_thumb_pop_cpsr(ctx, tmp_reg);
+  }
+#elif __aarch64__
+  emit_a64_pop_nzcv(ctx, tmp_reg);
+#endif
+}
+
 void emit_set_reg(mambo_context *ctx, enum reg reg, uintptr_t value)
 {
 #ifdef __arm__
@@ -398,7 +506,7 @@ int __emit_branch_cond(inst_set inst_type, void *write, uintptr_t target, mambo_
   return 0;
 }
 
-void emit_fcall(mambo_context *ctx, void *function_ptr)
+static void __emit_fcall(mambo_context *ctx, void *function_ptr)
 {
   // First try an immediate call, and if that is out of range then generate an indirect call
   int ret = __emit_branch_cond(ctx->code.inst_type, ctx->code.write_p, (uintptr_t)function_ptr, AL, true);
@@ -421,6 +529,21 @@ void emit_fcall(mambo_context *ctx, void *function_ptr)
 #endif
 }
 
+void emit_fcall(mambo_context *ctx, void *function_ptr)
+{
+#ifdef DBM_NATIVE_TLS
+  /* The function runs with MAMBO's TPIDR_EL0, native_tls_fcall_trampoline
+     switches to it and back. Only LR is modified, as for a direct call. */
+  emit_push(ctx, (1 << x9) | (1 << x10));
+  emit_set_reg_ptr(ctx, x9, &ctx->thread_data->tls);
+  emit_set_reg_ptr(ctx, x10, function_ptr);
+  __emit_fcall(ctx, native_tls_fcall_trampoline);
+  emit_pop(ctx, (1 << x9) | (1 << x10));
+#else
+  __emit_fcall(ctx, function_ptr);
+#endif
+}
+
 // push to the stack to make a safe function call
 int emit_safe_fcall(mambo_context *ctx, void *function_ptr, int argno)
 {
@@ -786,12 +909,36 @@ void emit_counter64_incr(mambo_context *ctx, void *counter, unsigned incr)
 #endif
 #ifdef __aarch64__
   assert(incr <= 0xFFF);
-  emit_a64_push(ctx, (1 << x0) | (1 << x1));
-  a64_copy_to_reg_64bits((uint32_t **)&ctx->code.write_p, x0, (uintptr_t)counter);
-  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, x0, x1);
-  emit_a64_ADD_SUB_immed(ctx, 1, 0, 0, 0, incr, x1, x1);
-  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, 0, x0, x1);
-  emit_a64_pop(ctx, (1 << x0) | (1 << x1));
+  // prefer dead registers, which don't have to be saved
+  uint32_t dead_regs = mambo_get_dead_regs(ctx);
+  uint32_t fallback_regs = (1 << x0) | (1 << x1) | (1 << x2);
+  uint32_t to_push = 0;
+  int regs[2];
+
+  for (int i = 0; i < 2; i++)
+  {
+    regs[i] = next_reg_in_list(dead_regs, 0);
+    if (regs[i] == reg_invalid)
+    {
+      regs[i] = next_reg_in_list(fallback_regs, 0);
+      to_push |= 1 << regs[i];
+    }
+#ifdef DBM_LIVENESS_STATS
+    else
+    {
+      liveness_spill_avoided(ctx->thread_data);
+    }
+#endif
+    dead_regs &= ~(1 << regs[i]);
+    fallback_regs &= ~(1 << regs[i]);
+  }
+
+  emit_a64_push(ctx, to_push);
+  a64_copy_to_reg_64bits((uint32_t **)&ctx->code.write_p, regs[0], (uintptr_t)counter);
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 1, 0, regs[0], regs[1]);
+  emit_a64_ADD_SUB_immed(ctx, 1, 0, 0, 0, incr, regs[1], regs[1]);
+  emit_a64_LDR_STR_unsigned_immed(ctx, 3, 0, 0, 0, regs[0], regs[1]);
+  emit_a64_pop(ctx, to_push);
 #endif
 }
 
@@ -799,7 +946,7 @@ int emit_indirect_branch_by_spc(mambo_context *ctx, enum reg reg)
 {
 #ifdef __aarch64__
   // Uses fragment id 0 to prevent the dispatcher from attempting linking on an IHL miss
-  a64_inline_hash_lookup(current_thread, 0, (uint32_t **)&ctx->code.write_p, ctx->code.read_address, reg, false, false);
+  a64_inline_hash_lookup(current_thread, 0, (uint32_t **)&ctx->code.write_p, ctx->code.read_address, reg, false, false, false, NULL);
 #else
   switch (ctx->code.inst_type)
   {
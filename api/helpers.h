@@ -39,6 +39,8 @@ typedef struct
 void emit_counter64_incr(mambo_context *ctx, void *counter, unsigned incr);
 void emit_push(mambo_context *ctx, uint32_t regs);
 void emit_pop(mambo_context *ctx, uint32_t regs);
+void emit_push_flags(mambo_context *ctx, enum reg tmp_reg);
+void emit_pop_flags(mambo_context *ctx, enum reg tmp_reg);
 void emit_set_reg(mambo_context *ctx, enum reg reg, uintptr_t value);
 void emit_fcall(mambo_context *ctx, void *function_ptr);
 int emit_safe_fcall(mambo_context *ctx, void *function_ptr, int argno);
@@ -99,6 +101,8 @@ static inline int emit_thumb_add_sub(mambo_context *ctx, int rd, int rn, int rm)
 #ifdef __aarch64__
 void emit_a64_push(mambo_context *ctx, uint32_t regs);
 void emit_a64_pop(mambo_context *ctx, uint32_t regs);
+void emit_a64_push_nzcv(mambo_context *ctx, enum reg tmp_reg);
+void emit_a64_pop_nzcv(mambo_context *ctx, enum reg tmp_reg);
 static inline int emit_a64_add_sub_shift(mambo_context *ctx, int rd, int rn, int rm,
                                          unsigned int shift_type, unsigned int shift);
 static inline int emit_a64_add_sub(mambo_context *ctx, int rd, int rn, int rm);
@@ -46,6 +46,8 @@ void set_mambo_context_code(mambo_context *ctx, dbm_thread *thread_data, mambo_c
   ctx->code.replace = false;
   ctx->code.pushed_regs = 0;
   ctx->code.available_regs = 0;
+  ctx->code.dead_regs = 0;
+  ctx->code.flags_live = true;
   ctx->code.plugin_pushed_reg_count = 0;
   ctx->code.stop = stop;
 }
@@ -63,8 +65,14 @@ void mambo_deliver_callbacks_for_ctx(mambo_context *ctx) {
 #ifdef PLUGINS_NEW
   unsigned cb_id = ctx->event_type;
   assert(cb_id < CALLBACK_MAX_IDX);
+  bool is_syscall = (cb_id == PRE_SYSCALL_C || cb_id == POST_SYSCALL_C);
 
   for (int i = 0; i < global_data.free_plugin; i++) {
+    mambo_plugin *plugin = &global_data.plugins[i];
+    if (is_syscall && plugin->syscall_subscribed
+        && !syscall_filter_test(plugin->syscalls, ctx->syscall.number)) {
+      continue;
+    }
     if (global_data.plugins[i].cbs[cb_id] != NULL) {
       ctx->plugin_id = i;
       global_data.plugins[i].cbs[cb_id](ctx);
@@ -101,7 +109,7 @@ void mambo_deliver_callbacks_code(unsigned cb_id, dbm_thread *thread_data, cc_ty
 void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func) {
 #ifdef PLUGINS_NEW
   ctx->plugin_id = func->plugin_id;
-  ctx->code.available_regs = ctx->code.pushed_regs;
+  ctx->code.available_regs = ctx->code.pushed_regs | ctx->code.dead_regs;
   ctx->code.func_name = func->name;
 
   if (func->post_callback != NULL) {
@@ -127,6 +135,11 @@ void _function_callback_wrapper(mambo_context *ctx, watched_func_t *func) {
     emit_pop(ctx, (1 << r5) | (1 << r6));
 #endif
 
+    // the liveness information doesn't apply at the return site
+    ctx->code.available_regs &= ~ctx->code.dead_regs;
+    ctx->code.dead_regs = 0;
+    ctx->code.flags_live = true;
+
     ctx->event_type = POST_FN_C;
     func->post_callback(ctx);
 
@@ -82,6 +82,29 @@ void _a64_is_load_or_store(mambo_context *ctx, bool *is_load, bool *is_store) {
       }
       break;
     }
+    case A64_ATOMIC_MEMORY: {
+      uint32_t size, v, a, r, rs, o3, opc, rn, rt;
+      a64_atomic_memory_decode_fields(ctx->code.read_address, &size, &v, &a, &r, &rs, &o3, &opc, &rn, &rt);
+      *is_load = true;
+      // all except LDAPR (o3 == 1, opc == 4) are read-modify-write, including SWP (o3 == 1, opc == 0)
+      if (!(o3 == 1 && opc == 4)) {
+        *is_store = true;
+      }
+      break;
+    }
+    case A64_LDAPR_STLR_UNSCALED: {
+      uint32_t size, opc, imm9, rn, rt;
+      a64_LDAPR_STLR_unscaled_decode_fields(ctx->code.read_address, &size, &opc, &imm9, &rn, &rt);
+      if (opc) {
+        *is_load = true;
+      } else {
+        *is_store = true;
+      }
+      break;
+    }
+    case A64_LDRA:
+      *is_load = true;
+      break;
   }
 }
 #endif
@@ -779,6 +802,27 @@ int _a64_calc_ld_st_addr(mambo_context *ctx, enum reg reg) {
       _generate_addr(ctx, reg, rn, reg_invalid, 0);
       return 0;
     }
+    case A64_ATOMIC_MEMORY: {
+      uint32_t size, v, a, r, rs, o3, opc, rn, rt;
+      a64_atomic_memory_decode_fields(ctx->code.read_address, &size, &v, &a, &r, &rs, &o3, &opc, &rn, &rt);
+      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      return 0;
+    }
+    case A64_LDAPR_STLR_UNSCALED: {
+      uint32_t size, opc, imm9, rn, rt;
+      a64_LDAPR_STLR_unscaled_decode_fields(ctx->code.read_address, &size, &opc, &imm9, &rn, &rt);
+      _generate_addr(ctx, reg, rn, reg_invalid, sign_extend32(9, imm9));
+      return 0;
+    }
+    case A64_LDRA: {
+      uint32_t m, s, imm9, w, rn, rt;
+      a64_LDRA_decode_fields(ctx->code.read_address, &m, &s, &imm9, &w, &rn, &rt);
+      // the base is signed with the zero modifier: AUTDZA (0b001110) or AUTDZB (0b001111)
+      _generate_addr(ctx, reg, rn, reg_invalid, 0);
+      emit_a64_pointer_auth(ctx, 0xE | m, x31, reg);
+      emit_add_sub_i(ctx, reg, reg, sign_extend32(10, (s << 9) | imm9) << 3);
+      return 0;
+    }
   }
 
   return -1;
@@ -889,6 +933,14 @@ int _a64_get_ld_st_size(mambo_context *ctx) {
       size = (1 << scale) * regs;
       break;
     }
+    case A64_ATOMIC_MEMORY:
+    case A64_LDAPR_STLR_UNSCALED:
+      // size is bits [31:30] in both encodings
+      size = 1 << (*(uint32_t *)ctx->code.read_address >> 30);
+      break;
+    case A64_LDRA:
+      size = 8;
+      break;
   } // switch
 
   return size;
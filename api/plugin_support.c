@@ -214,13 +214,29 @@ void *mambo_get_source_addr(mambo_context *ctx) {
   return ctx->code.read_address;
 }
 
+// Returns the source address of the instruction whose translation includes cc_addr, or NULL
+void *mambo_get_source_addr_for_cc(mambo_context *ctx, void *cc_addr) {
+  uintptr_t spc;
+  if (cc_addr_to_spc(ctx->thread_data, (uintptr_t)cc_addr, &spc)) {
+    return (void *)spc;
+  }
+  return NULL;
+}
+
 void *mambo_get_cc_addr(mambo_context *ctx) {
+#ifdef __aarch64__
+  // the address might become a branch target, which rules out merging a push into it
+  ctx->thread_data->pending_pop_end = NULL;
+#endif
   return ctx->code.write_p;
 }
 
 void mambo_set_cc_addr(mambo_context *ctx, void *addr) {
   assert(ctx->code.write_p != NULL);
   ctx->code.write_p = addr;
+#ifdef __aarch64__
+  ctx->thread_data->pending_pop_end = NULL;
+#endif
 }
 
 int mambo_get_thread_id(mambo_context *ctx) {
@@ -282,8 +298,8 @@ int mambo_set_source_addr(mambo_context *ctx, void *source_addr) {
 }
 
 /* Allows scratch registers to be shared by multiple plugins
-  This will likely be modified in the future to allocate dead
-  application registers if available.
+  Application registers which are dead at the current location are
+  allocated first, without being saved.
 */
 int mambo_get_scratch_regs(mambo_context *ctx, int count, ...) {
   int *regp;
@@ -303,8 +319,16 @@ int mambo_get_scratch_regs(mambo_context *ctx, int count, ...) {
     int reg = next_reg_in_list(ctx->code.available_regs, 0);
     if (reg != reg_invalid) {
       ctx->code.available_regs &= ~(1 << reg);
+#ifdef DBM_LIVENESS_STATS
+      if ((ctx->code.dead_regs & ~ctx->code.pushed_regs) & (1 << reg)) {
+        liveness_spill_avoided(ctx->thread_data);
+      }
+#endif
     } else {
-      min_pushed_reg--;
+      // dead registers can't be pushed, they might already be allocated
+      do {
+        min_pushed_reg--;
+      } while (min_pushed_reg >= 0 && (ctx->code.dead_regs & (1 << min_pushed_reg)));
       if (min_pushed_reg >= 0) {
         to_push |= 1 << min_pushed_reg;
         reg = min_pushed_reg;
@@ -331,18 +355,55 @@ int mambo_get_scratch_reg(mambo_context *ctx, int *regp) {
 }
 
 int mambo_free_scratch_regs(mambo_context *ctx, uint32_t regs) {
-  if ((regs & ctx->code.pushed_regs) != regs) {
+  if ((regs & (ctx->code.pushed_regs | ctx->code.dead_regs)) != regs) {
     return -1;
   }
   ctx->code.available_regs |= regs;
   return 0;
 }
 
+/* Returns the application registers which are dead at the current location
+   and haven't been allocated as scratch registers. They can be overwritten
+   without being saved. */
+uint32_t mambo_get_dead_regs(mambo_context *ctx) {
+  return ctx->code.dead_regs & ctx->code.available_regs;
+}
+
+/* Returns false if the condition flags are overwritten by the application
+   before being read, in which case they don't have to be preserved. The flags
+   are always reported as live on AArch32. With DBM_LIVENESS_STATS, each false
+   result is counted as a flag save avoided by the plugin. */
+bool mambo_are_flags_live(mambo_context *ctx) {
+#ifdef DBM_LIVENESS_STATS
+  if (!ctx->code.flags_live) {
+    atomic_increment_u64(&global_data.plugins[ctx->plugin_id].flags_saves_avoided, 1);
+  }
+#endif
+  return ctx->code.flags_live;
+}
+
 int mambo_free_scratch_reg(mambo_context *ctx, int reg) {
   return mambo_free_scratch_reg(ctx, 1 << reg);
 }
 
 /* Syscall helpers */
+/* Restricts the plugin's syscall callbacks to the syscalls subscribed to. Without
+   any subscriptions, they receive all syscalls. Plugins should subscribe before
+   the application starts, when registering their syscall callbacks. */
+int mambo_syscall_subscribe(mambo_context *ctx, uintptr_t no) {
+  unsigned int p_id = ctx->plugin_id;
+  if (p_id >= global_data.free_plugin) {
+    return MAMBO_INVALID_PLUGIN_ID;
+  }
+
+  mambo_plugin *plugin = &global_data.plugins[p_id];
+  plugin->syscall_subscribed = true;
+  syscall_filter_set(plugin->syscalls, no);
+  syscall_filter_set(global_data.syscall_filter, no);
+
+  return MAMBO_SUCCESS;
+}
+
 int mambo_syscall_get_no(mambo_context *ctx, uintptr_t *no) {
   if (ctx->event_type == PRE_SYSCALL_C ||
       ctx->event_type == POST_SYSCALL_C) {
@@ -396,6 +457,30 @@ int mambo_syscall_set_return(mambo_context *ctx, uintptr_t ret) {
   return -1;
 }
 
+/* Detach */
+
+/* Returns all threads to native execution, asynchronously: the detach
+   completes after the callback returns, then the exit callbacks are called */
+int mambo_detach(mambo_context *ctx) {
+#ifdef __aarch64__
+  if (detach_init() != 0) {
+    return -1;
+  }
+  return detach_request();
+#else
+  return -1;
+#endif
+}
+
+// Detaches when the process receives signo, which isn't delivered to the application
+int mambo_detach_on_signal(mambo_context *ctx, int signo) {
+#ifdef __aarch64__
+  return detach_set_signal(signo);
+#else
+  return -1;
+#endif
+}
+
 // enables indirect control transfers directly to the current code cache location
 int mambo_add_identity_mapping(mambo_context *ctx) {
   if (ctx->code.write_p == NULL) {
@@ -407,7 +492,7 @@ int mambo_add_identity_mapping(mambo_context *ctx) {
     addr |= THUMB;
   }
 
-  int ret = hash_add(&current_thread->entry_address, addr, addr);
+  int ret = hash_add(current_thread->entry_address, addr, addr);
   return (ret) ? 0 : -1;
 }
 
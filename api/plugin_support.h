@@ -38,6 +38,8 @@ struct code_ctx {
 
   uint32_t pushed_regs;
   uint32_t available_regs;
+  uint32_t dead_regs;
+  bool flags_live;
   int plugin_pushed_reg_count;
 
   char *func_name;
@@ -113,6 +115,12 @@ typedef enum {
 typedef struct {
   mambo_callback cbs[CALLBACK_MAX_IDX];
   void *data;
+  // the syscall callbacks receive all syscalls unless the plugin subscribes to specific ones
+  bool syscall_subscribed;
+  uint32_t syscalls[SYSCALL_FILTER_WORDS];
+#ifdef DBM_LIVENESS_STATS
+  uint64_t flags_saves_avoided;
+#endif
 } mambo_plugin;
 
 enum mambo_plugin_error {
@@ -163,14 +171,21 @@ int mambo_get_scratch_regs(mambo_context *ctx, int count, ...);
 int mambo_get_scratch_reg(mambo_context *ctx, int *regp);
 int mambo_free_scratch_regs(mambo_context *ctx, uint32_t regs);
 int mambo_free_scratch_reg(mambo_context *ctx, int reg);
+uint32_t mambo_get_dead_regs(mambo_context *ctx);
+bool mambo_are_flags_live(mambo_context *ctx);
 
 /* Syscalls */
+int mambo_syscall_subscribe(mambo_context *ctx, uintptr_t no);
 int mambo_syscall_get_no(mambo_context *ctx, uintptr_t *no);
 void mambo_syscall_get_args(mambo_context *ctx, uintptr_t **args);
 int mambo_syscall_bypass(mambo_context *ctx);
 int mambo_syscall_get_return(mambo_context *ctx, uintptr_t *ret);
 int mambo_syscall_set_return(mambo_context *ctx, uintptr_t ret);
 
+/* Detach */
+int mambo_detach(mambo_context *ctx);
+int mambo_detach_on_signal(mambo_context *ctx, int signo);
+
 /* VM-callback specific */
 vm_op_t mambo_get_vm_op(mambo_context *ctx);
 void *mambo_get_vm_addr(mambo_context *ctx);
@@ -188,6 +203,7 @@ cc_type mambo_get_fragment_type(mambo_context *ctx);
 int mambo_get_inst_len(mambo_context *ctx);
 void *mambo_get_source_addr(mambo_context *ctx);
 int mambo_set_source_addr(mambo_context *ctx, void *source_addr);
+void *mambo_get_source_addr_for_cc(mambo_context *ctx, void *cc_addr);
 void *mambo_get_cc_addr(mambo_context *ctx);
 void mambo_set_cc_addr(mambo_context *ctx, void *addr);
 int mambo_get_thread_id(mambo_context *ctx);
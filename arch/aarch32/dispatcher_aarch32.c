@@ -90,7 +90,7 @@ void dispatcher_aarch32(dbm_thread *thread_data, uint32_t source_index, branch_t
     #else
       branch_addr += 7;
       uint8_t *table = (uint8_t *)branch_addr;
-      if (thread_data->code_cache_meta[source_index].free_b == TB_CACHE_SIZE) {
+      if (thread_data->code_cache_meta_cold[source_index].free_b == TB_CACHE_SIZE) {
         // if the list of linked blocks is full, link this index to the inline hash lookup
       #ifdef DBM_D_INLINE_HASH
         table[thread_data->code_cache_meta[source_index].rn] = MAX_TB_INDEX / 2 + TB_CACHE_SIZE * 2 + 1;
@@ -99,7 +99,7 @@ void dispatcher_aarch32(dbm_thread *thread_data, uint32_t source_index, branch_t
       #endif
       } else {
         // allocate a branch slot and link it
-        cache_index = thread_data->code_cache_meta[source_index].free_b++;
+        cache_index = thread_data->code_cache_meta_cold[source_index].free_b++;
         table[thread_data->code_cache_meta[source_index].rn] = MAX_TB_INDEX / 2 + cache_index * 2;
         
         // insert the branch to the target BB
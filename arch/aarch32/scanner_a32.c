@@ -432,7 +432,7 @@ void arm_inline_hash_lookup(dbm_thread *thread_data, uint32_t **o_write_p, int b
   arm_copy_to_reg_32bit(&write_p, r_tmp, CODE_CACHE_HASH_SIZE);
 
   // MOVW+MOVT r6, hash_table
-  arm_copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address.entries);
+  arm_copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address->entries);
 
   // AND r_tmp, target, r_tmp
   arm_and(&write_p, REG_PROC, 0, r_tmp, target, r_tmp);
@@ -668,7 +668,7 @@ void thumb_inline_hash_lookup(dbm_thread *thread_data, uint16_t **o_write_p, int
   copy_to_reg_32bit(&write_p, r_tmp, CODE_CACHE_HASH_SIZE);
 
   // MOVW+MOVT r6, hash_table
-  copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address.entries);
+  copy_to_reg_32bit(&write_p, r6, (uint32_t)thread_data->entry_address->entries);
 
   // AND r_tmp, target, r_tmp
   thumb_and32(&write_p, 0, target, 0, r_tmp, 0, 0, r_tmp);
@@ -2647,6 +2647,8 @@ size_t scan_t32(dbm_thread *thread_data, uint16_t *read_address, int basic_block
           // At least two consecutive BBs are needed
           assert(thread_data->free_block == basic_block+1);
           /*basic_block = */thread_data->free_block++;
+          // not allocated by allocate_bb(), which resets the metadata
+          thread_data->code_cache_meta[basic_block + 1].actual_id = 0;
           data_p += BASIC_BLOCK_SIZE;
           thumb_check_free_space(thread_data, &write_p, &data_p, &it_state,
                                  true, 472, basic_block);
@@ -2654,7 +2656,7 @@ size_t scan_t32(dbm_thread *thread_data, uint16_t *read_address, int basic_block
           if (type == mambo_trace || type == mambo_trace_entry) {
   #endif
             thread_data->code_cache_meta[basic_block].rn = INT_MAX;
-            thread_data->code_cache_meta[basic_block].free_b = 0;
+            thread_data->code_cache_meta_cold[basic_block].free_b = 0;
 
   #ifdef FAST_BT
             thumb_cmpi32 (&write_p, 0, rm, 0, TB_CACHE_SIZE-1);
@@ -20,6 +20,7 @@
 */
 
 #include <stdio.h>
+#include <limits.h>
 
 #include "../../dbm.h"
 #include "../../scanner_common.h"
@@ -125,3 +126,109 @@ void dispatcher_aarch64(dbm_thread *thread_data, uint32_t source_index, branch_t
   #endif
   }
 }
+
+/* Stores the targets of the direct branch which ends a basic block and returns
+   their number, 0 if it doesn't end with a direct branch or if it's linked */
+int direct_exit_targets(dbm_code_cache_meta *bb_meta, uintptr_t *targets) {
+  if (bb_meta->branch_cache_status != 0) {
+    return 0;
+  }
+  switch (bb_meta->exit_branch_type) {
+  #ifdef DBM_LINK_UNCOND_IMM
+    case uncond_imm_a64:
+      targets[0] = bb_meta->branch_taken_addr;
+      return 1;
+  #endif
+    case cond_imm_a64:
+    case cbz_a64:
+    case tbz_a64:
+      targets[0] = bb_meta->branch_taken_addr;
+      targets[1] = bb_meta->branch_skipped_addr;
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+// Returns the address of the code translated for target, or 0 if there's none
+uintptr_t translated_block(dbm_thread *thread_data, uintptr_t target) {
+  uintptr_t block_address = cc_lookup(thread_data, target);
+  if (block_address == UINT_MAX) {
+    return 0;
+  }
+  if (is_bb(thread_data, block_address)) {
+    int basic_block = addr_to_bb_id(thread_data, block_address);
+    if (thread_data->code_cache_meta[basic_block].exit_branch_type == stub) {
+      return 0;
+    }
+  }
+  return block_address;
+}
+
+/* Links the direct branch exit of a basic block, which hasn't been executed
+   yet, to its translated targets, as if the dispatcher had been called for the
+   first of them. Subsequently translated targets are linked on first use. */
+void link_direct_exit(dbm_thread *thread_data, int basic_block) {
+  uintptr_t targets[2];
+
+  int count = direct_exit_targets(&thread_data->code_cache_meta[basic_block], targets);
+  for (int i = 0; i < count; i++) {
+    uintptr_t block_address = translated_block(thread_data, targets[i]);
+    if (block_address != 0) {
+      dispatcher_aarch64(thread_data, basic_block, thread_data->code_cache_meta[basic_block].exit_branch_type,
+                         targets[i], block_address);
+      return;
+    }
+  }
+}
+
+#ifdef DBM_PRETRANSLATE
+/* Translates the targets of the direct branches which end the new basic block
+   at block_address and of the blocks translated for them, breadth first, and
+   links the exits to them. The linked exits don't enter the dispatcher when
+   they're first taken. This code is translated before any thread executes it,
+   so plugins can see basic blocks which are never executed.
+
+   This runs synchronously, in the dispatcher of the thread which owns the code
+   cache. The code cache, hash table and scan state of a thread are only
+   written by that thread, and its inline hash lookups read the hash table
+   without locking, so they can't be written by a helper thread.
+
+   Nothing is translated when a flush could be needed. If one happens anyway,
+   thread_data->was_flushed is set and block_address is no longer valid. */
+void pretranslate_successors(dbm_thread *thread_data, uintptr_t block_address) {
+  int queue[PRETRANSLATE_MAX_BLOCKS + 1];
+  int depth[PRETRANSLATE_MAX_BLOCKS + 1];
+  int head = 0;
+  int tail = 0;
+
+  queue[tail] = addr_to_bb_id(thread_data, block_address);
+  depth[tail++] = 0;
+
+  while (head < tail) {
+    int basic_block = queue[head];
+    int level = depth[head++];
+    uintptr_t targets[2];
+
+    int count = direct_exit_targets(&thread_data->code_cache_meta[basic_block], targets);
+    for (int i = 0; i < count; i++) {
+      if (translated_block(thread_data, targets[i]) != 0 || level >= PRETRANSLATE_DEPTH
+          || tail > PRETRANSLATE_MAX_BLOCKS
+          || thread_data->free_block >= (CODE_CACHE_SIZE - 2 * CODE_CACHE_OVERP)) {
+        continue;
+      }
+
+      uintptr_t target_block = lookup_or_scan(thread_data, targets[i], NULL);
+      if (thread_data->was_flushed) {
+        return;
+      }
+      stats_inc(thread_data, STATS_PRETRANSLATIONS);
+      queue[tail] = addr_to_bb_id(thread_data, target_block);
+      depth[tail++] = level + 1;
+    }
+
+    // the scans above don't overwrite this block, which isn't a stub
+    link_direct_exit(thread_data, basic_block);
+  }
+}
+#endif
@@ -0,0 +1,634 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+#ifdef __aarch64__
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "../../dbm.h"
+#include "../../scanner_common.h"
+
+#include "../../pie/pie-a64-decoder.h"
+#include "../../pie/pie-a64-field-decoder.h"
+
+#define m(reg) (((reg) & 0x1F) == 31 ? 0 : (1 << (reg)))
+
+/*
+ * Returns true for the flag setting forms of the arithmetic and logical
+ * instructions: ADDS, SUBS, ADCS, SBCS, ANDS and BICS
+ */
+static bool a64_sets_flags(uint32_t *read_address, int inst)
+{
+  switch (inst)
+  {
+  case A64_ADD_SUB_IMMED:
+  case A64_ADD_SUB_EXT_REG:
+  case A64_ADD_SUB_SHIFT_REG:
+  case A64_ADC_SBC:
+    // S is bit 29
+    return (*read_address >> 29) & 1;
+
+  case A64_LOGICAL_IMMED:
+  case A64_LOGICAL_REG:
+    // opc is bits [30:29], 3 for ANDS and BICS
+    return ((*read_address >> 29) & 3) == 3;
+  }
+
+  return false;
+}
+
+/*
+ * Register usage of A64 instructions
+ * ======== ===== == === ============
+ *
+ * Sets the general purpose registers read and written by the instruction at
+ * read_address. X31 is never included, since it's either SP or XZR; its bit
+ * is used for the NZCV condition flags instead.
+ * The result must be conservative: when in doubt, a register is reported as
+ * read and not as written. Writes to W registers zero the top half of the X
+ * register, so they count as full definitions.
+ */
+void a64_reg_usage(uint32_t *read_address, int inst, uint32_t *o_reads, uint32_t *o_writes)
+{
+  uint32_t reads = 0, writes = 0;
+  uint32_t sf, op, opc, size, v, type, l, o0, o1, o2, imm, imm4, q, r, s, option;
+  uint32_t rd, rn, rm, ra, rt, rt2, rs;
+  uint32_t op1, crn, crm, op2;
+
+  switch (inst)
+  {
+  case A64_CBZ_CBNZ:
+    a64_CBZ_CBNZ_decode_fields(read_address, &sf, &op, &imm, &rt);
+    reads = m(rt);
+    break;
+
+  case A64_TBZ_TBNZ:
+    a64_TBZ_TBNZ_decode_fields(read_address, &sf, &op, &imm, &imm4, &rt);
+    reads = m(rt);
+    break;
+
+  case A64_B_COND:
+  case A64_FCSEL:
+  // CFINV, XAFLAG and AXFLAG are encoded as MSR (immediate)
+  case A64_MSR_IMMED:
+    reads = A64_NZCV;
+    break;
+
+  case A64_CLREX:
+  case A64_DSB:
+  case A64_DMB:
+  case A64_ISB:
+  case A64_SB:
+    break;
+
+  case A64_HINT:
+    // The PAC instructions in the hint space use X16, X17 and X30
+    reads = m(x16) | m(x17) | m(x30);
+    break;
+
+  case A64_SYS:
+    a64_SYS_decode_fields(read_address, &op1, &crn, &crm, &op2, &rt);
+    reads = m(rt);
+    break;
+
+  case A64_SYSL:
+    a64_SYSL_decode_fields(read_address, &op1, &crn, &crm, &op2, &rt);
+    writes = m(rt);
+    break;
+
+  case A64_MRS_MSR_REG:
+    a64_MRS_MSR_reg_decode_fields(read_address, &r, &o0, &op1, &crn, &crm, &op2, &rt);
+    if (r)
+    { // MRS
+      writes = m(rt);
+    }
+    else
+    {
+      reads = m(rt);
+    }
+    // NZCV: op0 = 3, op1 = 3, CRn = 4, CRm = 2, op2 = 0
+    if (o0 == 1 && op1 == 3 && crn == 4 && crm == 2 && op2 == 0)
+    {
+      if (r)
+      {
+        reads |= A64_NZCV;
+      }
+      else
+      {
+        writes |= A64_NZCV;
+      }
+    }
+    break;
+
+  case A64_B_BL:
+    a64_B_BL_decode_fields(read_address, &op, &imm);
+    if (op)
+    {
+      writes = m(lr);
+    }
+    break;
+
+  case A64_BR:
+  case A64_RET:
+  case A64_BLR:
+    // rn is bits [9:5] in all three encodings
+    rn = (*read_address >> 5) & 0x1F;
+    reads = m(rn);
+    if (inst == A64_BLR)
+    {
+      writes = m(lr);
+    }
+    break;
+
+  case A64_BRA:
+  case A64_BLRA:
+    // rm is the modifier, XZR for the zero modifier forms
+    a64_BRA_decode_fields(read_address, &op, &s, &rn, &rm);
+    reads = m(rn) | m(rm);
+    if (inst == A64_BLRA)
+    {
+      writes = m(lr);
+    }
+    break;
+
+  case A64_RETA:
+    reads = m(lr);
+    break;
+
+  case A64_LDX_STX:
+    a64_LDX_STX_decode_fields(read_address, &size, &o2, &l, &o1, &rs, &o0, &rt2, &rn, &rt);
+    reads = m(rn);
+    if (o2 == 0 && (o1 == 0 || size >= 2))
+    { // exclusive load / store (pair)
+      if (l)
+      {
+        writes = m(rt) | ((o1) ? m(rt2) : 0);
+      }
+      else
+      {
+        reads |= m(rt) | ((o1) ? m(rt2) : 0);
+        writes = m(rs);
+      }
+    }
+    else if (o2 == 1 && o1 == 0)
+    { // load-acquire / store-release
+      if (l)
+      {
+        writes = m(rt);
+      }
+      else
+      {
+        reads |= m(rt);
+      }
+    }
+    else
+    { // compare and swap (pair)
+      reads |= m(rs) | m(rt) | m(rt2);
+      if (rs < x30) reads |= m(rs + 1);
+      if (rt < x30) reads |= m(rt + 1);
+    }
+    break;
+
+  case A64_ATOMIC_MEMORY:
+    a64_atomic_memory_decode_fields(read_address, &size, &v, &o0, &r, &rs, &o1, &opc, &rn, &rt);
+    // rs is XZR for LDAPR and rt is XZR for the ST<op> aliases
+    reads = m(rn) | m(rs);
+    writes = m(rt);
+    break;
+
+  case A64_LDAPR_STLR_UNSCALED:
+    a64_LDAPR_STLR_unscaled_decode_fields(read_address, &size, &opc, &imm, &rn, &rt);
+    reads = m(rn);
+    if (opc == 0)
+    { // STLUR
+      reads |= m(rt);
+    }
+    else
+    {
+      writes = m(rt);
+    }
+    break;
+
+  case A64_LDRA:
+    a64_LDRA_decode_fields(read_address, &op, &s, &imm, &type, &rn, &rt);
+    reads = m(rn);
+    writes = m(rt);
+    if (type)
+    { // pre-index
+      writes |= m(rn);
+    }
+    break;
+
+  case A64_LD_ST_TAGS:
+    // LDG merges the tag into rt, the write-back forms aren't tracked
+    a64_ld_st_tags_decode_fields(read_address, &opc, &imm, &op2, &rn, &rt);
+    reads = m(rn) | m(rt);
+    break;
+
+  case A64_LDR_LIT:
+    a64_LDR_lit_decode_fields(read_address, &opc, &v, &imm, &rt);
+    // !PRFM
+    if (v == 0 && opc != 3)
+    {
+      writes = m(rt);
+    }
+    break;
+
+  case A64_LDP_STP:
+    a64_LDP_STP_decode_fields(read_address, &opc, &v, &type, &l, &imm, &rt2, &rn, &rt);
+    reads = m(rn);
+    if (type == 1 || type == 3)
+    { // post-index or pre-index
+      writes = m(rn);
+    }
+    if (v == 0)
+    {
+      if (l)
+      {
+        writes |= m(rt) | m(rt2);
+      }
+      else
+      {
+        reads |= m(rt) | m(rt2);
+      }
+    }
+    break;
+
+  case A64_LDR_STR_IMMED:
+  case A64_LDR_STR_REG:
+  case A64_LDR_STR_UNSIGNED_IMMED:
+    // The size, v, opc, rn and rt fields are identical between the three encodings
+    a64_LDR_STR_unsigned_immed_decode_fields(read_address, &size, &v, &opc, &imm, &rn, &rt);
+    reads = m(rn);
+    if (inst == A64_LDR_STR_REG)
+    {
+      a64_LDR_STR_reg_decode_fields(read_address, &size, &v, &opc, &rm, &option, &s, &rn, &rt);
+      reads |= m(rm);
+    }
+    else if (inst == A64_LDR_STR_IMMED)
+    {
+      a64_LDR_STR_immed_decode_fields(read_address, &size, &v, &opc, &imm, &type, &rn, &rt);
+      if (type == 1 || type == 3)
+      { // post-index or pre-index
+        writes = m(rn);
+      }
+    }
+    if (v == 0)
+    {
+      if (opc == 0)
+      {
+        reads |= m(rt);
+      }
+      else if (!(size == 3 && opc == 2))
+      { // !PRFM
+        writes |= m(rt);
+      }
+    }
+    break;
+
+  case A64_LDX_STX_MULTIPLE:
+  case A64_LDX_STX_SINGLE:
+    // rn is bits [9:5] in both encodings
+    rn = (*read_address >> 5) & 0x1F;
+    reads = m(rn);
+    break;
+
+  case A64_LDX_STX_MULTIPLE_POST:
+    a64_LDx_STx_multiple_post_decode_fields(read_address, &q, &l, &rm, &opc, &size, &rn, &rt);
+    reads = m(rn) | m(rm);
+    writes = m(rn);
+    break;
+
+  case A64_LDX_STX_SINGLE_POST:
+    a64_LDx_STx_single_post_decode_fields(read_address, &q, &l, &r, &rm, &opc, &s, &size, &rn, &rt);
+    reads = m(rn) | m(rm);
+    writes = m(rn);
+    break;
+
+  case A64_ADD_SUB_IMMED:
+  case A64_LOGICAL_IMMED:
+    // rn is bits [9:5] and rd is bits [4:0] in both encodings
+    rn = (*read_address >> 5) & 0x1F;
+    rd = *read_address & 0x1F;
+    reads = m(rn);
+    writes = m(rd);
+    writes |= a64_sets_flags(read_address, inst) ? A64_NZCV : 0;
+    break;
+
+  case A64_BFM:
+    a64_BFM_decode_fields(read_address, &sf, &opc, &op, &imm, &imm4, &rn, &rd);
+    reads = m(rn);
+    if (opc == 1)
+    { // BFM inserts into the existing value of rd
+      reads |= m(rd);
+    }
+    writes = m(rd);
+    break;
+
+  case A64_MOV_WIDE:
+    a64_MOV_wide_decode_fields(read_address, &sf, &opc, &op, &imm, &rd);
+    if (opc == 3)
+    { // MOVK
+      reads = m(rd);
+    }
+    writes = m(rd);
+    break;
+
+  case A64_ADR:
+    a64_ADR_decode_fields(read_address, &op, &imm, &imm4, &rd);
+    writes = m(rd);
+    break;
+
+  case A64_EXTR:
+  case A64_ADD_SUB_EXT_REG:
+  case A64_ADD_SUB_SHIFT_REG:
+  case A64_ADC_SBC:
+  case A64_COND_SELECT:
+  case A64_DATA_PROC_REG2:
+  case A64_LOGICAL_REG:
+    // rm is bits [20:16], rn is bits [9:5] and rd is bits [4:0] in all these encodings
+    rm = (*read_address >> 16) & 0x1F;
+    rn = (*read_address >> 5) & 0x1F;
+    rd = *read_address & 0x1F;
+    reads = m(rn) | m(rm);
+    writes = m(rd);
+    writes |= a64_sets_flags(read_address, inst) ? A64_NZCV : 0;
+    if (inst == A64_ADC_SBC || inst == A64_COND_SELECT)
+    {
+      reads |= A64_NZCV;
+    }
+    break;
+
+  case A64_DATA_PROC_REG1:
+    a64_data_proc_reg1_decode_fields(read_address, &sf, &opc, &rn, &rd);
+    reads = m(rn);
+    writes = m(rd);
+    break;
+
+  case A64_POINTER_AUTH:
+    // PAC*, AUT* and XPAC* modify rd in place, rn is the modifier
+    a64_pointer_auth_decode_fields(read_address, &opc, &rn, &rd);
+    reads = m(rn) | m(rd);
+    writes = m(rd);
+    break;
+
+  case A64_ADDG_SUBG:
+    a64_ADDG_SUBG_decode_fields(read_address, &op, &imm, &imm4, &rn, &rd);
+    reads = m(rn);
+    writes = m(rd);
+    break;
+
+  case A64_RMIF:
+  case A64_SETF:
+    // rn is bits [9:5] in both encodings, the flags are partially updated
+    rn = (*read_address >> 5) & 0x1F;
+    reads = m(rn) | A64_NZCV;
+    writes = A64_NZCV;
+    break;
+
+  case A64_DATA_PROC_REG3:
+    a64_data_proc_reg3_decode_fields(read_address, &sf, &op, &rm, &o0, &ra, &rn, &rd);
+    reads = m(rn) | m(rm) | m(ra);
+    writes = m(rd);
+    break;
+
+  case A64_CCMP_CCMN_IMMED:
+    a64_CCMP_CCMN_immed_decode_fields(read_address, &sf, &op, &imm, &imm4, &rn, &s);
+    reads = m(rn) | A64_NZCV;
+    writes = A64_NZCV;
+    break;
+
+  case A64_CCMP_CCMN_REG:
+    a64_CCMP_CCMN_reg_decode_fields(read_address, &sf, &op, &rm, &imm4, &rn, &s);
+    reads = m(rn) | m(rm) | A64_NZCV;
+    writes = A64_NZCV;
+    break;
+
+  case A64_SIMD_COPY:
+    a64_simd_copy_decode_fields(read_address, &q, &op, &imm, &imm4, &rn, &rd);
+    if (op == 0 && (imm4 == 1 || imm4 == 3))
+    { // DUP (general), INS (general)
+      reads = m(rn);
+    }
+    else if (op == 0 && (imm4 == 5 || imm4 == 7))
+    { // SMOV, UMOV
+      writes = m(rd);
+    }
+    break;
+
+  case A64_FLOAT_CVT_INT:
+    a64_float_cvt_int_decode_fields(read_address, &sf, &type, &r, &opc, &rn, &rd);
+    // SCVTF, UCVTF and FMOV from a general purpose register
+    if (opc == 2 || opc == 3 || opc == 7)
+    {
+      reads = m(rn);
+    }
+    else
+    {
+      writes = m(rd);
+    }
+    break;
+
+  case A64_FLOAT_CVT_FIXED:
+    a64_float_cvt_fixed_decode_fields(read_address, &sf, &type, &r, &opc, &imm, &rn, &rd);
+    if (opc == 2 || opc == 3)
+    { // SCVTF, UCVTF
+      reads = m(rn);
+    }
+    else
+    {
+      writes = m(rd);
+    }
+    break;
+
+  case A64_SIMD_ACROSS_LANE:
+  case A64_SIMD_EXTRACT:
+  case A64_SIMD_MODIFIED_IMMED:
+  case A64_SIMD_PERMUTE:
+  case A64_SIMD_SCALAR_COPY:
+  case A64_SIMD_SCALAR_PAIRWISE:
+  case A64_SIMD_SCALAR_SHIFT_IMMED:
+  case A64_SIMD_SCALAR_THREE_DIFF:
+  case A64_SIMD_SCALAR_THREE_SAME:
+  case A64_SIMD_SCALAR_TWO_REG:
+  case A64_SIMD_SCALAR_X_INDEXED:
+  case A64_SIMD_SHIFT_IMMED:
+  case A64_SIMD_TABLE_LOOKUP:
+  case A64_SIMD_THREE_DIFF:
+  case A64_SIMD_THREE_SAME:
+  case A64_SIMD_TWO_REG:
+  case A64_SIMD_X_INDEXED:
+  case A64_SIMD_THREE_SAME_EXTRA:
+  case A64_SIMD_THREE_SAME_FP16:
+  case A64_SIMD_TWO_REG_FP16:
+  case A64_SIMD_SCALAR_THREE_SAME_EXTRA:
+  case A64_SIMD_SCALAR_THREE_SAME_FP16:
+  case A64_SIMD_SCALAR_TWO_REG_FP16:
+  case A64_CRYPTO_AES:
+  case A64_CRYPTO_SHA_REG3:
+  case A64_CRYPTO_SHA_REG2:
+  case A64_CRYPTO_REG4:
+  case A64_CRYPTO_SHA512_REG3:
+  case A64_CRYPTO_SHA512_REG2:
+  case A64_CRYPTO_SM3_IMM2:
+  case A64_CRYPTO_XAR:
+  case A64_FLOAT_REG1:
+  case A64_FLOAT_REG2:
+  case A64_FLOAT_REG3:
+  case A64_FMOV_IMMED:
+    break;
+
+  case A64_FCMP:
+    writes = A64_NZCV;
+    break;
+
+  case A64_FCCMP:
+    reads = A64_NZCV;
+    writes = A64_NZCV;
+    break;
+
+  /* SVC and the other exception generating instructions expose all the
+     registers to MAMBO's syscall handling, signal handlers or a debugger.
+     SVE instructions can use any register as a base, index or count. */
+  default:
+    reads = A64_ALL_REGS | A64_NZCV;
+    break;
+  }
+
+  *o_reads = reads;
+  *o_writes = writes;
+}
+
+/*
+ * Backward register liveness analysis over the basic block starting at
+ * read_address. The analysis stops after the first branch, the first
+ * unknown instruction or after A64_LIVENESS_MAX_INSTS instructions. All
+ * registers are assumed to be live at the end of the analysed range.
+ */
+void a64_liveness(uint32_t *read_address, a64_liveness_t *liveness)
+{
+  uint32_t reads[A64_LIVENESS_MAX_INSTS];
+  uint32_t writes[A64_LIVENESS_MAX_INSTS];
+  bool stop = false;
+  int count = 0;
+
+  liveness->start = read_address;
+
+  while (!stop && count < A64_LIVENESS_MAX_INSTS)
+  {
+    a64_instruction inst = a64_decode(read_address);
+    a64_reg_usage(read_address, inst, &reads[count], &writes[count]);
+
+    switch (inst)
+    {
+    case A64_CBZ_CBNZ:
+    case A64_B_COND:
+    case A64_TBZ_TBNZ:
+    case A64_B_BL:
+    case A64_BR:
+    case A64_BLR:
+    case A64_RET:
+    case A64_BRA:
+    case A64_BLRA:
+    case A64_RETA:
+    case A64_INVALID:
+      stop = true;
+      break;
+    }
+
+    read_address++;
+    count++;
+  }
+
+  liveness->count = count;
+  liveness->live[count] = A64_ALL_REGS | A64_NZCV;
+  for (int i = count - 1; i >= 0; i--)
+  {
+    liveness->live[i] = reads[i] | (liveness->live[i + 1] & ~writes[i]);
+  }
+}
+
+/*
+ * Returns the registers which are dead immediately before the instruction at
+ * address. Registers which are not tracked, or addresses outside the analysed
+ * range, are reported as live.
+ */
+uint32_t a64_dead_regs(a64_liveness_t *liveness, uint32_t *address)
+{
+  if (liveness == NULL || address < liveness->start)
+  {
+    return 0;
+  }
+
+  int index = address - liveness->start;
+  if (index > liveness->count)
+  {
+    return 0;
+  }
+
+  return ~liveness->live[index] & A64_ALL_REGS;
+}
+
+/*
+ * Returns true if the instruction is a load or store which doesn't access
+ * SP or any of the registers in regs. These can execute between a pop and a
+ * push of regs which have been merged, see emit_a64_push().
+ */
+bool a64_is_independent_ld_st(uint32_t *read_address, int inst, uint32_t regs)
+{
+  uint32_t reads, writes;
+
+  switch (inst)
+  {
+  case A64_LDR_STR_IMMED:
+  case A64_LDR_STR_REG:
+  case A64_LDR_STR_UNSIGNED_IMMED:
+  case A64_LDP_STP:
+    // rn is bits [9:5] in all these encodings
+    if (((*read_address >> 5) & 0x1F) == sp)
+    {
+      return false;
+    }
+    a64_reg_usage(read_address, inst, &reads, &writes);
+    return ((reads | writes) & regs) == 0;
+  }
+
+  return false;
+}
+
+/*
+ * Returns true if the NZCV flags may be read before being overwritten,
+ * starting from the instruction at address.
+ */
+bool a64_is_nzcv_live(a64_liveness_t *liveness, uint32_t *address)
+{
+  if (liveness == NULL || address < liveness->start)
+  {
+    return true;
+  }
+
+  int index = address - liveness->start;
+  if (index > liveness->count)
+  {
+    return true;
+  }
+
+  return (liveness->live[index] & A64_NZCV) != 0;
+}
+
+#endif // __aarch64__
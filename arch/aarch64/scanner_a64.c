@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "../../dbm.h"
 #include "../../scanner_common.h"
@@ -35,6 +36,21 @@
 
 #define NOP_INSTRUCTION 0xD503201F
 #define MIN_FSPACE 60
+#ifdef DBM_SIGNAL_POLL
+  #define SIGNAL_POLL_SIZE 44
+  #define IHL_POLL_SIZE 24
+#else
+  #define IHL_POLL_SIZE 0
+#endif
+// the maximum size of the out-of-line miss paths of an inline hash lookup
+#define IHL_STUB_SIZE 40
+#ifdef DBM_INLINE_SYSCALLS
+  #ifdef DBM_STATS
+    #define INLINE_SYSCALL_SIZE (68 + 28)
+  #else
+    #define INLINE_SYSCALL_SIZE 68
+  #endif
+#endif
 
 // #define DEBUG
 #ifdef DEBUG
@@ -363,10 +379,171 @@ void a64_check_free_space(dbm_thread *thread_data, uint32_t **write_p,
       *write_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
     }
     *data_p = (uint32_t *)&thread_data->code_cache->blocks[basic_block];
+    pc_map_continue(thread_data, cur_block, (uintptr_t)*data_p);
     *data_p += BASIC_BLOCK_SIZE;
   }
 }
 
+#ifdef DBM_SIGNAL_POLL
+/*
+ * Loads the thread's signal pending counter, which is kept in the code cache:
+ *
+ *   ADRP reg, is_pending
+ *   LDR  Wreg, [reg, #:lo12:is_pending]
+ */
+static void a64_load_signal_pending(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t reg)
+{
+  uint32_t *write_p = *o_write_p;
+  uint64_t flag = (uint64_t)signal_pending_flag(thread_data);
+  int64_t pages = (int64_t)(flag >> 12) - (int64_t)((uint64_t)write_p >> 12);
+
+  a64_ADR(&write_p, 1, pages & 3, (pages >> 2) & 0x7FFFF, reg);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 2, 0, 1, (flag & 0xFFF) >> 2, reg, reg);
+  write_p++;
+
+  *o_write_p = write_p;
+}
+
+/*
+ * Any loop in linked code contains either an indirect branch or a direct
+ * branch to an address lower than or equal to the start of its own fragment.
+ * The latter check for pending signals before exiting the fragment. If a
+ * signal is pending, the branch instruction is executed from a new fragment
+ * entered through the dispatcher, which delivers the signal.
+ *
+ *           STP  X0, X1, [SP, #-16]!
+ *           ADRP X0, is_pending
+ *           LDR  W0, [X0, #:lo12:is_pending]
+ *           CBZ  W0, resume
+ *           MOV  X0, read_address
+ *           MOV  X1, #0
+ *           B    dispatcher
+ *   resume: LDP  X0, X1, [SP], #16
+ */
+static void a64_poll_signals(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t **data_p,
+                             int basic_block, uint32_t *read_address, uint64_t target,
+                             uint32_t *fragment_start)
+{
+  uint32_t *write_p;
+  uint32_t *cbz_branch;
+
+  if (target > (uint64_t)fragment_start)
+  {
+    return;
+  }
+
+  a64_check_free_space(thread_data, o_write_p, data_p, SIGNAL_POLL_SIZE + MIN_FSPACE, basic_block);
+  write_p = *o_write_p;
+
+  a64_push_pair_reg(x0, x1);
+  a64_load_signal_pending(thread_data, &write_p, x0);
+  cbz_branch = write_p++;
+
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)read_address);
+  // source fragment 0, the branch isn't linked
+  a64_copy_to_reg_64bits(&write_p, x1, 0);
+  a64_b_helper(write_p, thread_data->dispatcher_addr);
+  write_p++;
+
+  a64_cbz_helper(cbz_branch, (uint64_t)write_p, 0, x0);
+  a64_pop_pair_reg(x0, x1);
+
+  *o_write_p = write_p;
+}
+
+static uint64_t a64_cbz_tbz_target(uint32_t *read_address, a64_instruction inst)
+{
+  uint32_t sf, op, b5, b40, imm, rt;
+
+  if (inst == A64_CBZ_CBNZ)
+  {
+    a64_CBZ_CBNZ_decode_fields(read_address, &sf, &op, &imm, &rt);
+    return (uint64_t)read_address + (sign_extend64(19, imm) << 2);
+  }
+
+  a64_TBZ_TBNZ_decode_fields(read_address, &b5, &op, &b40, &imm, &rt);
+  return (uint64_t)read_address + (sign_extend64(14, imm) << 2);
+}
+#endif
+
+#ifdef DBM_INLINE_SYSCALLS
+/*
+ * Syscalls which aren't set in global_data.syscall_filter are executed
+ * directly from the code cache, the others go through the syscall wrapper.
+ * This emits the code up to the wrapper call, the caller patches the two
+ * branches to it and the branch over it:
+ *
+ *            STP  X0, X1, [SP, #-16]!
+ *            MOV  X0, #syscall_filter
+ *            LSR  X1, X8, #SYSCALL_FILTER_SHIFT
+ *            CBNZ X1, wrapper
+ *            LSR  X1, X8, #5
+ *            LDR  W0, [X0, X1, LSL #2]
+ *            LSR  W0, W0, W8
+ *            TBNZ W0, #0, wrapper
+ *            MOV  X0, #&stats[STATS_SYSCALLS]   **
+ *            LDR  X1, [X0]                     **
+ *            ADD  X1, X1, #1                   **
+ *            STR  X1, [X0]                     **
+ *            LDP  X0, X1, [SP], #16
+ *            SVC  #imm
+ *            B    done
+ *            .quad read_address + 4
+ *   wrapper: LDP  X0, X1, [SP], #16
+ *            <syscall wrapper call>
+ *   done:
+ *
+ * ** with DBM_STATS, syscall_handler_pre() counts the others
+ *
+ * The address following the SVC is used by the signal handler to deliver
+ * signals which interrupt the syscall, see inline_syscall_spc().
+ * The condition flags aren't modified.
+ */
+static void a64_inline_syscall(dbm_thread *thread_data, uint32_t **o_write_p, uint32_t *read_address,
+                               uint32_t **wrapper_branches, uint32_t **done_branch)
+{
+  uint32_t *write_p = *o_write_p;
+
+  a64_push_pair_reg(x0, x1);
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)global_data.syscall_filter);
+
+  // UBFM X1, X8, #SYSCALL_FILTER_SHIFT, #63
+  a64_BFM(&write_p, 1, 2, 1, SYSCALL_FILTER_SHIFT, 63, x8, x1);
+  write_p++;
+  wrapper_branches[0] = write_p++;
+
+  // UBFM X1, X8, #5, #63
+  a64_BFM(&write_p, 1, 2, 1, 5, 63, x8, x1);
+  write_p++;
+  a64_LDR_STR_reg(&write_p, 2, 0, 1, x1, 3, 1, x0, x0);
+  write_p++;
+  // LSRV W0, W0, W8
+  a64_data_proc_reg2(&write_p, 0, x8, 9, x0, x0);
+  write_p++;
+  wrapper_branches[1] = write_p++;
+
+#ifdef DBM_STATS
+  a64_copy_to_reg_64bits(&write_p, x0, (uint64_t)&thread_data->stats[STATS_SYSCALLS]);
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 1, 0, x0, x1);
+  write_p++;
+  a64_ADD_SUB_immed(&write_p, 1, 0, 0, 0, 1, x1, x1);
+  write_p++;
+  a64_LDR_STR_unsigned_immed(&write_p, 3, 0, 0, 0, x0, x1);
+  write_p++;
+#endif
+
+  a64_pop_pair_reg(x0, x1);
+  a64_copy();
+  *done_branch = write_p++;
+
+  *(uint64_t *)write_p = (uint64_t)read_address + 4;
+  write_p += 2;
+
+  *o_write_p = write_p;
+}
+#endif
+
 void pass1_a64(uint32_t *read_address, branch_type *bb_type)
 {
 
@@ -393,6 +570,9 @@ void pass1_a64(uint32_t *read_address, branch_type *bb_type)
     case A64_BR:
     case A64_BLR:
     case A64_RET:
+    case A64_BRA:
+    case A64_BLRA:
+    case A64_RETA:
       *bb_type = uncond_branch_reg;
       break;
     case A64_INVALID:
@@ -404,7 +584,8 @@ void pass1_a64(uint32_t *read_address, branch_type *bb_type)
 
 bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id, uint32_t **o_read_address,
                                    a64_instruction inst, uint32_t **o_write_p, uint32_t **o_data_p,
-                                   int basic_block, cc_type type, bool allow_write, bool *stop)
+                                   int basic_block, cc_type type, bool allow_write, bool *stop,
+                                   a64_liveness_t *liveness)
 {
   bool replaced = false;
 #ifdef PLUGINS_NEW
@@ -424,6 +605,11 @@ bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
     mambo_context ctx;
     set_mambo_context_code(&ctx, thread_data, cb_id, type, basic_block, A64_INST, inst, cond, read_address, write_p, data_p, stop);
 
+    // code inserted after an instruction runs before the next one
+    uint32_t *liveness_address = (cb_id == POST_INST_C) ? read_address + 1 : read_address;
+    ctx.code.dead_regs = allow_write ? a64_dead_regs(liveness, liveness_address) : 0;
+    ctx.code.flags_live = allow_write ? a64_is_nzcv_live(liveness, liveness_address) : true;
+
     for (int i = 0; i < global_data.free_plugin; i++)
     {
       if (global_data.plugins[i].cbs[cb_id] != NULL)
@@ -432,7 +618,7 @@ bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
         ctx.code.data_p = data_p;
         ctx.plugin_id = i;
         ctx.code.replace = false;
-        ctx.code.available_regs = ctx.code.pushed_regs;
+        ctx.code.available_regs = ctx.code.pushed_regs | ctx.code.dead_regs;
         global_data.plugins[i].cbs[cb_id](&ctx);
         if (allow_write)
         {
@@ -459,6 +645,7 @@ bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
           if (allow_write && ctx.code.pushed_regs)
           {
             emit_pop(&ctx, ctx.code.pushed_regs);
+            ctx.code.pushed_regs = 0;
           }
           write_p = ctx.code.write_p;
           data_p = ctx.code.data_p;
@@ -499,8 +686,95 @@ bool a64_scanner_deliver_callbacks(dbm_thread *thread_data, mambo_cb_idx cb_id,
   return replaced;
 }
 
+/*
+ * Pointer Authenticated Branches
+ * ======= ============= ========
+ *
+ * BRAA, BRAB, BLRAA, BLRAB, RETAA, RETAB and their zero modifier forms
+ * authenticate the signed target address before branching, without modifying
+ * the target register. They are translated to a copy of the target into a
+ * scratch register which has already been spilled by the inline hash lookup
+ * or dispatcher exit, an AUTIA / AUTIB / AUTIZA / AUTIZB of the copy and the
+ * translation of the equivalent BR, BLR or RET using the authenticated copy:
+ *
+ *     BRAA Xn, Xm   ==>  STP  X0, X1, [SP, #-16]!
+ *                        MOV  X0, Xn
+ *                        AUTIA X0, Xm
+ *                        (dispatcher exit with the target in X0)
+ *
+ * Xn keeps the signed pointer, e.g. for BLRAA X19, X20 in a loop. When the
+ * modifier is SP, it's recomputed in tmp from the SP lowered by the spills.
+ * An authentication failure faults on FEAT_FPAC CPUs, same as the native
+ * branch; otherwise the corrupted address reaches the dispatcher and the fault
+ * is raised when trying to scan it.
+ *
+ * dst and tmp must have been saved on the stack, sp_offset bytes below the
+ * application's SP, and must still hold their application values.
+ */
+static void a64_pac_branch_auth(uint32_t **o_write_p, uint32_t *read_address,
+                                enum reg dst, enum reg tmp, uint32_t sp_offset)
+{
+  uint32_t *write_p = *o_write_p;
+  uint32_t p = 1, m, rn, rm = 31;
+  // AUTIA is 0b000100, AUTIB 0b000101, AUTIZA 0b001100, AUTIZB 0b001101
+  uint32_t opcode = 0x4;
+  uint32_t target;
+
+  if (a64_decode(read_address) == A64_RETA)
+  {
+    // RETAA / RETAB use LR as the target and SP as the modifier
+    a64_RETA_decode_fields(read_address, &m);
+    rn = lr;
+  }
+  else
+  {
+    // BRA and BLRA have identical fields, Rm is SP when 31
+    a64_BRA_decode_fields(read_address, &p, &m, &rn, &rm);
+  }
+
+  // AUT overwrites its operand, authenticate in tmp if the modifier is dst
+  target = (p && rm == dst) ? tmp : dst;
+
+  if (rn != target)
+  {
+    // MOV target, rn
+    a64_logical_reg(&write_p, 1, 1, 0, 0, rn, 0, xzr, target);
+    write_p++;
+  }
+
+  if (!p)
+  {
+    opcode |= 0x8;
+    a64_pointer_auth(&write_p, opcode | m, x31, target);
+    write_p++;
+  }
+  else if (rm == 31)
+  {
+    // ADD tmp, SP, #sp_offset
+    a64_ADD_SUB_immed(&write_p, 1, 0, 0, 0, sp_offset, sp, tmp);
+    write_p++;
+    a64_pointer_auth(&write_p, opcode | m, tmp, target);
+    write_p++;
+  }
+  else
+  {
+    a64_pointer_auth(&write_p, opcode | m, rm, target);
+    write_p++;
+  }
+
+  if (target != dst)
+  {
+    // MOV dst, target
+    a64_logical_reg(&write_p, 1, 1, 0, 0, target, 0, xzr, dst);
+    write_p++;
+  }
+
+  *o_write_p = write_p;
+}
+
 void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p,
-                            uint32_t *read_address, enum reg rn, bool link, bool set_meta)
+                            uint32_t *read_address, enum reg rn, bool link, bool set_meta,
+                            bool pac, uint32_t **o_stub_p)
 {
   /*
    * Indirect Branch LookUp
@@ -509,6 +783,7 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
    *                 STP  X0, X1, [SP, #-16]!
    *                 STP  X2, [SP, #-16]!        **
    *                 MOV  X1, rn                 ** rn = X1
+   *                 AUT  X1, modifier           $$
    *                 MOV  LR, read_address + 4   ##
    *                 MOV  X0, #hash_table
    *                 AND  Xtmp, rn, #(hash_mask << 2)
@@ -519,25 +794,40 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
    *                 SUB  Xtmp, Xtmp, rn
    *                 CBNZ Xtmp, loop
    *                 LDR  X0, [X0,  #-8]
+   *                 ADRP Xtmp, is_pending        !!
+   *                 LDR  Wtmp, [Xtmp, #lo12]     !!
+   *                 CBNZ Wtmp, pending           !!
    *                 LDR  X2, [SP], #16           **
    *                 BR   X0
-   *     not_found:
+   *     not_found:                               %%
    *                 MOV  X0, rn
    *                 MOV  X1, #bb
    *                 LDR  X2, [SP], #16           **
    *                 B    dispatcher
+   *     pending:                                 !!
+   *                 MOV  X1, rn                  !!
+   *                 LDR  X2, [SP], #16           ** !!
+   *                 B    checked_cc_return       !!
    *
-   * ** if rn is X0, X1 or (BLR LR)
+   * ** if rn is X0, X1, (BLR LR) or for a PAC branch
+   * $$ for a PAC branch at read_address, see a64_pac_branch_auth
    * ## for BLR
+   * !! with DBM_SIGNAL_POLL
+   * %% if o_stub_p isn't NULL, the miss paths are placed out of line, in the
+   *    IHL_STUB_SIZE bytes below *o_stub_p, which is lowered accordingly
    */
 
   uint32_t *write_p = *o_write_p;
+  uint32_t *hit_end;
   uint32_t *loop;
   uint32_t *branch_to_not_found;
+#ifdef DBM_SIGNAL_POLL
+  uint32_t *branch_to_pending;
+#endif
   uint32_t reg_spc, reg_tmp;
   bool use_x2 = false;
 
-  if ((rn == x0) || (rn == x1) || (link && rn == lr))
+  if ((rn == x0) || (rn == x1) || (link && rn == lr) || pac)
   {
     reg_spc = x1;
     reg_tmp = x2;
@@ -559,7 +849,11 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   if (use_x2)
   {
     a64_push_reg(x2);
-    if (rn != reg_spc)
+    if (pac)
+    {
+      a64_pac_branch_auth(&write_p, read_address, reg_spc, reg_tmp, 32);
+    }
+    else if (rn != reg_spc)
     {
       a64_logical_reg(&write_p, 1, 1, 0, 0, rn, 0, xzr, reg_spc);
       write_p++;
@@ -573,9 +867,10 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   }
 
   a64_copy_to_reg_64bits(&write_p, x0,
-                         (uint64_t)&thread_data->entry_address.entries);
+                         (uint64_t)&thread_data->entry_address->entries);
 
-  a64_logical_immed(&write_p, 1, 0, 1, 62, 18, reg_spc, reg_tmp);
+  // reg_tmp = (reg_spc >> 2 & CODE_CACHE_HASH_SIZE) << 2
+  a64_logical_immed(&write_p, 1, 0, 1, 62, CODE_CACHE_HASH_BITS - 1, reg_spc, reg_tmp);
   write_p++;
 
   a64_ADD_SUB_shift_reg(&write_p, 1, 0, 0, 0, reg_tmp, 0x2, x0, x0);
@@ -596,6 +891,11 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   a64_LDR_STR_immed(&write_p, 3, 0, 1, -8, 0, x0, x0);
   write_p++;
 
+#ifdef DBM_SIGNAL_POLL
+  a64_load_signal_pending(thread_data, &write_p, reg_tmp);
+  branch_to_pending = write_p++;
+#endif
+
   if (use_x2)
   {
     a64_pop_reg(x2);
@@ -604,6 +904,13 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   a64_BR(&write_p, x0);
   write_p++;
 
+  hit_end = write_p;
+  if (o_stub_p != NULL)
+  {
+    write_p = *o_stub_p - (IHL_STUB_SIZE / 4);
+    *o_stub_p = write_p;
+  }
+
   a64_cbz_helper(branch_to_not_found, (uint64_t)write_p, 1, reg_tmp);
 
   a64_logical_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, xzr, x0);
@@ -619,9 +926,199 @@ void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t *
   a64_b_helper(write_p, (uint64_t)thread_data->dispatcher_addr);
   write_p++;
 
+#ifdef DBM_SIGNAL_POLL
+  // Enter the target through checked_cc_return, which delivers the signal
+  a64_cbnz_helper(branch_to_pending, (uint64_t)write_p, 0, reg_tmp);
+
+  if (reg_spc != x1)
+  {
+    a64_logical_reg(&write_p, 1, 1, 0, 0, reg_spc, 0, xzr, x1);
+    write_p++;
+  }
+
+  if (use_x2)
+  {
+    a64_pop_reg(x2);
+  }
+
+  a64_b_helper(write_p, (uint64_t)thread_data->code_cache + checked_cc_return_offset);
+  write_p++;
+#endif
+
+  if (o_stub_p != NULL)
+  {
+    assert(write_p <= *o_stub_p + (IHL_STUB_SIZE / 4));
+    write_p = hit_end;
+  }
+
   *o_write_p = write_p;
 }
 
+/*
+ * Returns true for LDXR, LDAXR, STXR, STLXR and their pair forms,
+ * setting is_load accordingly
+ */
+static bool a64_is_exclusive(uint32_t *read_address, a64_instruction inst, bool *is_load)
+{
+  uint32_t size, o2, l, o1, rs, o0, rt2, rn, rt;
+
+  if (inst != A64_LDX_STX)
+  {
+    return false;
+  }
+
+  a64_LDX_STX_decode_fields(read_address, &size, &o2, &l, &o1, &rs, &o0, &rt2, &rn, &rt);
+  if (o2 == 0 && (o1 == 0 || size >= 2))
+  {
+    *is_load = l;
+    return true;
+  }
+
+  return false;
+}
+
+/*
+ * Returns the address of the exclusive store which ends the exclusive region
+ * starting with the exclusive load at read_address, or NULL. The region must
+ * not contain other exclusive loads or branches other than conditional ones,
+ * e.g. the B.NE of a compare and swap loop, after which it continues on the
+ * fall-through path, in the next basic block.
+ *
+ * The instrumentation of the region is inserted after the store, where the
+ * address of each load and store is computed from the registers it reads.
+ * These must not be modified by the load or store itself, or by any later
+ * instruction in the region. Writes to SP aren't tracked.
+ */
+static uint32_t *a64_find_exclusive_store(uint32_t *read_address)
+{
+  bool is_load;
+  uint32_t reads, writes;
+  uint32_t ld_st_regs = 0;
+
+  for (int i = 0; i < A64_MAX_EXCLUSIVE_REGION; i++)
+  {
+    uint32_t *address = read_address + i;
+    a64_instruction inst = a64_decode(address);
+
+    a64_reg_usage(address, inst, &reads, &writes);
+    switch (inst)
+    {
+    case A64_LDR_LIT:
+    case A64_LDX_STX:
+    case A64_LDP_STP:
+    case A64_LDX_STX_MULTIPLE:
+    case A64_LDX_STX_MULTIPLE_POST:
+    case A64_LDX_STX_SINGLE:
+    case A64_LDX_STX_SINGLE_POST:
+    case A64_LDR_STR_IMMED:
+    case A64_LDR_STR_REG:
+    case A64_LDR_STR_UNSIGNED_IMMED:
+    case A64_ATOMIC_MEMORY:
+    case A64_LDAPR_STLR_UNSCALED:
+    case A64_LDRA:
+      ld_st_regs |= reads & A64_ALL_REGS;
+      break;
+    }
+    // unknown instructions are reported as reading all registers, and might write any of them
+    if ((reads & A64_ALL_REGS) == A64_ALL_REGS || (writes & ld_st_regs) != 0)
+    {
+      return NULL;
+    }
+
+    if (a64_is_exclusive(address, inst, &is_load))
+    {
+      if (!is_load)
+      {
+        return address;
+      }
+      if (i > 0)
+      {
+        return NULL;
+      }
+    }
+
+    switch (inst)
+    {
+    case A64_B_BL:
+    case A64_BR:
+    case A64_BLR:
+    case A64_RET:
+    case A64_BRA:
+    case A64_BLRA:
+    case A64_RETA:
+    case A64_SVC:
+    case A64_CLREX:
+    case A64_INVALID:
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+#ifdef DBM_LSE_ATOMICS
+/*
+ * Exclusive Add Loops
+ * ========= === =====
+ *
+ *     loop: LD{A}XR Rt, [Xn]           MOV     Xs, #(+/-)imm
+ *           ADD/SUB Rd, Rt, #imm  ==>  LDADD{A}{L} Xs, Rt, [Xn]
+ *           ST{L}XR Ws, Rd, [Xn]       ADD/SUB Rd, Rt, #imm
+ *           CBNZ    Ws, loop           MOV     Ws, #0
+ *                                      CBNZ    Ws, loop
+ *
+ * Ws is written by the exclusive store and it must differ from the other
+ * registers, so it holds the addend until it's cleared.
+ */
+static bool a64_exclusive_add_to_lse(uint32_t **o_write_p, uint32_t *read_address)
+{
+  uint32_t ld_size, ld_o2, ld_l, ld_o1, ld_rs, ld_o0, ld_rt2, ld_rn, ld_rt;
+  uint32_t st_size, st_o2, st_l, st_o1, st_rs, st_o0, st_rt2, st_rn, st_rt;
+  uint32_t sf, op, s, shift, imm12, rn, rd;
+  uint32_t *write_p = *o_write_p;
+
+  if (a64_decode(read_address + 1) != A64_ADD_SUB_IMMED || a64_decode(read_address + 2) != A64_LDX_STX)
+  {
+    return false;
+  }
+
+  a64_LDX_STX_decode_fields(read_address, &ld_size, &ld_o2, &ld_l, &ld_o1, &ld_rs, &ld_o0, &ld_rt2, &ld_rn, &ld_rt);
+  a64_ADD_SUB_immed_decode_fields(read_address + 1, &sf, &op, &s, &shift, &imm12, &rn, &rd);
+  a64_LDX_STX_decode_fields(read_address + 2, &st_size, &st_o2, &st_l, &st_o1, &st_rs, &st_o0, &st_rt2, &st_rn, &st_rt);
+
+  if (ld_o2 != 0 || ld_o1 != 0 || ld_l != 1 || st_o2 != 0 || st_o1 != 0 || st_l != 0
+      || ld_size != st_size || ld_rn != st_rn
+      || s != 0 || shift > 1 || rn != ld_rt || st_rt != rd
+      || ld_rt == x31 || ld_rt == ld_rn || rd == x31 || rd == ld_rn
+      || st_rs == ld_rn || st_rs == ld_rt || st_rs == rd)
+  {
+    return false;
+  }
+
+  int64_t addend = (int64_t)imm12 << (shift * 12);
+  if (op)
+  {
+    addend = -addend;
+  }
+
+  a64_copy_to_reg_64bits(&write_p, st_rs, addend);
+
+  // LDADD{A}{L} Xs, Rt, [Xn]
+  a64_atomic_memory(&write_p, ld_size, 0, ld_o0, st_o0, st_rs, 0, 0, ld_rn, ld_rt);
+  write_p++;
+
+  // the original ADD / SUB computes the stored value
+  *write_p++ = *(read_address + 1);
+
+  // MOV Ws, #0
+  a64_MOV_wide(&write_p, 0, 2, 0, 0, st_rs);
+  write_p++;
+
+  *o_write_p = write_p;
+  return true;
+}
+#endif
+
 size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
                 int basic_block, cc_type type, uint32_t *write_p)
 {
@@ -641,8 +1138,27 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   uint64_t PC_relative_address;
   uint64_t size;
   uint64_t target;
+  bool is_pac;
+  bool is_link;
 
   bool TPIDR_EL0;
+  uint32_t dead_regs;
+  a64_liveness_t liveness;
+  pc_map_builder pc_map, *outer_pc_map;
+
+#ifdef PLUGINS_NEW
+  bool is_load;
+  uint32_t *excl_store = NULL;
+  uint32_t *deferred[A64_MAX_EXCLUSIVE_REGION];
+  int deferred_count = 0;
+#endif
+#ifdef DBM_INLINE_HASH
+  uint32_t *stubs_end = NULL;
+#endif
+#ifdef DBM_INLINE_SYSCALLS
+  uint32_t *wrapper_branches[2];
+  uint32_t *done_branch;
+#endif
 
   if (write_p == NULL)
   {
@@ -650,6 +1166,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   }
 
   start_address = write_p;
+  outer_pc_map = pc_map_begin(thread_data, &pc_map, basic_block);
 
   if (type == mambo_bb)
   {
@@ -658,7 +1175,7 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   else
   { // mambo_trace
     data_p = (uint32_t *)&thread_data->code_cache->traces + (TRACE_CACHE_SIZE / 4);
-    thread_data->code_cache_meta[basic_block].free_b = 0;
+    thread_data->code_cache_meta_cold[basic_block].free_b = 0;
   }
 
   /*
@@ -691,11 +1208,30 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
   }
 #endif
 
+  a64_liveness(read_address, &liveness);
+  thread_data->pending_pop_end = NULL;
+#ifdef PLUGINS_NEW
+  // the fall-through path of a conditional branch in an exclusive region
+  if (read_address == thread_data->excl_continuation)
+  {
+    excl_store = thread_data->excl_store;
+    deferred_count = thread_data->excl_deferred_count;
+    memcpy(deferred, thread_data->excl_deferred, deferred_count * sizeof(deferred[0]));
+    thread_data->excl_continuation = NULL;
+  }
+#endif
+#ifdef DBM_LIVENESS_STATS
+  atomic_increment_u64(&global_data.liveness_fragments, 1);
+  // scans can be nested
+  uint32_t outer_spills = thread_data->liveness_fragment_spills;
+  thread_data->liveness_fragment_spills = 0;
+#endif
+
   a64_scanner_deliver_callbacks(thread_data, PRE_FRAGMENT_C, &read_address, -1,
-                                &write_p, &data_p, basic_block, type, true, &stop);
+                                &write_p, &data_p, basic_block, type, true, &stop, &liveness);
 
   a64_scanner_deliver_callbacks(thread_data, PRE_BB_C, &read_address, -1,
-                                &write_p, &data_p, basic_block, type, true, &stop);
+                                &write_p, &data_p, basic_block, type, true, &stop, &liveness);
 
   while (!stop)
   {
@@ -703,17 +1239,42 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
     a64_instruction inst = a64_decode(read_address);
     debug("  instruction enum: %d\n", (inst == A64_INVALID) ? -1 : inst);
     debug("  instruction word: 0x%x\n", *read_address);
+    pc_map_add(thread_data, (uintptr_t)write_p, (uintptr_t)read_address);
 
 #ifdef PLUGINS_NEW
-    bool skip_inst = a64_scanner_deliver_callbacks(thread_data, PRE_INST_C, &read_address, inst,
-                                                   &write_p, &data_p, basic_block, type, true, &stop);
+    /*
+     * Code inserted between an exclusive load and the matching exclusive store
+     * can clear the exclusive monitor and make the store fail on every retry.
+     * The instrumentation of an exclusive region is inserted after its store.
+     */
+    if (excl_store == NULL && a64_is_exclusive(read_address, inst, &is_load) && is_load)
+    {
+      excl_store = a64_find_exclusive_store(read_address);
+    }
+
+    bool defer_inst = (excl_store != NULL);
+    bool skip_inst = false;
+    if (defer_inst)
+    {
+      deferred[deferred_count++] = read_address;
+    }
+    else
+    {
+      skip_inst = a64_scanner_deliver_callbacks(thread_data, PRE_INST_C, &read_address, inst,
+                                                &write_p, &data_p, basic_block, type, true, &stop, &liveness);
+    }
     if (!skip_inst)
     {
 #endif
+      uint32_t *inst_write_p = write_p;
 
       switch (inst)
       {
       case A64_CBZ_CBNZ:
+#ifdef DBM_SIGNAL_POLL
+        a64_poll_signals(thread_data, &write_p, &data_p, basic_block, read_address,
+                         a64_cbz_tbz_target(read_address, inst), start_scan);
+#endif
         a64_branch_imm_reg(thread_data, &write_p, basic_block, inst, read_address);
         stop = true;
         break;
@@ -724,6 +1285,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         branch_offset = sign_extend64(19, imm19) << 2;
         target = (uint64_t)read_address + branch_offset;
 
+#ifdef DBM_SIGNAL_POLL
+        a64_poll_signals(thread_data, &write_p, &data_p, basic_block, read_address, target, start_scan);
+#endif
+
 #ifdef DBM_LINK_COND_IMM
         // Mark this as the beggining of code emulating B.cond
         thread_data->code_cache_meta[basic_block].exit_branch_type = cond_imm_a64;
@@ -738,19 +1303,29 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         break;
 
       case A64_SVC:
+#ifdef DBM_INLINE_SYSCALLS
+        a64_check_free_space(thread_data, &write_p, &data_p, INLINE_SYSCALL_SIZE + MIN_FSPACE, basic_block);
+        a64_inline_syscall(thread_data, &write_p, read_address, wrapper_branches, &done_branch);
+        a64_cbnz_helper(wrapper_branches[0], (uint64_t)write_p, 1, x1);
+        a64_tbnz_helper(wrapper_branches[1], (uint64_t)write_p, x0, 0);
+        a64_pop_pair_reg(x0, x1);
+#endif
         a64_push_pair_reg(x29, x30);
         a64_copy_to_reg_64bits(&write_p, x29, (uint64_t)read_address + 4);
         a64_bl_helper(write_p, thread_data->syscall_wrapper_addr);
         write_p++;
         a64_pop_pair_reg(x0, x1);
+#ifdef DBM_INLINE_SYSCALLS
+        a64_b_helper(done_branch, (uint64_t)write_p);
+#endif
 
         a64_scanner_deliver_callbacks(thread_data, POST_BB_C, &bb_entry, -1,
-                                      &write_p, &data_p, basic_block, type, false, &stop);
+                                      &write_p, &data_p, basic_block, type, false, &stop, NULL);
         // set the correct address for the PRE_BB_C event
         read_address++;
         bb_entry = read_address;
         a64_scanner_deliver_callbacks(thread_data, PRE_BB_C, &read_address, -1,
-                                      &write_p, &data_p, basic_block, type, true, &stop);
+                                      &write_p, &data_p, basic_block, type, true, &stop, &liveness);
         read_address--;
         break;
 
@@ -782,9 +1357,22 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         a64_MRS_MSR_reg_decode_fields(read_address, &R, &o0, &op1, &CRn, &CRm, &op2, &Rt);
 
         TPIDR_EL0 = (o0 == 1) && (op1 == 3) && (CRn == 13) && (CRm == 0) && (op2 == 2);
+#ifdef DBM_NATIVE_TLS
+        // TPIDR_EL0 holds the application's value while running from the code cache
+        TPIDR_EL0 = false;
+#endif
         if (TPIDR_EL0)
         {
-          if (Rt == x0)
+          dead_regs = a64_dead_regs(&liveness, read_address) & ~(1 << Rt);
+          if (R == 1 && Rt != x31)
+          { // MRS, the destination register can hold the address
+            spilled_reg = Rt;
+          }
+          else if (dead_regs != 0)
+          {
+            spilled_reg = next_reg_in_list(dead_regs, 0);
+          }
+          else if (Rt == x0)
           {
             spilled_reg = x1;
           }
@@ -793,7 +1381,17 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
             spilled_reg = x0;
           }
 
-          a64_push_reg(spilled_reg);
+          bool push = (spilled_reg != Rt) && ((dead_regs & (1 << spilled_reg)) == 0);
+          if (push)
+          {
+            a64_push_reg(spilled_reg);
+          }
+#ifdef DBM_LIVENESS_STATS
+          else
+          {
+            liveness_spill_avoided(thread_data);
+          }
+#endif
           a64_copy_to_reg_64bits(&write_p, spilled_reg, (uint64_t)&thread_data->tls);
 
           if (R == 0)
@@ -807,7 +1405,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
             write_p++;
           }
 
-          a64_pop_reg(spilled_reg);
+          if (push)
+          {
+            a64_pop_reg(spilled_reg);
+          }
           break;
         }
         else
@@ -817,6 +1418,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         break;
 
       case A64_TBZ_TBNZ:
+#ifdef DBM_SIGNAL_POLL
+        a64_poll_signals(thread_data, &write_p, &data_p, basic_block, read_address,
+                         a64_cbz_tbz_target(read_address, inst), start_scan);
+#endif
         a64_branch_imm_reg(thread_data, &write_p, basic_block, inst, read_address);
         stop = true;
         break;
@@ -824,14 +1429,18 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_B_BL:
         a64_B_BL_decode_fields(read_address, &op, &imm26);
 
+        branch_offset = sign_extend64(26, imm26) << 2;
+        target = (uint64_t)read_address + branch_offset;
+
+#ifdef DBM_SIGNAL_POLL
+        a64_poll_signals(thread_data, &write_p, &data_p, basic_block, read_address, target, start_scan);
+#endif
+
         if (op == 1)
         { // Branch Link
           a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
         }
 
-        branch_offset = sign_extend64(26, imm26) << 2;
-        target = (uint64_t)read_address + branch_offset;
-
 #ifdef DBM_LINK_UNCOND_IMM
         thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_imm_a64;
         thread_data->code_cache_meta[basic_block].exit_branch_addr = write_p;
@@ -846,13 +1455,26 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
         // while(1);
         break;
 
+      case A64_BRA:
+      case A64_BLRA:
+      case A64_RETA:
       case A64_BR:
       case A64_BLR:
       case A64_RET:
-        a64_BR_decode_fields(read_address, &Rn);
+        is_pac = (inst == A64_BRA || inst == A64_BLRA || inst == A64_RETA);
+        if (inst == A64_RETA)
+        {
+          Rn = lr;
+        }
+        else
+        {
+          // Rn is encoded in the same bits in BR, BLR, RET, BRA and BLRA
+          a64_BR_decode_fields(read_address, &Rn);
+        }
+        is_link = (inst == A64_BLR || inst == A64_BLRA);
 
 #ifdef DBM_INLINE_HASH
-        a64_check_free_space(thread_data, &write_p, &data_p, 88, basic_block);
+        a64_check_free_space(thread_data, &write_p, &data_p, 96 + IHL_STUB_SIZE + IHL_POLL_SIZE, basic_block);
 #endif
 
         thread_data->code_cache_meta[basic_block].exit_branch_type = uncond_branch_reg;
@@ -862,11 +1484,18 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 #ifndef DBM_INLINE_HASH
         a64_branch_save_context(&write_p);
 
-        // MOV X0, Rn (Alias of ORR X0, Rn, XZR)
-        a64_logical_reg(&write_p, 1, 1, 0, 0, Rn, 0, xzr, x0);
-        write_p++;
+        if (is_pac)
+        {
+          a64_pac_branch_auth(&write_p, read_address, x0, x1, 16);
+        }
+        else
+        {
+          // MOV X0, Rn (Alias of ORR X0, Rn, XZR)
+          a64_logical_reg(&write_p, 1, 1, 0, 0, Rn, 0, xzr, x0);
+          write_p++;
+        }
 
-        if (inst == A64_BLR)
+        if (is_link)
         {
           // MOV LR, read_address+4
           a64_copy_to_reg_64bits(&write_p, lr, (uint64_t)read_address + 4);
@@ -874,7 +1503,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
         a64_branch_jump(thread_data, &write_p, basic_block, 0, INSERT_BRANCH);
 #else
-      a64_inline_hash_lookup(thread_data, basic_block, &write_p, read_address, Rn, (inst == A64_BLR), true);
+      // the miss paths of basic blocks are placed at the end of their last slot
+      stubs_end = (type == mambo_bb) ? data_p : NULL;
+      a64_inline_hash_lookup(thread_data, basic_block, &write_p, read_address, Rn, is_link, true, is_pac,
+                             (type == mambo_bb) ? &data_p : NULL);
 #endif
         stop = true;
         break;
@@ -986,13 +1618,31 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
 
       case A64_HVC:
       case A64_BRK:
+      case A64_ERETA:
       case A64_HINT:
+      case A64_LDX_STX:
+#ifdef DBM_LSE_ATOMICS
+        if (global_data.lse_atomics && a64_exclusive_add_to_lse(&write_p, read_address))
+        {
+#ifdef PLUGINS_NEW
+          // the whole exclusive region has been translated
+          assert(excl_store == read_address + 2);
+          deferred[deferred_count++] = read_address + 1;
+          deferred[deferred_count++] = read_address + 2;
+#endif
+          read_address += 2;
+          break;
+        }
+#endif
+        a64_copy();
+        break;
+
       case A64_CLREX:
       case A64_DSB:
       case A64_DMB:
       case A64_ISB:
+      case A64_SB:
       case A64_SYS:
-      case A64_LDX_STX:
       case A64_LDP_STP:
       case A64_LDR_STR_IMMED:
       case A64_LDR_STR_REG:
@@ -1001,6 +1651,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_LDX_STX_MULTIPLE_POST:
       case A64_LDX_STX_SINGLE:
       case A64_LDX_STX_SINGLE_POST:
+      case A64_LDRA:
+      case A64_ATOMIC_MEMORY:
+      case A64_LDAPR_STLR_UNSCALED:
+      case A64_LD_ST_TAGS:
       case A64_ADD_SUB_IMMED:
       case A64_BFM:
       case A64_EXTR:
@@ -1016,6 +1670,10 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_DATA_PROC_REG2:
       case A64_DATA_PROC_REG3:
       case A64_LOGICAL_REG:
+      case A64_POINTER_AUTH:
+      case A64_RMIF:
+      case A64_SETF:
+      case A64_ADDG_SUBG:
       case A64_SIMD_ACROSS_LANE:
       case A64_SIMD_COPY:
       case A64_SIMD_EXTRACT:
@@ -1034,9 +1692,20 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_SIMD_SCALAR_X_INDEXED:
       case A64_SIMD_TWO_REG:
       case A64_SIMD_X_INDEXED:
+      case A64_SIMD_THREE_SAME_EXTRA:
+      case A64_SIMD_THREE_SAME_FP16:
+      case A64_SIMD_TWO_REG_FP16:
+      case A64_SIMD_SCALAR_THREE_SAME_EXTRA:
+      case A64_SIMD_SCALAR_THREE_SAME_FP16:
+      case A64_SIMD_SCALAR_TWO_REG_FP16:
       case A64_CRYPTO_AES:
       case A64_CRYPTO_SHA_REG3:
       case A64_CRYPTO_SHA_REG2:
+      case A64_CRYPTO_REG4:
+      case A64_CRYPTO_SHA512_REG3:
+      case A64_CRYPTO_SHA512_REG2:
+      case A64_CRYPTO_SM3_IMM2:
+      case A64_CRYPTO_XAR:
       case A64_FCMP:
       case A64_FCCMP:
       case A64_FCSEL:
@@ -1046,6 +1715,8 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       case A64_FMOV_IMMED:
       case A64_FLOAT_CVT_FIXED:
       case A64_FLOAT_CVT_INT:
+      // none of the SVE instructions are PC-relative
+      case A64_SVE:
         a64_copy();
         break;
 
@@ -1075,6 +1746,14 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
           ;
         exit(EXIT_FAILURE);
       }
+
+      // a copied load or store can stay between a pop and a push which get merged
+      if (thread_data->pending_pop_end == inst_write_p && write_p == inst_write_p + 1
+          && *inst_write_p == *read_address
+          && a64_is_independent_ld_st(read_address, inst, thread_data->pending_pop_regs))
+      {
+        thread_data->pending_pop_end = write_p;
+      }
 #ifdef PLUGINS_NEW
     } // if (!skip_inst)
 #endif
@@ -1091,17 +1770,68 @@ size_t scan_a64(dbm_thread *thread_data, uint32_t *read_address,
       a64_check_free_space(thread_data, &write_p, &data_p, MIN_FSPACE, basic_block);
     }
 #ifdef PLUGINS_NEW
-    a64_scanner_deliver_callbacks(thread_data, POST_INST_C, &read_address, inst, &write_p, &data_p, basic_block, type, !stop, &stop);
+    if (!defer_inst)
+    {
+      a64_scanner_deliver_callbacks(thread_data, POST_INST_C, &read_address, inst, &write_p, &data_p, basic_block, type, !stop, &stop, &liveness);
+    }
+    else if (read_address == excl_store)
+    {
+      // the liveness information doesn't apply to the deferred callbacks
+      for (int i = 0; i < deferred_count; i++)
+      {
+        uint32_t *deferred_address = deferred[i];
+        a64_instruction deferred_inst = a64_decode(deferred_address);
+        if (a64_scanner_deliver_callbacks(thread_data, PRE_INST_C, &deferred_address, deferred_inst,
+                                          &write_p, &data_p, basic_block, type, true, &stop, NULL))
+        {
+          fprintf(stderr, "MAMBO API WARNING: instructions can't be replaced in "
+                          "exclusive regions (at %p).\n", deferred[i]);
+        }
+        deferred_address = deferred[i];
+        a64_scanner_deliver_callbacks(thread_data, POST_INST_C, &deferred_address, deferred_inst,
+                                      &write_p, &data_p, basic_block, type, true, &stop, NULL);
+      }
+      excl_store = NULL;
+      deferred_count = 0;
+    }
 #endif
 
     read_address++;
   } // while(!stop)
 
+#ifdef PLUGINS_NEW
+  /*
+   * The exclusive region continues in the basic block starting at the
+   * fall-through address of the conditional branch which ended this one, the
+   * deferred instrumentation is inserted after the store in that block. If
+   * the branch is taken, the deferred instructions aren't instrumented.
+   */
+  if (excl_store != NULL)
+  {
+    thread_data->excl_continuation = read_address;
+    thread_data->excl_store = excl_store;
+    thread_data->excl_deferred_count = deferred_count;
+    memcpy(thread_data->excl_deferred, deferred, deferred_count * sizeof(deferred[0]));
+  }
+#endif
+
   a64_scanner_deliver_callbacks(thread_data, POST_BB_C, &bb_entry, -1,
-                                &write_p, &data_p, basic_block, type, false, &stop);
+                                &write_p, &data_p, basic_block, type, false, &stop, NULL);
   a64_scanner_deliver_callbacks(thread_data, POST_FRAGMENT_C, &start_scan, -1,
-                                &write_p, &data_p, basic_block, type, false, &stop);
+                                &write_p, &data_p, basic_block, type, false, &stop, NULL);
+  pc_map_end(thread_data, outer_pc_map);
+#ifdef DBM_LIVENESS_STATS
+  int bucket = min(thread_data->liveness_fragment_spills, LIVENESS_HIST_SIZE - 1);
+  atomic_increment_u64(&global_data.liveness_spills_hist[bucket], 1);
+  thread_data->liveness_fragment_spills = outer_spills;
+#endif
 
+#ifdef DBM_INLINE_HASH
+  if (stubs_end != NULL)
+  {
+    return ((stubs_end - start_address) * sizeof(*write_p));
+  }
+#endif
   return ((write_p - start_address + 1) * sizeof(*write_p));
 }
 #endif // __aarch64__
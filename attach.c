@@ -0,0 +1,783 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Attach mode: dbm --attach PID takes over a running process.
+
+  The injector stops all the threads of the target with ptrace, saves their
+  registers and uses the first one to execute syscalls in the target. MAMBO's
+  own (static, non-PIE) image is mapped at its link address and started in a
+  new thread of the target, with a fresh initial stack, as if it had been
+  executed with the arguments --attached <address of the attach_info>.
+
+  MAMBO then initialises normally, except that it loads no ELF file, takes
+  over the signal handlers which the application has installed and registers
+  its executable mappings with the plugins. For each application thread, it
+  creates a dbm_thread and a pthread which only donates its TLS block, since
+  MAMBO's C code needs one. Finally, the injector points each application
+  thread at attach_thread_entry with the donated TLS and detaches. The threads
+  enter the code cache at the PC where they were stopped.
+*/
+
+#ifdef DBM_ATTACH
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <elf.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <asm/unistd.h>
+#include <linux/sched.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "dbm.h"
+#include "kernel_sigaction.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+  #define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define ATTACH_MAX_THREADS 1024
+#define ATTACH_STACK_SIZE (64 * 1024)
+#define ATTACH_BOOT_STACK_SIZE (1024 * 1024)
+#define ATTACH_TIMEOUT_MS 10000
+#define ATTACH_MAX_AUXV 64
+
+#define A64_SVC_0 0xd4000001
+#define A64_BRK_0 0xd4200000
+
+enum attach_state {
+  ATTACH_INIT = 0,
+  ATTACH_READY,
+  ATTACH_FAILED
+};
+
+// written to host_state by attach_thread_end in util.S
+enum attach_host_state {
+  HOST_STARTING = 0,
+  HOST_READY,
+  HOST_RELEASED
+};
+
+// the NT_PRSTATUS register set
+typedef struct {
+  uint64_t regs[31];
+  uint64_t sp;
+  uint64_t pc;
+  uint64_t pstate;
+} attach_regs;
+
+typedef struct {
+  volatile int host_state; // must be the first field, see attach_thread_end
+  pid_t tid;
+  attach_regs regs;
+  uintptr_t tls;
+  // set up in the target
+  dbm_thread *thread_data;
+  uintptr_t mambo_tls;
+  void *mambo_stack;
+  volatile int *started;
+} attach_thread;
+
+typedef struct {
+  volatile int state;
+  volatile int started;
+  uintptr_t scratch;
+  int thread_count;
+  // the signal handlers installed by the application before MAMBO's libc was initialised
+  struct kernel_sigaction sigactions[_NSIG];
+  attach_thread threads[ATTACH_MAX_THREADS];
+} attach_info;
+
+/* Injector */
+
+typedef struct {
+  pid_t tid;
+  int pending_signal; // received while stopped, delivered after detaching
+} attach_tracee;
+
+static pid_t target;
+static int mem_fd = -1;
+static attach_tracee *tracees;
+static int tracee_count;
+static attach_tracee *injector_thread; // executes the remote syscalls
+static uintptr_t syscall_insn;         // SVC #0; BRK #0 in the target
+static pid_t cloned_tid;
+static attach_info *info;
+static uintptr_t remote_info;
+static bool regs_saved;
+static uintptr_t borrowed_pc;
+static uint32_t borrowed_code[2];
+
+static void restore_and_detach();
+
+static void attach_fail(char *msg) {
+  fprintf(stderr, "MAMBO attach: %s (%s)\n", msg, strerror(errno));
+  if (regs_saved) {
+    restore_and_detach();
+  }
+  exit(EXIT_FAILURE);
+}
+
+static int get_regs(pid_t tid, attach_regs *regs) {
+  struct iovec iov = {regs, sizeof(*regs)};
+  return ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov);
+}
+
+static int set_regs(pid_t tid, attach_regs *regs) {
+  struct iovec iov = {regs, sizeof(*regs)};
+  return ptrace(PTRACE_SETREGSET, tid, NT_PRSTATUS, &iov);
+}
+
+static int get_tls(pid_t tid, uintptr_t *tls) {
+  struct iovec iov = {tls, sizeof(*tls)};
+  return ptrace(PTRACE_GETREGSET, tid, NT_ARM_TLS, &iov);
+}
+
+static int set_tls(pid_t tid, uintptr_t tls) {
+  struct iovec iov = {&tls, sizeof(tls)};
+  return ptrace(PTRACE_SETREGSET, tid, NT_ARM_TLS, &iov);
+}
+
+static int remote_read(uintptr_t addr, void *buf, size_t size) {
+  return (pread(mem_fd, buf, size, addr) == size) ? 0 : -1;
+}
+
+// /proc/PID/mem can also write to read-only mappings
+static int remote_write(uintptr_t addr, void *buf, size_t size) {
+  return (pwrite(mem_fd, buf, size, addr) == size) ? 0 : -1;
+}
+
+/* Waits for a stop of a traced thread. Signals received in the meantime
+   are recorded and delivered when the thread is detached. */
+static int wait_stop(attach_tracee *t, int *status) {
+  while (true) {
+    pid_t ret = waitpid(t->tid, status, __WALL);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (!WIFSTOPPED(*status)) {
+      errno = ESRCH;
+      return -1;
+    }
+    int event = *status >> 16;
+    int sig = WSTOPSIG(*status);
+    if (event != 0 || sig == SIGTRAP) {
+      return 0;
+    }
+    t->pending_signal = sig;
+    return 0;
+  }
+}
+
+/* Executes a syscall in the injector thread, whose registers
+   are restored by the caller once it's done with it */
+static uintptr_t remote_syscall(uintptr_t no, uintptr_t a0, uintptr_t a1, uintptr_t a2,
+                                uintptr_t a3, uintptr_t a4, uintptr_t a5) {
+  attach_regs regs;
+  int status;
+
+  if (get_regs(injector_thread->tid, &regs) != 0) attach_fail("failed to read the registers");
+  regs.regs[0] = a0;
+  regs.regs[1] = a1;
+  regs.regs[2] = a2;
+  regs.regs[3] = a3;
+  regs.regs[4] = a4;
+  regs.regs[5] = a5;
+  regs.regs[8] = no;
+  regs.pc = syscall_insn;
+  if (set_regs(injector_thread->tid, &regs) != 0) attach_fail("failed to set the registers");
+
+  while (true) {
+    if (ptrace(PTRACE_CONT, injector_thread->tid, 0, 0) != 0) attach_fail("PTRACE_CONT failed");
+    if (wait_stop(injector_thread, &status) != 0) attach_fail("the target exited");
+    if ((status >> 16) == PTRACE_EVENT_CLONE) {
+      unsigned long msg;
+      if (ptrace(PTRACE_GETEVENTMSG, injector_thread->tid, 0, &msg) != 0) {
+        attach_fail("PTRACE_GETEVENTMSG failed");
+      }
+      cloned_tid = msg;
+    } else if ((status >> 16) == 0 && WSTOPSIG(status) == SIGTRAP) {
+      if (get_regs(injector_thread->tid, &regs) != 0) attach_fail("failed to read the registers");
+      if (regs.pc == syscall_insn + 4) {
+        return regs.regs[0];
+      }
+    }
+  }
+}
+
+static bool remote_failed(uintptr_t ret) {
+  return ret > -4096UL;
+}
+
+static uintptr_t remote_mmap(uintptr_t addr, size_t size, int prot, int flags) {
+  uintptr_t ret = remote_syscall(__NR_mmap, addr, size, prot, flags | MAP_PRIVATE | MAP_ANONYMOUS,
+                                 -1, 0);
+  if (remote_failed(ret) || (addr != 0 && ret != addr)) {
+    errno = remote_failed(ret) ? -ret : EEXIST;
+    attach_fail("remote mmap failed");
+  }
+  return ret;
+}
+
+static bool is_tracee(pid_t tid) {
+  for (int i = 0; i < tracee_count; i++) {
+    if (tracees[i].tid == tid) return true;
+  }
+  return false;
+}
+
+/* Stops all threads of the target. Threads can still be created by the
+   ones which haven't been stopped yet, so the list is scanned until it
+   doesn't contain any new threads. */
+static void stop_threads() {
+  char path[PATH_MAX];
+  bool found_new;
+
+  snprintf(path, sizeof(path), "/proc/%d/task", target);
+  do {
+    found_new = false;
+    DIR *dir = opendir(path);
+    if (dir == NULL) attach_fail("can't list the threads");
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      pid_t tid = atoi(entry->d_name);
+      if (tid <= 0 || is_tracee(tid)) continue;
+
+      if (ptrace(PTRACE_SEIZE, tid, 0, 0) != 0) {
+        if (errno == ESRCH) continue; // already exited
+        attach_fail("PTRACE_SEIZE failed");
+      }
+      if (tracee_count == ATTACH_MAX_THREADS) {
+        errno = E2BIG;
+        attach_fail("too many threads");
+      }
+
+      attach_tracee *t = &tracees[tracee_count];
+      t->tid = tid;
+      t->pending_signal = 0;
+      int status;
+      if (ptrace(PTRACE_INTERRUPT, tid, 0, 0) != 0 || wait_stop(t, &status) != 0) {
+        ptrace(PTRACE_DETACH, tid, 0, 0);
+        continue;
+      }
+      tracee_count++;
+      found_new = true;
+    }
+    closedir(dir);
+  } while (found_new);
+
+  if (tracee_count == 0) {
+    errno = ESRCH;
+    attach_fail("no threads found");
+  }
+}
+
+// Lets the application continue without MAMBO, if it hasn't been started yet
+static void restore_and_detach() {
+  regs_saved = false;
+  if (borrowed_pc != 0) {
+    remote_write(borrowed_pc, borrowed_code, sizeof(borrowed_code));
+  }
+  for (int i = 0; i < tracee_count; i++) {
+    attach_tracee *t = &tracees[i];
+    set_regs(t->tid, &info->threads[i].regs);
+    ptrace(PTRACE_DETACH, t->tid, 0, t->pending_signal);
+  }
+}
+
+/* Maps the PT_LOAD segments of this executable at the same addresses in the
+   target. MAMBO is linked statically at a fixed address, so they don't need
+   to be relocated. */
+static void map_mambo() {
+  Elf64_Phdr *phdr = (Elf64_Phdr *)getauxval(AT_PHDR);
+  int phnum = getauxval(AT_PHNUM);
+
+  int fd = open("/proc/self/exe", O_RDONLY);
+  if (fd < 0) attach_fail("can't open the MAMBO executable");
+
+  for (int i = 0; i < phnum; i++) {
+    if (phdr[i].p_type != PT_LOAD) continue;
+
+    uintptr_t start = align_lower(phdr[i].p_vaddr, PAGE_SIZE);
+    uintptr_t end = align_higher(phdr[i].p_vaddr + phdr[i].p_memsz, PAGE_SIZE);
+    remote_mmap(start, end - start, PROT_READ | PROT_WRITE, MAP_FIXED_NOREPLACE);
+
+    void *buf = malloc(phdr[i].p_filesz);
+    assert(buf != NULL);
+    if (pread(fd, buf, phdr[i].p_filesz, phdr[i].p_offset) != phdr[i].p_filesz
+        || remote_write(phdr[i].p_vaddr, buf, phdr[i].p_filesz) != 0) {
+      attach_fail("failed to copy the MAMBO image");
+    }
+    free(buf);
+
+    int prot = ((phdr[i].p_flags & PF_R) ? PROT_READ : 0)
+             | ((phdr[i].p_flags & PF_W) ? PROT_WRITE : 0)
+             | ((phdr[i].p_flags & PF_X) ? PROT_EXEC : 0);
+    uintptr_t ret = remote_syscall(__NR_mprotect, start, end - start, prot, 0, 0, 0);
+    if (remote_failed(ret)) {
+      errno = -ret;
+      attach_fail("remote mprotect failed");
+    }
+  }
+  close(fd);
+}
+
+static int read_auxv(char *path, Elf64_auxv_t *auxv) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) attach_fail("can't read the auxiliary vector");
+  ssize_t size = read(fd, auxv, sizeof(Elf64_auxv_t) * ATTACH_MAX_AUXV);
+  close(fd);
+  if (size <= 0) attach_fail("can't read the auxiliary vector");
+  return size / sizeof(Elf64_auxv_t);
+}
+
+/* Builds the initial stack of MAMBO's main thread, with the layout expected
+   by _start. The auxiliary vector is the target's, with the entries which
+   describe the executable replaced by MAMBO's. */
+static uintptr_t build_stack(uintptr_t stack, char *mambo_path) {
+  char info_arg[32];
+  char *argv[] = {mambo_path, ATTACH_BOOT_ARG, info_arg};
+  int argc = sizeof(argv) / sizeof(argv[0]);
+  extern char **environ;
+  int envc = 0;
+  Elf64_auxv_t auxv[ATTACH_MAX_AUXV];
+  char path[PATH_MAX];
+  uint8_t random[16];
+
+  snprintf(info_arg, sizeof(info_arg), "%" PRIxPTR, remote_info);
+  while (environ[envc] != NULL) envc++;
+  snprintf(path, sizeof(path), "/proc/%d/auxv", target);
+  int auxc = read_auxv(path, auxv);
+  if (getrandom(random, sizeof(random), 0) != sizeof(random)) attach_fail("getrandom failed");
+
+  size_t strings_size = sizeof(random);
+  for (int i = 0; i < argc; i++) strings_size += strlen(argv[i]) + 1;
+  for (int i = 0; i < envc; i++) strings_size += strlen(environ[i]) + 1;
+  size_t words = 1 + (argc + 1) + (envc + 1) + auxc * 2;
+  size_t size = align_higher(words * sizeof(uintptr_t) + strings_size, 16);
+  if (size > ATTACH_BOOT_STACK_SIZE / 2) {
+    errno = E2BIG;
+    attach_fail("the environment is too large");
+  }
+
+  uintptr_t sp = stack + ATTACH_BOOT_STACK_SIZE - size;
+  uintptr_t *image = calloc(1, size);
+  assert(image != NULL);
+  uintptr_t *vec = image;
+  char *strings = (char *)(image + words);
+  #define remote_addr(p) (sp + ((uintptr_t)(p) - (uintptr_t)image))
+
+  memcpy(strings, random, sizeof(random));
+  uintptr_t remote_random = remote_addr(strings);
+  strings += sizeof(random);
+
+  *vec++ = argc;
+  for (int i = 0; i < argc; i++) {
+    *vec++ = remote_addr(strings);
+    strings = stpcpy(strings, argv[i]) + 1;
+  }
+  *vec++ = 0;
+  for (int i = 0; i < envc; i++) {
+    *vec++ = remote_addr(strings);
+    strings = stpcpy(strings, environ[i]) + 1;
+  }
+  *vec++ = 0;
+  for (int i = 0; i < auxc; i++) {
+    uintptr_t type = auxv[i].a_type;
+    uintptr_t val = auxv[i].a_un.a_val;
+    switch (type) {
+      case AT_PHDR:
+      case AT_PHENT:
+      case AT_PHNUM:
+      case AT_ENTRY:
+        val = getauxval(type);
+        break;
+      case AT_BASE:
+        val = 0;
+        break;
+      case AT_RANDOM:
+        val = remote_random;
+        break;
+    }
+    *vec++ = type;
+    *vec++ = val;
+  }
+  #undef remote_addr
+
+  if (remote_write(sp, image, size) != 0) attach_fail("failed to write the initial stack");
+  free(image);
+
+  return sp;
+}
+
+/* Starts MAMBO in a new thread of the target. All signals are blocked in
+   the new thread, MAMBO's threads are created with the same mask. */
+static void start_mambo(uintptr_t stack_pointer, uintptr_t data) {
+  uint64_t all = ~0ULL;
+  if (remote_write(data, &all, sizeof(all)) != 0) attach_fail("failed to write the signal mask");
+  uintptr_t ret = remote_syscall(__NR_rt_sigprocmask, SIG_SETMASK, data, data + 8, 8, 0, 0);
+  if (remote_failed(ret)) attach_fail("remote rt_sigprocmask failed");
+
+  if (ptrace(PTRACE_SETOPTIONS, injector_thread->tid, 0, PTRACE_O_TRACECLONE) != 0) {
+    attach_fail("PTRACE_SETOPTIONS failed");
+  }
+  cloned_tid = 0;
+  ret = remote_syscall(__NR_clone, CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND
+                       | CLONE_THREAD | CLONE_SYSVSEM, stack_pointer, 0, 0, 0, 0);
+  if (remote_failed(ret) || cloned_tid == 0) {
+    errno = remote_failed(ret) ? -ret : ESRCH;
+    attach_fail("remote clone failed");
+  }
+  ptrace(PTRACE_SETOPTIONS, injector_thread->tid, 0, 0);
+  remote_syscall(__NR_rt_sigprocmask, SIG_SETMASK, data + 8, 0, 8, 0, 0);
+
+  attach_tracee boot = {cloned_tid, 0};
+  attach_regs regs;
+  int status;
+  if (wait_stop(&boot, &status) != 0 || get_regs(boot.tid, &regs) != 0) {
+    attach_fail("the MAMBO thread didn't start");
+  }
+  regs.pc = getauxval(AT_ENTRY);
+  regs.sp = stack_pointer;
+  regs.regs[0] = 0;
+  if (set_regs(boot.tid, &regs) != 0 || ptrace(PTRACE_DETACH, boot.tid, 0, 0) != 0) {
+    attach_fail("failed to start the MAMBO thread");
+  }
+}
+
+static int wait_ready() {
+  int state = ATTACH_INIT;
+  struct timespec delay = {0, 1000 * 1000};
+
+  for (int ms = 0; ms < ATTACH_TIMEOUT_MS && state == ATTACH_INIT; ms++) {
+    nanosleep(&delay, NULL);
+    if (remote_read(remote_info + offsetof(attach_info, state), &state, sizeof(state)) != 0) {
+      attach_fail("failed to read the attach state");
+    }
+  }
+  return state;
+}
+
+void attach_process(pid_t pid) {
+  char path[PATH_MAX];
+  char mambo_path[PATH_MAX];
+
+  target = pid;
+  tracees = calloc(ATTACH_MAX_THREADS, sizeof(attach_tracee));
+  info = calloc(1, sizeof(attach_info));
+  assert(tracees != NULL && info != NULL);
+
+  ssize_t len = readlink("/proc/self/exe", mambo_path, sizeof(mambo_path) - 1);
+  if (len < 0) attach_fail("can't find the MAMBO executable");
+  mambo_path[len] = '\0';
+
+  stop_threads();
+  snprintf(path, sizeof(path), "/proc/%d/mem", target);
+  mem_fd = open(path, O_RDWR);
+  if (mem_fd < 0) attach_fail("can't open the target's memory");
+
+  injector_thread = &tracees[0];
+  info->thread_count = tracee_count;
+  for (int i = 0; i < tracee_count; i++) {
+    attach_thread *t = &info->threads[i];
+    t->tid = tracees[i].tid;
+    if (get_regs(t->tid, &t->regs) != 0 || get_tls(t->tid, &t->tls) != 0) {
+      attach_fail("failed to read the registers");
+    }
+    if (t->tid == target) {
+      injector_thread = &tracees[i];
+    }
+  }
+  regs_saved = true;
+  attach_regs *inj_regs = &info->threads[injector_thread - tracees].regs;
+
+  /* Borrow two instructions at the PC of the injector thread to map a
+     code page for the remote syscalls and a data page */
+  uint32_t code[2] = {A64_SVC_0, A64_BRK_0};
+  syscall_insn = inj_regs->pc;
+  if (remote_read(syscall_insn, borrowed_code, sizeof(borrowed_code)) != 0) {
+    attach_fail("failed to read the application's code");
+  }
+  borrowed_pc = syscall_insn;
+  if (remote_write(syscall_insn, code, sizeof(code)) != 0) {
+    attach_fail("failed to write the syscall instruction");
+  }
+  info->scratch = remote_mmap(0, PAGE_SIZE * 2, PROT_READ | PROT_EXEC, 0);
+  uintptr_t data = info->scratch + PAGE_SIZE;
+  uintptr_t ret = remote_syscall(__NR_mprotect, data, PAGE_SIZE, PROT_READ | PROT_WRITE, 0, 0, 0);
+  if (remote_failed(ret)) attach_fail("remote mprotect failed");
+  if (remote_write(borrowed_pc, borrowed_code, sizeof(borrowed_code)) != 0) {
+    attach_fail("failed to restore the application's code");
+  }
+  borrowed_pc = 0;
+  syscall_insn = info->scratch;
+  if (remote_write(syscall_insn, code, sizeof(code)) != 0) {
+    attach_fail("failed to write the syscall instruction");
+  }
+
+  // MAMBO's libc installs its own handlers while it's initialised
+  for (int i = 1; i < _NSIG; i++) {
+    if (i == SIGKILL || i == SIGSTOP) continue;
+    ret = remote_syscall(__NR_rt_sigaction, i, 0, data, 8, 0, 0);
+    if (remote_failed(ret)
+        || remote_read(data, &info->sigactions[i], sizeof(info->sigactions[i])) != 0) {
+      attach_fail("failed to read the signal handlers");
+    }
+  }
+
+  map_mambo();
+
+  remote_info = remote_mmap(0, align_higher(sizeof(attach_info), PAGE_SIZE), PROT_READ | PROT_WRITE, 0);
+  if (remote_write(remote_info, info, sizeof(attach_info)) != 0) {
+    attach_fail("failed to write the thread list");
+  }
+
+  uintptr_t stack = remote_mmap(0, ATTACH_BOOT_STACK_SIZE, PROT_READ | PROT_WRITE,
+                                MAP_NORESERVE | MAP_STACK);
+  start_mambo(build_stack(stack, mambo_path), data);
+
+  int state = wait_ready();
+  if (state != ATTACH_READY) {
+    errno = (state == ATTACH_INIT) ? ETIMEDOUT : EIO;
+    attach_fail("MAMBO failed to initialise in the target");
+  }
+  if (remote_read(remote_info, info, sizeof(attach_info)) != 0) {
+    attach_fail("failed to read the thread list");
+  }
+
+  for (int i = 0; i < tracee_count; i++) {
+    attach_thread *t = &info->threads[i];
+    attach_regs regs = t->regs;
+    regs.pc = (uintptr_t)attach_thread_entry;
+    regs.sp = (uintptr_t)t->mambo_stack + ATTACH_STACK_SIZE;
+    regs.regs[0] = remote_info + offsetof(attach_info, threads) + i * sizeof(attach_thread);
+    regs.regs[1] = (uintptr_t)t->mambo_stack;
+    regs.regs[2] = ATTACH_STACK_SIZE;
+    if (set_regs(t->tid, &regs) != 0 || set_tls(t->tid, t->mambo_tls) != 0) {
+      attach_fail("failed to redirect a thread");
+    }
+  }
+  regs_saved = false;
+  for (int i = 0; i < tracee_count; i++) {
+    ptrace(PTRACE_DETACH, tracees[i].tid, 0, tracees[i].pending_signal);
+  }
+
+  printf("MAMBO: attached to %d (%d threads)\n", target, tracee_count);
+  exit(EXIT_SUCCESS);
+}
+
+/* Target */
+
+extern char __executable_start[];
+extern char _end[];
+
+static void attach_signal_handlers(attach_info *info) {
+  for (int i = 1; i < _NSIG; i++) {
+    if (i == SIGKILL || i == SIGSTOP) continue;
+
+    struct kernel_sigaction act = info->sigactions[i];
+    global_data.signal_handlers[i] = (uintptr_t)act.k_sa_handler;
+    if (act.k_sa_handler == SIG_IGN || act.k_sa_handler == SIG_DFL) {
+      // keep MAMBO's own handler
+      if (i == UNLINK_SIGNAL) continue;
+    } else {
+      act.k_sa_handler = (__sighandler_t)signal_trampoline;
+      act.sa_flags |= SA_SIGINFO;
+    }
+    int ret = raw_syscall(__NR_rt_sigaction, i, &act, NULL, 8);
+    assert(ret == 0);
+  }
+}
+
+// Registers the executable mappings of the application with the plugins
+static void attach_scan_mappings(attach_info *info) {
+  char line[PATH_MAX + 128];
+  char path[PATH_MAX];
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  assert(maps != NULL);
+
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    uintptr_t start, end;
+    unsigned long long offset;
+    char perms[5];
+
+    path[0] = '\0';
+    int fields = sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %llx %*s %*s %s",
+                        &start, &end, perms, &offset, path);
+    if (fields < 4 || perms[2] != 'x') continue;
+    if (start < (uintptr_t)_end && end > (uintptr_t)__executable_start) continue;
+    if (start == info->scratch) continue;
+
+    int fd = -1;
+    if (path[0] == '/') {
+      fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    int prot = PROT_EXEC | ((perms[0] == 'r') ? PROT_READ : 0) | ((perms[1] == 'w') ? PROT_WRITE : 0);
+    int flags = (perms[3] == 's') ? MAP_SHARED : MAP_PRIVATE;
+    notify_vm_op(VM_MAP, start, end - start, prot, flags, fd, offset);
+  }
+  fclose(maps);
+}
+
+// Only provides a TLS block for an application thread, until it exits
+static void *attach_tls_host(void *arg) {
+  attach_thread *t = (attach_thread *)arg;
+  uintptr_t tls;
+
+  asm volatile("MRS %0, TPIDR_EL0" : "=r" (tls));
+  t->mambo_tls = tls;
+  asm volatile("DMB SY" ::: "memory");
+  t->host_state = HOST_READY;
+  futex_wake(&t->host_state, 1);
+
+  while (t->host_state != HOST_RELEASED) {
+    futex_wait(&t->host_state, HOST_READY, NULL);
+  }
+  return NULL;
+}
+
+static bool attach_init_thread(attach_info *info, attach_thread *t) {
+  pthread_t host;
+  pthread_attr_t attr;
+
+  if (!allocate_thread_data(&t->thread_data)) {
+    return false;
+  }
+  init_thread(t->thread_data);
+  t->thread_data->attached = true;
+  t->started = &info->started;
+
+  t->mambo_stack = mmap(NULL, ATTACH_STACK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (t->mambo_stack == MAP_FAILED) {
+    return false;
+  }
+
+  int ret = pthread_attr_init(&attr);
+  assert(ret == 0);
+  ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  assert(ret == 0);
+  ret = pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 4096);
+  assert(ret == 0);
+  ret = pthread_create(&host, &attr, attach_tls_host, t);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    return false;
+  }
+
+  while (t->host_state == HOST_STARTING) {
+    futex_wait(&t->host_state, HOST_STARTING, NULL);
+  }
+  return true;
+}
+
+/* Runs in MAMBO's initial thread, after the common initialisation.
+   Exits the thread once all application threads have entered MAMBO. */
+void attach_start(char *arg) {
+  attach_info *info = (attach_info *)strtoull(arg, NULL, 16);
+  static char app_path[PATH_MAX];
+
+  global_data.attached = true;
+  // /proc/self/exe still refers to the application
+  ssize_t len = readlink("/proc/self/exe", app_path, sizeof(app_path) - 1);
+  if (len > 0) {
+    app_path[len] = '\0';
+    global_data.argv[1] = app_path;
+  }
+
+  attach_signal_handlers(info);
+  attach_scan_mappings(info);
+
+  int state = ATTACH_READY;
+  for (int i = 0; i < info->thread_count; i++) {
+    if (!attach_init_thread(info, &info->threads[i])) {
+      fprintf(stderr, "MAMBO attach: failed to set up thread %d\n", info->threads[i].tid);
+      state = ATTACH_FAILED;
+      break;
+    }
+  }
+  asm volatile("DMB SY" ::: "memory");
+  info->state = state;
+
+  if (state == ATTACH_READY) {
+    int started;
+    while ((started = info->started) < info->thread_count) {
+      futex_wait(&info->started, started, NULL);
+    }
+    munmap((void *)info->scratch, PAGE_SIZE * 2);
+  }
+  raw_syscall(__NR_exit, 0);
+}
+
+/* Called from attach_thread_entry on the MAMBO stack of an application
+   thread, with MAMBO's TLS. Builds the frame expected by th_enter below
+   the application's stack pointer and returns the code cache address
+   of the instruction at which the thread was stopped. */
+uintptr_t attach_thread_start(attach_thread *t, void *mambo_sp, uint64_t **app_frame) {
+  dbm_thread *thread_data = t->thread_data;
+
+  current_thread = thread_data;
+  thread_data->mambo_sp = mambo_sp;
+  thread_data->tid = t->tid;
+  thread_data->tls = t->tls;
+
+  uint64_t *frame = (uint64_t *)(t->regs.sp - 32 * sizeof(uint64_t));
+  for (int r = 2; r <= 28; r++) {
+    frame[r - 2] = t->regs.regs[r];
+  }
+  frame[28] = t->regs.regs[29];
+  frame[29] = t->regs.regs[30];
+  // popped by the fragment
+  frame[30] = t->regs.regs[0];
+  frame[31] = t->regs.regs[1];
+  *app_frame = frame;
+
+  int ret = register_thread(thread_data);
+  assert(ret == 0);
+
+  uintptr_t addr = lookup_or_scan(thread_data, t->regs.pc, NULL);
+
+  atomic_increment_int((int32_t *)t->started, 1);
+  futex_wake(t->started, 1);
+
+#ifdef DBM_NATIVE_TLS
+  native_tls_leave(thread_data);
+#endif
+  return addr;
+}
+
+#endif // DBM_ATTACH
@@ -91,7 +91,7 @@ bool hash_add(hash_table *table, uintptr_t key, uintptr_t value) {
   do {
     if (table->entries[index].key == 0 || table->entries[index].key == key) {
       if (table->entries[index].key == 0) {
-        table->count++;
+        table->used[table->count++] = index;
       }
       table->entries[index].key = key;
       table->entries[index].value = value;
@@ -109,6 +109,15 @@ bool hash_add(hash_table *table, uintptr_t key, uintptr_t value) {
   return done;
 }
 
+/* Empties up to max of the non-empty entries, in O(max) instead of O(size).
+   Returns the number of non-empty entries left. */
+int hash_clear_used(hash_table *table, int max) {
+  while (table->count > 0 && max-- > 0) {
+    table->entries[table->used[--table->count]].key = 0;
+  }
+  return table->count;
+}
+
 void hash_init(hash_table *table, int size) {
   table->size = size;
   table->collisions = 0;
@@ -123,20 +132,21 @@ void hash_init(hash_table *table, int size) {
 void linked_list_init(ll *list, int size) {
   assert(size >= 1);
   list->size = size;
-  list->free_list = &list->pool[0];
-  
-  for (int i = 0; i < size-1; i++) {
-    list->pool[i].next = &list->pool[i+1];
-  }
-  
-  list->pool[size-1].next = NULL;
+  list->free_list = NULL;
+  list->next_unused = 0;
 }
 
 ll_entry *linked_list_alloc(ll *list) {
-  if (list->free_list == NULL) return NULL;
-  
-  ll_entry *entry = list->free_list;
-  list->free_list = entry->next;
+  ll_entry *entry;
+
+  if (list->free_list != NULL) {
+    entry = list->free_list;
+    list->free_list = entry->next;
+  } else if (list->next_unused < list->size) {
+    entry = &list->pool[list->next_unused++];
+  } else {
+    return NULL;
+  }
   entry->next = NULL;
   
   return entry;
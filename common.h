@@ -23,7 +23,12 @@
 
 #include <stdlib.h>
 
-#define CODE_CACHE_HASH_SIZE 0x7FFFF//14071
+#ifdef DBM_LARGE_CODE_CACHE
+  #define CODE_CACHE_HASH_BITS 21
+#else
+  #define CODE_CACHE_HASH_BITS 19
+#endif
+#define CODE_CACHE_HASH_SIZE ((1 << CODE_CACHE_HASH_BITS) - 1)
 #define CODE_CACHE_HASH_OVERP 10
 
 /* Warning, size MUST be (a power of 2) */
@@ -43,6 +48,8 @@ typedef struct {
   int collisions;
   int count;
   hash_entry entries[CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP];
+  // indexes of the count non-empty entries, so clearing doesn't depend on the size
+  int used[CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP];
 } hash_table;
 
 struct ll_entry_s {
@@ -54,6 +61,8 @@ typedef struct ll_entry_s ll_entry;
 typedef struct {
   ll_entry *free_list;
   int size;
+  // the entries of the pool from next_unused onwards haven't been allocated yet
+  int next_unused;
   ll_entry pool[];
 } ll;
 
@@ -74,6 +83,7 @@ bool hash_add(hash_table *table, uintptr_t key, uintptr_t value);
 void hash_delete(hash_table *table, uintptr_t key);
 uintptr_t hash_lookup(hash_table *table, uintptr_t key);
 void hash_init(hash_table *table, int size);
+int hash_clear_used(hash_table *table, int max);
 
 void linked_list_init(ll *list, int size);
 ll_entry *linked_list_alloc(ll *list);
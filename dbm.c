@@ -23,12 +23,15 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <asm/unistd.h>
 #include <pthread.h>
 #include <sys/auxv.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <errno.h>
+#include <linux/futex.h>
 
 #include <libelf.h>
 
@@ -38,6 +41,10 @@
 
 #include "elf/elf_loader.h"
 
+#if defined(DBM_LSE_ATOMICS) && !defined(HWCAP_ATOMICS)
+  #define HWCAP_ATOMICS (1 << 8)
+#endif
+
 #ifdef __arm__
 #include "pie/pie-thumb-decoder.h"
 #include "pie/pie-thumb-encoder.h"
@@ -61,39 +68,56 @@
 
 #define dispatcher_thread_data_offset ((uintptr_t)&disp_thread_data - (uintptr_t)&start_of_dispatcher_s)
 #define th_is_pending_ptr_offset      ((uintptr_t)&th_is_pending_ptr - (uintptr_t)&start_of_dispatcher_s)
+#define th_tls_ptr_offset             ((uintptr_t)&th_tls_ptr - (uintptr_t)&start_of_dispatcher_s)
 #define dispatcher_wrapper_offset     ((uintptr_t)dispatcher_trampoline - (uintptr_t)&start_of_dispatcher_s)
 #define syscall_wrapper_offset        ((uintptr_t)syscall_wrapper - (uintptr_t)&start_of_dispatcher_s)
 #define trace_head_incr_offset        ((uintptr_t)trace_head_incr - (uintptr_t)&start_of_dispatcher_s)
 
+#define HASH_TABLE_ENTRIES (CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP)
+/* entries of the previous generation's hash table cleared by each scan(), more
+   than the entries a scan() adds, so the clearing normally completes before
+   the next flush */
+#define HASH_CLEAR_STEP 8
+
 uintptr_t page_size;
 dbm_global global_data;
 __thread dbm_thread *current_thread;
 
+// Clears up to count of the used entries of the hash table of the previous generation
+static void hash_clear_stale(dbm_thread *thread_data, int count) {
+  hash_clear_used(&thread_data->hash_tables[(thread_data->cache_generation + 1) & 1], count);
+}
+
+/* Flushing doesn't depend on the size of the code cache: the hash table
+   switches to the table of the next generation, cleared by scan() during the
+   previous one, and the metadata of each basic block is reset by allocate_bb().
+   Only the entries added to that table before the previous flush and not yet
+   cleared by scan() are cleared here, each of which was added by a scan(). */
 void flush_code_cache(dbm_thread *thread_data) {
+  stats_inc(thread_data, STATS_CACHE_FLUSHES);
   thread_data->was_flushed = true;
   thread_data->free_block = trampolines_size_bbs;
-  hash_init(&thread_data->entry_address, CODE_CACHE_HASH_SIZE + CODE_CACHE_HASH_OVERP);
+
+  hash_clear_stale(thread_data, HASH_TABLE_ENTRIES);
+  thread_data->cache_generation++;
+  thread_data->entry_address = &thread_data->hash_tables[thread_data->cache_generation & 1];
+  thread_data->entry_address->size = HASH_TABLE_ENTRIES;
+  thread_data->entry_address->collisions = 0;
 #ifdef DBM_TRACES
   thread_data->trace_cache_next = thread_data->code_cache->traces;
   thread_data->trace_id = CODE_CACHE_SIZE;
   thread_data->active_trace.id = CODE_CACHE_SIZE;
+  // trace_dir_add() keeps the entries after trace_dir_last clear
+  memset(thread_data->trace_dir, 0, (thread_data->trace_dir_last + 1) * sizeof(thread_data->trace_dir[0]));
+  thread_data->trace_dir_last = 0;
 #endif
-
-  for (int i = 0; i < CODE_CACHE_SIZE; i++) {
-    thread_data->code_cache_meta[i].exit_branch_type = unknown;
-    thread_data->code_cache_meta[i].linked_from = NULL;
-    thread_data->code_cache_meta[i].branch_cache_status = 0;
-    thread_data->code_cache_meta[i].actual_id = 0;
-#ifdef DBM_TRACES
-    thread_data->exec_count[i] = 0;
-#endif
-  }
+  pc_map_reset(thread_data);
 
   linked_list_init(thread_data->cc_links, MAX_CC_LINKS);
 }
 
 uintptr_t cc_lookup(dbm_thread *thread_data, uintptr_t target) {
-  uintptr_t addr = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t addr = hash_lookup(thread_data->entry_address, target);
   return adjust_cc_entry(addr);
 }
 
@@ -135,6 +159,16 @@ int allocate_bb(dbm_thread *thread_data) {
   }
   
   basic_block = thread_data->free_block++;
+
+  // the metadata of the previous generation is reset here, rather than when flushing
+  thread_data->code_cache_meta[basic_block].exit_branch_type = unknown;
+  thread_data->code_cache_meta_cold[basic_block].linked_from = NULL;
+  thread_data->code_cache_meta[basic_block].branch_cache_status = 0;
+  thread_data->code_cache_meta[basic_block].actual_id = 0;
+#ifdef DBM_TRACES
+  thread_data->exec_count[basic_block] = 0;
+#endif
+
   return basic_block;
 }
 
@@ -153,7 +187,7 @@ uintptr_t stub_bb(dbm_thread *thread_data, uintptr_t target) {
   debug("Stub BB: 0x%x\n", block_address + thumb);
   
   thread_data->code_cache_meta[basic_block].exit_branch_type = stub;
-  if (!hash_add(&thread_data->entry_address, target, block_address + thumb)) {
+  if (!hash_add(thread_data->entry_address, target, block_address + thumb)) {
     fprintf(stderr, "Failed to add hash table entry for newly created stub basic block\n");
     while(1);
   }
@@ -194,6 +228,7 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   bool stub = false;
 
   debug("scan(%p)\n", address);
+  stats_inc(thread_data, STATS_TRANSLATIONS);
 
   // Alocate a basic block
   if (basic_block == ALLOCATE_BB) {
@@ -205,6 +240,7 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   block_address = (uintptr_t)&thread_data->code_cache->blocks[basic_block];
   thread_data->code_cache_meta[basic_block].source_addr = address;
   thread_data->code_cache_meta[basic_block].tpc = block_address;
+  thread_data->code_cache_meta_cold[basic_block].pc_map_size = 0;
   //fprintf(stderr, "scan(%p): 0x%x (bb %d)\n", address, block_address, basic_block);
 
   // Add entry into the code cache hash table
@@ -212,7 +248,7 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   // from scan_x could result in duplicate BBS or an infinite recursive call
   block_address |= thumb;
   if (!stub) {
-    if (!hash_add(&thread_data->entry_address, (uintptr_t)address, block_address)) {
+    if (!hash_add(thread_data->entry_address, (uintptr_t)address, block_address)) {
       fprintf(stderr, "Failed to add hash table entry for newly created basic block\n");
       while(1);
     }
@@ -232,6 +268,8 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   block_size = scan_a64(thread_data, (uint32_t *)address, basic_block, mambo_bb, NULL);
 #endif
 
+  hash_clear_stale(thread_data, HASH_CLEAR_STEP);
+
   // Flush modified instructions from caches
   // End address is exclusive
   if (thread_data->free_block < basic_block) {
@@ -247,108 +285,349 @@ uintptr_t scan(dbm_thread *thread_data, uint16_t *address, int basic_block) {
   return adjust_cc_entry(block_address);
 }
 
-int lock_thread_list() {
-  return pthread_mutex_lock(&global_data.thread_list_mutex);
+static inline unsigned int thread_registry_index(pid_t tid) {
+  // TIDs are mostly allocated sequentially, so they are used as their own hash
+  return (unsigned int)tid & (THREAD_REGISTRY_SIZE - 1);
 }
 
-int unlock_thread_list() {
-  return pthread_mutex_unlock(&global_data.thread_list_mutex);
+/* Readers of the registry, other than a thread looking up itself, must hold
+   the read lock while they access the dbm_thread structures they've found */
+int thread_registry_read_lock() {
+  int epoch;
+  while (true) {
+    epoch = global_data.thread_registry_epoch & 1;
+    atomic_increment_int((int32_t *)&global_data.thread_registry_readers[epoch], 1);
+    // the registry must only be read after the reader has been counted
+    asm volatile("DMB SY" ::: "memory");
+    /* If the epoch has changed since it was read, a concurrent synchronize
+       might have already finished waiting for this counter */
+    if ((global_data.thread_registry_epoch & 1) == epoch) {
+      return epoch;
+    }
+    atomic_increment_int((int32_t *)&global_data.thread_registry_readers[epoch], -1);
+  }
 }
 
-int register_thread(dbm_thread *thread_data, bool caller_has_lock) {
-  int ret;
+void thread_registry_read_unlock(int epoch) {
+  asm volatile("DMB SY" ::: "memory");
+  atomic_increment_int((int32_t *)&global_data.thread_registry_readers[epoch], -1);
+}
 
-  if (!caller_has_lock) {
-    ret = lock_thread_list();
-    assert(ret == 0);
+/* Waits until all the readers which might have found an entry removed before
+   the call have released the read lock. Readers which start during the grace
+   period are counted in the other epoch, so they can't delay it indefinitely,
+   and they can't see the removed entries anyway. */
+void thread_registry_synchronize() {
+  int ret = pthread_mutex_lock(&global_data.thread_registry_mutex);
+  assert(ret == 0);
+
+  asm volatile("DMB SY" ::: "memory");
+  int epoch = global_data.thread_registry_epoch & 1;
+  global_data.thread_registry_epoch++;
+  asm volatile("DMB SY" ::: "memory");
+
+  while (global_data.thread_registry_readers[epoch] != 0) {
+    raw_syscall(__NR_sched_yield);
+  }
+
+  ret = pthread_mutex_unlock(&global_data.thread_registry_mutex);
+  assert(ret == 0);
+}
+
+// Returns NULL if the TID isn't registered, lock-free and async-signal-safe
+dbm_thread *thread_lookup(pid_t tid) {
+  unsigned int index = thread_registry_index(tid);
+  for (int i = 0; i < THREAD_REGISTRY_SIZE; i++) {
+    thread_registry_entry *entry = &global_data.thread_registry[index];
+    pid_t entry_tid = entry->tid;
+    if (entry_tid == 0) {
+      break;
+    }
+    if (entry_tid == tid) {
+      asm volatile("DMB SY" ::: "memory");
+      dbm_thread *thread = entry->thread;
+      // the entry may have been reused for a different TID in the meantime
+      if (thread != NULL && thread->tid == tid) {
+        return thread;
+      }
+      break;
+    }
+    index = (index + 1) & (THREAD_REGISTRY_SIZE - 1);
+  }
+  return NULL;
+}
+
+/* Iterates over the registered threads, starting with *index = 0, until it
+   returns NULL. It must be called with the read lock held. Threads registered
+   or unregistered during the iteration may or may not be returned. */
+dbm_thread *thread_registry_next(int *index) {
+  while (*index < THREAD_REGISTRY_SIZE) {
+    dbm_thread *thread = global_data.thread_registry[*index].thread;
+    (*index)++;
+    if (thread != NULL) {
+      return thread;
+    }
+  }
+  return NULL;
+}
+
+// Claims an entry for thread_data->tid and publishes the fully initialised thread_data
+static int thread_registry_insert(dbm_thread *thread_data) {
+  pid_t tid = thread_data->tid;
+  unsigned int index = thread_registry_index(tid);
+  thread_registry_entry *entry = NULL;
+
+  int ret = pthread_mutex_lock(&global_data.thread_registry_write_mutex);
+  assert(ret == 0);
+
+  for (int i = 0; i < THREAD_REGISTRY_SIZE && entry == NULL; i++) {
+    thread_registry_entry *e = &global_data.thread_registry[index];
+    pid_t entry_tid = e->tid;
+    if (entry_tid == 0 || entry_tid == THREAD_REGISTRY_TOMBSTONE) {
+      e->tid = tid;
+      entry = e;
+    } else {
+      index = (index + 1) & (THREAD_REGISTRY_SIZE - 1);
+    }
   }
 
-  thread_data->next_thread = global_data.threads;
-  global_data.threads = thread_data;
+  if (entry != NULL) {
+    asm volatile("DMB SY" ::: "memory");
+    entry->thread = thread_data;
+    asm volatile("DMB SY" ::: "memory");
+  }
+
+  ret = pthread_mutex_unlock(&global_data.thread_registry_write_mutex);
+  assert(ret == 0);
+
+  return (entry != NULL) ? 0 : -1;
+}
+
+// register_thread() is always called by the thread itself, from MAMBO's context
+int register_thread(dbm_thread *thread_data) {
+#ifdef DBM_NATIVE_TLS
+  asm volatile("MRS %0, TPIDR_EL0" : "=r" (thread_data->mambo_tls));
+#endif
+
+  int ret = thread_registry_insert(thread_data);
+  if (ret != 0) {
+    return ret;
+  }
 
   mambo_deliver_callbacks(PRE_THREAD_C, thread_data);
 
-  if (!caller_has_lock) {
-    ret = unlock_thread_list();
-    assert(ret == 0);
+  /* dbm_exit() might have scanned the registry before this thread was added,
+     in which case it won't wait for it to stop */
+  if (global_data.exit_group) {
+    thread_abort(thread_data);
   }
 
   return 0;
 }
 
-int unregister_thread(dbm_thread *thread_data, bool caller_has_lock) {
-  int ret, status = 0;
+// Removes thread_data from the registry, readers might still be accessing it
+int thread_registry_remove(dbm_thread *thread_data) {
+  unsigned int index = thread_registry_index(thread_data->tid);
+  thread_registry_entry *entry = NULL;
+
+  int ret = pthread_mutex_lock(&global_data.thread_registry_write_mutex);
+  assert(ret == 0);
 
-  if (!caller_has_lock) {
-    ret = lock_thread_list();
+  for (int i = 0; i < THREAD_REGISTRY_SIZE; i++) {
+    thread_registry_entry *e = &global_data.thread_registry[index];
+    if (e->tid == 0) {
+      break;
+    }
+    if (e->thread == thread_data) {
+      entry = e;
+      break;
+    }
+    index = (index + 1) & (THREAD_REGISTRY_SIZE - 1);
+  }
+  if (entry == NULL) {
+    ret = pthread_mutex_unlock(&global_data.thread_registry_write_mutex);
     assert(ret == 0);
+    return -1;
   }
 
-  if (global_data.threads == thread_data) {
-    global_data.threads = thread_data->next_thread;
-  } else {
-    dbm_thread *prev_thread = global_data.threads;
-    while (prev_thread->next_thread != thread_data && prev_thread->next_thread != NULL) {
-      prev_thread = prev_thread->next_thread;
-    }
-    if (prev_thread->next_thread == thread_data) {
-      prev_thread->next_thread = thread_data->next_thread;
-    } else {
-      status = -1;
+#ifdef DBM_STATS
+  stats_thread_exit(thread_data);
+#endif
+  entry->thread = NULL;
+  asm volatile("DMB SY" ::: "memory");
+  entry->tid = THREAD_REGISTRY_TOMBSTONE;
+
+  /* A run of tombstones followed by an empty entry isn't on the probe sequence
+     of any registered TID, so it's cleared. Otherwise, lookups of absent TIDs
+     would eventually probe the whole table in processes creating many threads. */
+  unsigned int next = (index + 1) & (THREAD_REGISTRY_SIZE - 1);
+  if (global_data.thread_registry[next].tid == 0) {
+    while (global_data.thread_registry[index].tid == THREAD_REGISTRY_TOMBSTONE) {
+      global_data.thread_registry[index].tid = 0;
+      index = (index - 1) & (THREAD_REGISTRY_SIZE - 1);
     }
   }
 
-  if (status == 0) {
-    mambo_deliver_callbacks(POST_THREAD_C, thread_data);
+  ret = pthread_mutex_unlock(&global_data.thread_registry_write_mutex);
+  assert(ret == 0);
+
+  return 0;
+}
+
+/* Also called by the thread itself. On return, no other thread is accessing
+   thread_data through the registry and it can be freed. */
+int unregister_thread(dbm_thread *thread_data) {
+  if (thread_registry_remove(thread_data) != 0) {
+    return -1;
   }
 
-  if (!caller_has_lock) {
-    ret = unlock_thread_list();
-    assert(ret == 0);
+  mambo_deliver_callbacks(POST_THREAD_C, thread_data);
+
+  thread_registry_synchronize();
+
+  return 0;
+}
+
+#ifdef DBM_NATIVE_TLS
+/* Switches TPIDR_EL0 to MAMBO's TLS pointer when entering from code which might be
+   running with the application's TLS pointer, such as the signal handler. It must
+   not access TLS before the switch. Returns the thread to pass to native_tls_leave(),
+   or NULL if the thread isn't registered, in which case TPIDR_EL0 isn't switched. */
+dbm_thread *native_tls_enter() {
+  pid_t tid = raw_syscall(__NR_gettid);
+  dbm_thread *thread_data = thread_lookup(tid);
+  if (thread_data != NULL) {
+    uintptr_t tls;
+    asm volatile("MRS %0, TPIDR_EL0" : "=r" (tls));
+    if (tls != thread_data->mambo_tls) {
+      thread_data->tls = tls;
+      asm volatile("MSR TPIDR_EL0, %0" : : "r" (thread_data->mambo_tls));
+    }
   }
+  return thread_data;
+}
 
-  return status;
+/* Switches TPIDR_EL0 to the application's TLS pointer of thread_data, TLS can't be
+   used afterwards. Does nothing for NULL, returned by native_tls_enter() when it
+   didn't switch. */
+void native_tls_leave(dbm_thread *thread_data) {
+  if (thread_data != NULL) {
+    asm volatile("MSR TPIDR_EL0, %0" : : "r" (thread_data->tls) : "memory");
+  }
 }
+#endif
 
-void dbm_exit(dbm_thread *thread_data, uint32_t code) {
-  fprintf(stderr, "We're done; exiting with status: %d\n", code);
+// Returns 0 when woken up, or a negative error code such as -EAGAIN or -ETIMEDOUT
+int futex_wait(volatile int *addr, int val, const struct timespec *timeout) {
+  return raw_syscall(__NR_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
 
-#ifdef PLUGINS_NEW
-  lock_thread_list();
-  pid_t pid = getpid();
-  global_data.exit_group = 1;
+int futex_wake(volatile int *addr, int count) {
+  return raw_syscall(__NR_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
-  bool done;
-  do {
-    for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
-      if (thread != thread_data && thread->status == THREAD_RUNNING) {
-        syscall(__NR_tgkill, pid, thread->tid, UNLINK_SIGNAL);
-      }
-    }
-    usleep(100);
+/* Called after a thread's status has changed from THREAD_RUNNING, wakes up
+   the threads waiting in dbm_exit() or in the detacher for other threads to stop */
+void exit_barrier_notify() {
+  if (global_data.exit_group || global_data.detach != DETACH_NONE) {
+    // make the new status visible before the sequence number changes
+    asm volatile("DMB SY" ::: "memory");
+    atomic_increment_int((int32_t *)&global_data.exit_barrier_seq, 1);
+    futex_wake(&global_data.exit_barrier_seq, INT_MAX);
+  }
+}
+
+#define EXIT_SIGNAL_RETRY_NS (10 * 1000 * 1000)
 
-    done = true;
-    for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
-      if (thread != thread_data) {
-        if (thread->status == THREAD_RUNNING) {
-          done = false;
+/* Sets exit_group and returns once all other threads have either aborted or
+   entered a syscall, on return from which they'll abort. Only the first
+   thread to call it returns, any others abort. */
+void stop_other_threads(dbm_thread *thread_data) {
+  if (atomic_compare_and_swap_i32((int32_t *)&global_data.exit_group, 0, 1) != 0) {
+    thread_abort(thread_data);
+  }
+  asm volatile("DMB SY" ::: "memory");
+  pid_t pid = getpid();
+  int registry_epoch = thread_registry_read_lock();
+
+  /* Signal the running threads and wait for them to stop. The signals are
+     only sent again if no thread has stopped in EXIT_SIGNAL_RETRY_NS. */
+  const struct timespec retry = {0, EXIT_SIGNAL_RETRY_NS};
+  bool send_signals = true;
+  while (true) {
+    int seq = global_data.exit_barrier_seq;
+    asm volatile("DMB SY" ::: "memory");
+    bool done = true;
+    dbm_thread *thread;
+    for (int index = 0; (thread = thread_registry_next(&index)) != NULL;) {
+      if (thread != thread_data && thread->status == THREAD_RUNNING) {
+        done = false;
+        if (send_signals) {
+          syscall(__NR_tgkill, pid, thread->tid, UNLINK_SIGNAL);
         }
       }
     }
-  } while (!done);
+    if (done) {
+      break;
+    }
+    send_signals = (futex_wait(&global_data.exit_barrier_seq, seq, &retry) == -ETIMEDOUT);
+  }
+  thread_registry_read_unlock(registry_epoch);
+}
 
-  for (dbm_thread *thread = global_data.threads; thread != NULL; thread = thread->next_thread) {
+void dbm_exit(dbm_thread *thread_data, uint32_t code) {
+  fprintf(stderr, "We're done; exiting with status: %d\n", code);
+
+#ifdef PLUGINS_NEW
+  stop_other_threads(thread_data);
+
+  int registry_epoch = thread_registry_read_lock();
+  dbm_thread *thread;
+  for (int index = 0; (thread = thread_registry_next(&index)) != NULL;) {
     mambo_deliver_callbacks(POST_THREAD_C, thread);
   }
+  thread_registry_read_unlock(registry_epoch);
 
   mambo_deliver_callbacks(EXIT_C, thread_data);
 #endif
 
+#ifdef DBM_STATS
+  stats_exit();
+#endif
+
+#ifdef DBM_LIVENESS_STATS
+  fprintf(stderr, "Liveness: %" PRIu64 " register saves avoided in %" PRIu64 " fragments\n",
+          global_data.liveness_spills_avoided, global_data.liveness_fragments);
+  if (global_data.liveness_fragments > 0) {
+    fprintf(stderr, "Liveness: %.2f register saves avoided per fragment\n",
+            (double)global_data.liveness_spills_avoided / global_data.liveness_fragments);
+  }
+  for (int i = 0; i < LIVENESS_HIST_SIZE; i++) {
+    fprintf(stderr, "Liveness: %" PRIu64 " fragments with %d%s saves avoided\n",
+            global_data.liveness_spills_hist[i], i, (i == LIVENESS_HIST_SIZE - 1) ? " or more" : "");
+  }
+  fprintf(stderr, "Liveness: %" PRIu64 " push instructions removed by merging with a pop\n",
+          global_data.merged_push_pop_insts);
+#ifdef PLUGINS_NEW
+  for (int i = 0; i < global_data.free_plugin; i++) {
+    fprintf(stderr, "Liveness: plugin %d: %" PRIu64 " flag saves avoided\n",
+            i, global_data.plugins[i].flags_saves_avoided);
+  }
+#endif
+#endif
+
   exit(code);
 }
 
 void thread_abort(dbm_thread *thread_data) {
   thread_data->status = THREAD_EXIT;
+  exit_barrier_notify();
+#ifdef DBM_ATTACH
+  // not a MAMBO pthread, see attach_thread_entry
+  if (thread_data->attached) {
+    return_with_sp(thread_data->mambo_sp);
+  }
+#endif
   pthread_exit(NULL);
 }
 
@@ -362,6 +641,10 @@ bool allocate_thread_data(dbm_thread **thread_data) {
 }
 
 int free_thread_data(dbm_thread *thread_data) {
+  // any vfork child has already exited or called execve
+  if (thread_data->vfork_child != NULL) {
+    free_thread_data(thread_data->vfork_child);
+  }
   if (munmap(thread_data->code_cache, CC_SZ_ROUND(sizeof(dbm_code_cache))) != 0) {
     fprintf(stderr, "Error freeing code cache on exit()\n");
     while(1);
@@ -370,6 +653,19 @@ int free_thread_data(dbm_thread *thread_data) {
     fprintf(stderr, "Error freeing CC link struct on exit()\n");
     while(1);
   }
+  if (munmap(thread_data->code_cache_meta_cold,
+             METADATA_SZ_ROUND(sizeof(dbm_code_cache_meta_cold) * (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO))) != 0) {
+    fprintf(stderr, "Error freeing cold fragment metadata on exit()\n");
+    while(1);
+  }
+  if (munmap(thread_data->hash_tables, METADATA_SZ_ROUND(sizeof(hash_table) * 2)) != 0) {
+    fprintf(stderr, "Error freeing hash tables on exit()\n");
+    while(1);
+  }
+  if (munmap(thread_data->pc_map, PC_MAP_SIZE) != 0) {
+    fprintf(stderr, "Error freeing TPC->SPC maps on exit()\n");
+    while(1);
+  }
   if (munmap(thread_data, METADATA_SZ_ROUND(sizeof(dbm_thread))) != 0) {
     fprintf(stderr, "Error freeing thread private structure on exit()\n");
     while(1);
@@ -377,11 +673,94 @@ int free_thread_data(dbm_thread *thread_data) {
   return 0;
 }
 
-void init_thread(dbm_thread *thread_data) {
-  dbm_thread **dispatcher_thread_data;
+#ifdef DBM_THREAD_POOL
+/* Called by an exiting thread. Its code cache and metadata are kept in the
+   pool for the next thread created, which saves mapping them again and
+   faulting in their pages. Their contents are reset like after a flush. */
+int recycle_thread_data(dbm_thread *thread_data) {
+  bool pooled = false;
+
+  int ret = pthread_mutex_lock(&global_data.thread_pool_mutex);
+  assert(ret == 0);
+  if (global_data.thread_pool_count < THREAD_POOL_SIZE) {
+    dbm_thread_mappings *mappings = &global_data.thread_pool[global_data.thread_pool_count++];
+    mappings->code_cache = thread_data->code_cache;
+    mappings->cc_links = thread_data->cc_links;
+    mappings->code_cache_meta_cold = thread_data->code_cache_meta_cold;
+    mappings->hash_tables = thread_data->hash_tables;
+    mappings->cache_generation = thread_data->cache_generation;
+    mappings->pc_map = thread_data->pc_map;
+    pooled = true;
+  }
+  ret = pthread_mutex_unlock(&global_data.thread_pool_mutex);
+  assert(ret == 0);
+
+  if (!pooled) {
+    return free_thread_data(thread_data);
+  }
+  if (thread_data->vfork_child != NULL) {
+    free_thread_data(thread_data->vfork_child);
+  }
+  if (munmap(thread_data, METADATA_SZ_ROUND(sizeof(dbm_thread))) != 0) {
+    fprintf(stderr, "Error freeing thread private structure on exit()\n");
+    while(1);
+  }
+  return 0;
+}
+
+static bool thread_pool_get(dbm_thread *thread_data) {
+  bool found = false;
+
+  int ret = pthread_mutex_lock(&global_data.thread_pool_mutex);
+  assert(ret == 0);
+  if (global_data.thread_pool_count > 0) {
+    dbm_thread_mappings *mappings = &global_data.thread_pool[--global_data.thread_pool_count];
+    thread_data->code_cache = mappings->code_cache;
+    thread_data->cc_links = mappings->cc_links;
+    thread_data->code_cache_meta_cold = mappings->code_cache_meta_cold;
+    thread_data->hash_tables = mappings->hash_tables;
+    thread_data->cache_generation = mappings->cache_generation;
+    thread_data->pc_map = mappings->pc_map;
+    found = true;
+  }
+  ret = pthread_mutex_unlock(&global_data.thread_pool_mutex);
+  assert(ret == 0);
+
+  return found;
+}
+#endif
+
+#ifdef DBM_CC_THP
+/* Only the mapping changes: fragments are still placed by allocate_bb() and
+   never relocated, but with huge pages the whole code cache is covered by a
+   few I-TLB entries. MADV_HUGEPAGE is only a hint, without THP support the
+   code cache is mapped with small pages. */
+static void *cc_mmap_thp(size_t size) {
+  size = CC_SZ_ROUND(size);
+  uint8_t *map = mmap(NULL, size + CC_THP_SIZE, PROT_EXEC | PROT_READ | PROT_WRITE, CC_MMAP_OPTS, -1, 0);
+  if (map == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+
+  // keep the part aligned to CC_THP_SIZE
+  uint8_t *start = (uint8_t *)ROUND_UP((uintptr_t)map, CC_THP_SIZE);
+  if (start != map) {
+    munmap(map, start - map);
+  }
+  munmap(start + size, (map + size + CC_THP_SIZE) - (start + size));
+
+  madvise(start, size, MADV_HUGEPAGE);
+  return start;
+}
+#endif
 
+static void map_thread_data(dbm_thread *thread_data) {
   // Initialize code cache
+#ifdef DBM_CC_THP
+  thread_data->code_cache = cc_mmap_thp(sizeof(dbm_code_cache));
+#else
   thread_data->code_cache = mmap(NULL, sizeof(dbm_code_cache), PROT_EXEC | PROT_READ | PROT_WRITE, CC_MMAP_OPTS, -1, 0);
+#endif
   if (thread_data->code_cache == MAP_FAILED) {
     fprintf(stderr, "Allocating code cache space failed\n");
     while(1);
@@ -391,8 +770,32 @@ void init_thread(dbm_thread *thread_data) {
   thread_data->cc_links = mmap(NULL, sizeof(ll) + sizeof(ll_entry) * MAX_CC_LINKS, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
   assert(thread_data->cc_links != MAP_FAILED);
 
+  thread_data->code_cache_meta_cold = mmap(NULL, sizeof(dbm_code_cache_meta_cold) * (CODE_CACHE_SIZE + TRACE_FRAGMENT_NO),
+                                           PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+  assert(thread_data->code_cache_meta_cold != MAP_FAILED);
+
+  thread_data->hash_tables = mmap(NULL, sizeof(hash_table) * 2, PROT_READ | PROT_WRITE, METADATA_MMAP_OPTS, -1, 0);
+  assert(thread_data->hash_tables != MAP_FAILED);
+}
+
+void init_thread(dbm_thread *thread_data) {
+  dbm_thread **dispatcher_thread_data;
+  bool recycled = false;
+
+#ifdef DBM_THREAD_POOL
+  recycled = thread_pool_get(thread_data);
+#endif
+  if (!recycled) {
+    map_thread_data(thread_data);
+  }
+
   // Initialize the hash table and basic block allocator, mark all BBs as unknown type
   flush_code_cache(thread_data);
+#ifdef DBM_STATS
+  // the initial flush isn't counted
+  memset(thread_data->stats, 0, sizeof(thread_data->stats));
+  thread_data->stats_retired = false;
+#endif
 
   // Copy the trampolines to the code cache
   memcpy(&thread_data->code_cache->blocks[0], &start_of_dispatcher_s, trampolines_size_bytes);
@@ -403,7 +806,13 @@ void init_thread(dbm_thread *thread_data) {
 
   uint32_t **dispatcher_is_pending = (uint32_t **)((uintptr_t)&thread_data->code_cache->blocks[0]
                                            + th_is_pending_ptr_offset);
-  *dispatcher_is_pending = &thread_data->is_signal_pending;
+  *dispatcher_is_pending = signal_pending_flag(thread_data);
+
+#ifdef DBM_NATIVE_TLS
+  uintptr_t **dispatcher_tls = (uintptr_t **)((uintptr_t)&thread_data->code_cache->blocks[0]
+                                              + th_tls_ptr_offset);
+  *dispatcher_tls = &thread_data->tls;
+#endif
 
   debug("*thread_data in dispatcher at: %p\n", dispatcher_thread_data);
 
@@ -432,27 +841,44 @@ void init_thread(dbm_thread *thread_data) {
   debug("Syscall wrapper addr: 0x%x\n", thread_data->syscall_wrapper_addr);
 }
 
+// After fork, only the calling thread exists and nothing else can access the registry
 void free_all_other_threads(dbm_thread *thread_data) {
-  dbm_thread *it = global_data.threads;
-  while(it != NULL) {
-    dbm_thread *next = thread_data->next_thread;
-    if (it != thread_data) {
-      assert(free_thread_data(it) == 0);
+  for (int i = 0; i < THREAD_REGISTRY_SIZE; i++) {
+    dbm_thread *thread = global_data.thread_registry[i].thread;
+    if (thread != NULL && thread != thread_data) {
+      assert(free_thread_data(thread) == 0);
     }
-    it = next;
   }
-  global_data.threads = thread_data;
+  memset(global_data.thread_registry, 0, THREAD_REGISTRY_SIZE * sizeof(thread_registry_entry));
+  global_data.thread_registry_readers[0] = 0;
+  global_data.thread_registry_readers[1] = 0;
+
+  int ret = thread_registry_insert(thread_data);
+  assert(ret == 0);
 }
 
 
 void reset_process(dbm_thread *thread_data) {
   thread_data->tid = syscall(__NR_gettid);
 
-  int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
+  int ret = pthread_mutex_init(&global_data.thread_registry_mutex, NULL);
+  assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.thread_registry_write_mutex, NULL);
   assert(ret == 0);
+#ifdef DBM_THREAD_POOL
+  // the pooled mappings are private, the child keeps its own copies
+  ret = pthread_mutex_init(&global_data.thread_pool_mutex, NULL);
+  assert(ret == 0);
+#endif
 
   current_thread = thread_data;
   free_all_other_threads(thread_data);
+#ifdef __aarch64__
+  detach_reset();
+#endif
+#ifdef DBM_STATS
+  stats_reset(thread_data);
+#endif
 
   /*
       MASSIVE HACK
@@ -499,25 +925,7 @@ int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
   }
 
 #ifdef DBM_TRACES
-  int first = CODE_CACHE_SIZE;
-  int last = thread_data->active_trace.id - 1;
-  int pivot;
-
-  if (addr >= thread_data->code_cache_meta[last].tpc) {
-    assert((void *)addr < (((void *)&thread_data->code_cache) + sizeof(dbm_code_cache)));
-    return last;
-  }
-
-  while (first <= last) {
-    pivot = (first + last) / 2;
-    if (addr < thread_data->code_cache_meta[pivot].tpc) {
-      last = pivot - 1;
-    } else if (addr >= thread_data->code_cache_meta[pivot+1].tpc) {
-      first = pivot + 1;
-    } else {
-      return pivot;
-    }
-  }
+  return trace_dir_lookup(thread_data, addr);
 #endif
 
   return -1;
@@ -526,6 +934,7 @@ int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr) {
 // TODO: handle links to traces
 void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t linked_to_addr) {
   int linked_to = addr_to_bb_id(thread_data, linked_to_addr);
+  stats_inc(thread_data, STATS_LINKS);
 
   debug("Linked 0x%x (%d) from 0x%x\n", linked_to_addr, linked_to, linked_from);
 
@@ -535,8 +944,8 @@ void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t li
   assert(entry != NULL);
 
   entry->data = linked_from;
-  entry->next = thread_data->code_cache_meta[linked_to].linked_from;
-  thread_data->code_cache_meta[linked_to].linked_from = entry;
+  entry->next = thread_data->code_cache_meta_cold[linked_to].linked_from;
+  thread_data->code_cache_meta_cold[linked_to].linked_from = entry;
 }
 
 void notify_vm_op(vm_op_t op, uintptr_t addr, size_t size, int prot, int flags, int fd, off_t off) {
@@ -546,6 +955,11 @@ void notify_vm_op(vm_op_t op, uintptr_t addr, size_t size, int prot, int flags,
         int ret = interval_map_add(&global_data.exec_allocs, addr, addr + size, fd);
         assert(ret == 0);
       }
+#ifdef DBM_AOT
+      if (fd >= 0 && (prot & PROT_EXEC) && (flags & MAP_APP)) {
+        aot_add_elf(fd, addr, off);
+      }
+#endif
 #ifdef PLUGINS_NEW
       if (fd >= 0 && (prot & PROT_EXEC)) {
         Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
@@ -563,6 +977,7 @@ void notify_vm_op(vm_op_t op, uintptr_t addr, size_t size, int prot, int flags,
       assert(ret >= 0);
       // TODO: flush the code cache in all threads
       if (ret >= 1) {
+        atomic_increment_u32(&global_data.exec_allocs_generation, 1);
         flush_code_cache(current_thread);
       }
       break;
@@ -604,6 +1019,23 @@ void main(int argc, char **argv, char **envp) {
     exit(EXIT_FAILURE);
   }
 
+#ifdef DBM_ATTACH
+  if (strcmp(argv[1], "--attach") == 0) {
+    if (argc != 3) {
+      printf("Syntax: dbm --attach pid\n");
+      exit(EXIT_FAILURE);
+    }
+    attach_process(atoi(argv[2])); // doesn't return
+  }
+  // started by attach_process() in the target process
+  bool attached = (strcmp(argv[1], ATTACH_BOOT_ARG) == 0);
+#endif
+
+#ifdef DBM_FORK_SERVER
+  // continues here in each process started by the fork server, with its arguments
+  fork_server_start(&argc, &argv, &envp);
+#endif
+
   global_data.argc = argc;
   global_data.argv = argv;
 
@@ -611,7 +1043,9 @@ void main(int argc, char **argv, char **envp) {
   PAGE_SIZE;
   assert(page_size > 0);
 
-  int ret = pthread_mutex_init(&global_data.thread_list_mutex, NULL);
+  int ret = pthread_mutex_init(&global_data.thread_registry_mutex, NULL);
+  assert(ret == 0);
+  ret = pthread_mutex_init(&global_data.thread_registry_write_mutex, NULL);
   assert(ret == 0);
 
   ret = interval_map_init(&global_data.exec_allocs, 512);
@@ -620,7 +1054,33 @@ void main(int argc, char **argv, char **envp) {
   ret = pthread_mutex_init(&global_data.signal_handlers_mutex, NULL);
   assert(ret == 0);
 
+#ifdef DBM_THREAD_POOL
+  ret = pthread_mutex_init(&global_data.thread_pool_mutex, NULL);
+  assert(ret == 0);
+#endif
+
+  global_data.thread_registry = mmap(NULL, THREAD_REGISTRY_SIZE * sizeof(thread_registry_entry),
+                                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(global_data.thread_registry != MAP_FAILED);
+
+#ifdef DBM_LSE_ATOMICS
+  global_data.lse_atomics = (getauxval(AT_HWCAP) & HWCAP_ATOMICS) != 0;
+#endif
+
   install_system_sig_handlers();
+  syscall_filter_init();
+#ifdef DBM_STATS
+  stats_init();
+#endif
+#ifdef DBM_AOT
+  aot_init();
+#endif
+
+#ifdef DBM_ATTACH
+  if (attached) {
+    attach_start(argv[2]); // doesn't return
+  }
+#endif
 
   global_data.brk = 0;
   struct elf_loader_auxv auxv;
@@ -645,10 +1105,17 @@ void main(int argc, char **argv, char **envp) {
   current_thread = thread_data;
   init_thread(thread_data);
   thread_data->tid = syscall(__NR_gettid);
-  register_thread(thread_data, false);
+  ret = register_thread(thread_data);
+  assert(ret == 0);
 
   uintptr_t block_address = scan(thread_data, (uint16_t *)entry_address, ALLOCATE_BB);
   debug("Address of first basic block is: 0x%x\n", block_address);
+#ifdef DBM_AOT
+  aot_translate(thread_data, false);
+  if (thread_data->was_flushed) {
+    block_address = lookup_or_scan(thread_data, entry_address, NULL);
+  }
+#endif
 
   #define ARGDIFF 2
   elf_run(block_address, argv[1], argc-ARGDIFF, &argv[ARGDIFF], envp, &auxv);
@@ -35,23 +35,44 @@
 
 #include "common.h"
 #include "util.h"
+#include "syscalls.h"
 
 /* Various parameters which can be tuned */
 
+/* With DBM_LARGE_CODE_CACHE, the code cache spans the +/-128 MiB range of B
+   on A64 instead of 16 MiB. All links between fragments are B instructions,
+   so the larger code cache needs no veneers. */
+#ifdef DBM_LARGE_CODE_CACHE
+  #ifndef __aarch64__
+    #error DBM_LARGE_CODE_CACHE is only supported on AArch64
+  #endif
+  #define CODE_CACHE_SCALE 8
+#else
+  #define CODE_CACHE_SCALE 1
+#endif
+
 // BASIC_BLOCK_SIZE should be a power of 2
 #define BASIC_BLOCK_SIZE 64
 #ifdef DBM_TRACES
-  #define CODE_CACHE_SIZE 55000
+  #define CODE_CACHE_SIZE (55000 * CODE_CACHE_SCALE)
 #else
-  #define CODE_CACHE_SIZE 65000
+  #define CODE_CACHE_SIZE (65000 * CODE_CACHE_SCALE)
 #endif
-#define TRACE_FRAGMENT_NO 60000
+#define TRACE_FRAGMENT_NO (60000 * CODE_CACHE_SCALE)
 #define CODE_CACHE_OVERP 30
 #define TRACE_FRAGMENT_OVERP 50
-#define MAX_BRANCH_RANGE (16*1024*1024)
+#define MAX_BRANCH_RANGE (16*1024*1024 * CODE_CACHE_SCALE)
 #define TRACE_CACHE_SIZE (MAX_BRANCH_RANGE - (CODE_CACHE_SIZE*BASIC_BLOCK_SIZE * 4))
 #define TRACE_LIMIT_OFFSET (2*1024)
 
+// the directory over the trace cache used by addr_to_fragment_id()
+#define TRACE_DIR_SHIFT 12
+#define TRACE_DIR_SIZE ((TRACE_CACHE_SIZE >> TRACE_DIR_SHIFT) + 1)
+// the space for the TPC->SPC maps of the fragments in a code cache
+#define PC_MAP_SIZE (MAX_BRANCH_RANGE / 2)
+// the maximum number of instructions in an A64 exclusive region with deferred instrumentation
+#define A64_MAX_EXCLUSIVE_REGION 32
+
 #define TRACE_ALIGN 4 // must be a power of 2
 #define TRACE_ALIGN_MASK (TRACE_ALIGN-1)
 
@@ -73,6 +94,94 @@
 
 #define MAX_PLUGIN_NO (10)
 
+/* With DBM_NATIVE_TLS, TPIDR_EL0 holds the application's TLS pointer while
+   executing from the code cache and MAMBO's own only while running its C code */
+#ifdef DBM_NATIVE_TLS
+  #ifndef __aarch64__
+    #error DBM_NATIVE_TLS is only supported on AArch64
+  #endif
+#endif
+
+#ifdef DBM_LIVENESS_STATS
+  #ifndef __aarch64__
+    #error DBM_LIVENESS_STATS is only supported on AArch64
+  #endif
+  // fragments are counted by the number of register saves avoided in them, up to LIVENESS_HIST_SIZE - 1 or more
+  #define LIVENESS_HIST_SIZE 8
+#endif
+
+/* With DBM_LSE_ATOMICS, simple LDXR / ADD / STXR loops are translated to LSE
+   atomics on cores which implement them */
+#ifdef DBM_LSE_ATOMICS
+  #ifndef __aarch64__
+    #error DBM_LSE_ATOMICS is only supported on AArch64
+  #endif
+#endif
+
+/* With DBM_SIGNAL_POLL, asynchronous signals don't unlink the interrupted
+   fragment, translated code checks for them at back-edges and indirect branches */
+#ifdef DBM_SIGNAL_POLL
+  #ifndef __aarch64__
+    #error DBM_SIGNAL_POLL is only supported on AArch64
+  #endif
+#endif
+
+/* With DBM_INLINE_SYSCALLS, syscalls which neither MAMBO nor any plugin needs
+   to see are executed directly from the code cache */
+#ifdef DBM_INLINE_SYSCALLS
+  #ifndef __aarch64__
+    #error DBM_INLINE_SYSCALLS is only supported on AArch64
+  #endif
+#endif
+
+/* With DBM_ATTACH, dbm --attach PID injects MAMBO into a running process and
+   takes over all its threads */
+#ifdef DBM_ATTACH
+  #ifndef __aarch64__
+    #error DBM_ATTACH is only supported on AArch64
+  #endif
+#endif
+
+/* With DBM_PRETRANSLATE, the dispatcher translates the direct branch targets
+   of each new basic block a few levels deep and links them ahead of execution,
+   synchronously, see pretranslate_successors() */
+#ifdef DBM_PRETRANSLATE
+  #ifndef __aarch64__
+    #error DBM_PRETRANSLATE is only supported on AArch64
+  #endif
+  #define PRETRANSLATE_DEPTH 3
+  #define PRETRANSLATE_MAX_BLOCKS 16
+#endif
+
+/* With DBM_AOT, the functions listed in the file named by MAMBO_AOT are
+   translated and linked before the application starts, see aot.c */
+#ifdef DBM_AOT
+  #ifndef __aarch64__
+    #error DBM_AOT is only supported on AArch64
+  #endif
+#endif
+
+/* With DBM_STATS_TIMING, the time spent in each dispatcher call is added to
+   the dispatcher_ns counter, at the cost of two clock_gettime calls per call */
+#ifdef DBM_STATS_TIMING
+  #ifndef DBM_STATS
+    #error DBM_STATS_TIMING requires DBM_STATS
+  #endif
+#endif
+
+/* With DBM_CC_THP, the code cache is aligned to the huge page size and marked
+   with MADV_HUGEPAGE, so it can be backed by transparent huge pages, which
+   don't have to be reserved like CC_HUGETLB. Fragments aren't relocated: the
+   only placement of hot code is DBM_TRACES, which translates again the code
+   reached from hot trace heads into the packed trace cache. There's no
+   periodic compaction of hot basic blocks. */
+#ifdef DBM_CC_THP
+  #ifdef CC_HUGETLB
+    #error DBM_CC_THP and CC_HUGETLB are mutually exclusive
+  #endif
+  #define CC_THP_SIZE (2*1024*1024)
+#endif
+
 typedef enum {
   mambo_bb = 0,
   mambo_trace,
@@ -133,6 +242,8 @@ typedef struct {
 #define BOTH_LINKED (1 << 2)
 
 #define MAX_SAVED_EXIT_SZ 12
+/* The metadata of each fragment used when dispatching, linking and building
+   traces. On AArch64, it takes a single cache line. */
 typedef struct {
   uint16_t *source_addr;
   uintptr_t tpc;
@@ -146,13 +257,20 @@ typedef struct {
 #endif // __arch64__
   uintptr_t branch_taken_addr;
   uintptr_t branch_skipped_addr;
-  uintptr_t branch_condition;
-  uintptr_t branch_cache_status;
+  uint32_t branch_condition;
+  uint32_t branch_cache_status;
   uint32_t rn;
-  uint32_t free_b;
+} dbm_code_cache_meta;
+
+// The metadata of each fragment used rarely, kept in a separate array
+typedef struct {
   ll_entry *linked_from;
+  uint32_t free_b;
   uint8_t saved_exit[MAX_SAVED_EXIT_SZ];
-} dbm_code_cache_meta;
+  // offset and size in bytes of the TPC->SPC map in the thread's pc_map, no map if 0
+  uint32_t pc_map;
+  uint32_t pc_map_size;
+} dbm_code_cache_meta_cold;
 
 typedef struct {
   unsigned long flags;
@@ -184,12 +302,45 @@ typedef struct {
 enum dbm_thread_status {
   THREAD_RUNNING = 0,
   THREAD_SYSCALL,
-  THREAD_EXIT
+  THREAD_EXIT,
+  // stopped by the detacher, waiting to return to native execution
+  THREAD_DETACHED
 };
 
+// the state of the TPC->SPC map being built by the scanner
+typedef struct {
+  // -1 if the map has been dropped
+  int fragment_id;
+  uintptr_t tpc;
+  uintptr_t spc;
+} pc_map_builder;
+
+#ifdef DBM_STATS
+// event counters kept by each thread, see stats.c
+enum dbm_stats_counter {
+  STATS_DISPATCHER_ENTRIES = 0,
+  STATS_TRANSLATIONS,
+  STATS_LINKS,
+  STATS_INLINE_HASH_MISSES,
+  STATS_TRACE_CREATIONS,
+  STATS_TRACE_EARLY_EXITS,
+  STATS_SIGNAL_UNLINKS,
+  STATS_SYSCALLS,
+  STATS_CACHE_FLUSHES,
+  STATS_PRETRANSLATIONS,
+  STATS_MERGED_PUSH_POPS,
+#ifdef DBM_STATS_TIMING
+  STATS_DISPATCHER_NS,
+#endif
+  STATS_COUNTER_NO
+};
+#define stats_inc(thread_data, counter) ((thread_data)->stats[counter]++)
+#else
+#define stats_inc(thread_data, counter)
+#endif
+
 typedef struct dbm_thread_s dbm_thread;
 struct dbm_thread_s {
-  dbm_thread *next_thread;
   enum dbm_thread_status status;
 
   int free_block;
@@ -198,8 +349,13 @@ struct dbm_thread_s {
   uintptr_t syscall_wrapper_addr;
 
   dbm_code_cache *code_cache;
-  dbm_code_cache_meta code_cache_meta[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO];
-  hash_table entry_address;
+  dbm_code_cache_meta code_cache_meta[CODE_CACHE_SIZE + TRACE_FRAGMENT_NO] __attribute__((aligned(64)));
+  dbm_code_cache_meta_cold *code_cache_meta_cold;
+  /* The hash table of the current generation of the code cache. Each flush
+     switches to the table of the other generation, see flush_code_cache() */
+  hash_table *entry_address;
+  hash_table *hash_tables;
+  unsigned int cache_generation;
 #ifdef DBM_TRACES
   uint8_t   exec_count[CODE_CACHE_SIZE];
   uintptr_t trace_head_incr_addr;
@@ -207,24 +363,76 @@ struct dbm_thread_s {
   int       trace_id;
   int       trace_fragment_count;
   trace_in_prog active_trace;
+  // the first trace fragment starting in each page of the trace cache, 0 if none
+  int       trace_dir[TRACE_DIR_SIZE];
+  int       trace_dir_last;
 #endif
 
   ll *cc_links;
 
+  uint8_t *pc_map;
+  uint32_t pc_map_free;
+  pc_map_builder *pc_map_builder;
+
   uintptr_t tls;
+#ifdef DBM_NATIVE_TLS
+  // must immediately follow tls, the trampolines access both through th_tls_ptr
+  uintptr_t mambo_tls;
+#endif
   uintptr_t child_tls;
 
 #ifdef PLUGINS_NEW
   void *plugin_priv[MAX_PLUGIN_NO];
+#endif
+#ifdef __aarch64__
+  // the last pop emitted through the API, which can be merged with a following push
+  uint32_t *pending_pop_start;
+  uint32_t *pending_pop_end;
+  uint32_t pending_pop_regs;
+#ifdef PLUGINS_NEW
+  /* An exclusive region split by a conditional branch, with the instructions
+     whose instrumentation is deferred to the basic block at excl_continuation */
+  uint32_t *excl_continuation;
+  uint32_t *excl_store;
+  uint32_t *excl_deferred[A64_MAX_EXCLUSIVE_REGION];
+  int excl_deferred_count;
+#endif
+#endif
+#ifdef DBM_LIVENESS_STATS
+  uint32_t liveness_fragment_spills;
 #endif
   void *clone_ret_addr;
   pid_t tid;
   volatile pid_t *set_tid;
   sys_clone_args *clone_args;
   bool clone_vm;
+  // the MAMBO context of this thread's vfork children, which share its address space
+  dbm_thread *vfork_child;
+  bool in_vfork;
+  bool is_vfork_child;
+  // in a child created by vfork without a shared address space, the parent is suspended until it calls execve
+  bool parent_in_vfork;
+  /* In the vfork child context, the parent's cache_generation and
+     global_data.exec_allocs_generation when the last child started */
+  unsigned int vfork_parent_generation;
+  unsigned int vfork_exec_allocs_generation;
+  // the syscall wrapper's frame, which the vfork child overwrites on the shared stack
+  uintptr_t vfork_frame[SYSCALL_WRAPPER_FRAME_SIZE];
   int pending_signals[_NSIG];
+#ifndef DBM_SIGNAL_POLL
   uint32_t is_signal_pending;
+#endif
   void *mambo_sp;
+#ifdef DBM_ATTACH
+  // an application thread which existed when MAMBO was attached
+  bool attached;
+#endif
+#ifdef DBM_STATS
+  // only written by the thread itself, read by stats_dump()
+  uint64_t stats[STATS_COUNTER_NO];
+  // the counters have been added to the totals of the exited threads
+  bool stats_retired;
+#endif
 };
 
 typedef enum {
@@ -265,10 +473,46 @@ typedef struct {
   watched_funcp_t funcps[MAX_WATCHED_FUNC_PTRS];
 } watched_functions_t;
 
+/* The thread registry is an open addressing hash table keyed by TID, which
+   is read without locking. Each thread inserts and removes its own entry,
+   removed entries are marked with a tombstone to keep the probe sequences of
+   the other TIDs intact, and can be reused. Tombstones which precede an empty
+   entry are cleared on removal. A dbm_thread found through the
+   registry is only freed after all the readers which might have seen it have
+   called thread_registry_read_unlock(). */
+#define THREAD_REGISTRY_SIZE (16*1024) // must be a power of 2
+#define THREAD_REGISTRY_TOMBSTONE (-1)
+
+typedef struct {
+  volatile pid_t tid;
+  dbm_thread * volatile thread;
+} thread_registry_entry;
+
+#ifdef DBM_THREAD_POOL
+/* The code cache and the other large mappings of an exited thread, kept for
+   the next thread created. The hash tables keep their generation, so the
+   table which is still in use is cleared incrementally, as after a flush.
+   Only the mappings are reused, the new thread translates its code again:
+   fragments embed the addresses of their thread's hash table and dbm_thread,
+   so they can't be copied from the parent's code cache. */
+#define THREAD_POOL_SIZE 8
+
+typedef struct {
+  dbm_code_cache *code_cache;
+  ll *cc_links;
+  dbm_code_cache_meta_cold *code_cache_meta_cold;
+  hash_table *hash_tables;
+  unsigned int cache_generation;
+  uint8_t *pc_map;
+} dbm_thread_mappings;
+#endif
+
 typedef struct {
   int argc;
   char **argv;
   interval_map exec_allocs;
+  // incremented when executable mappings are removed from exec_allocs
+  unsigned int exec_allocs_generation;
 
   uintptr_t signal_handlers[_NSIG];
   pthread_mutex_t signal_handlers_mutex;
@@ -277,10 +521,46 @@ typedef struct {
   uintptr_t initial_brk;
   pthread_mutex_t brk_mutex;
 
-  dbm_thread *threads;
-  pthread_mutex_t thread_list_mutex;
+  thread_registry_entry *thread_registry;
+  // registry readers which started in each of the two grace period epochs
+  volatile int thread_registry_readers[2];
+  volatile int thread_registry_epoch;
+  pthread_mutex_t thread_registry_mutex;
+  // serialises insertions and removals, lookups don't take it
+  pthread_mutex_t thread_registry_write_mutex;
+#ifdef DBM_THREAD_POOL
+  dbm_thread_mappings thread_pool[THREAD_POOL_SIZE];
+  int thread_pool_count;
+  pthread_mutex_t thread_pool_mutex;
+#endif
 
   volatile int exit_group;
+  // incremented when a thread stops running application code after exit_group or detach is set
+  volatile int exit_barrier_seq;
+  volatile int detach;
+  // the signal which triggers a detach, 0 if none
+  int detach_signal;
+#ifdef DBM_STATS
+  // the signal which triggers a stats dump, 0 if none
+  int stats_signal;
+#endif
+  // threads created by the application which aren't in the registry yet
+  volatile int threads_starting;
+  // syscalls which have to go through syscall_handler_pre() and syscall_handler_post()
+  uint32_t syscall_filter[SYSCALL_FILTER_WORDS];
+#ifdef DBM_ATTACH
+  bool attached;
+#endif
+#ifdef DBM_LSE_ATOMICS
+  bool lse_atomics;
+#endif
+
+#ifdef DBM_LIVENESS_STATS
+  uint64_t liveness_fragments;
+  uint64_t liveness_spills_avoided;
+  uint64_t liveness_spills_hist[LIVENESS_HIST_SIZE];
+  uint64_t merged_push_pop_insts;
+#endif
 
 #ifdef PLUGINS_NEW
   int free_plugin;
@@ -295,7 +575,39 @@ typedef struct {
 } cc_addr_pair;
 
 void dbm_exit(dbm_thread *thread_data, uint32_t code);
+void stop_other_threads(dbm_thread *thread_data);
+#ifdef DBM_FORK_SERVER
+void fork_server_enable(void);
+void fork_server_start(int *argc, char ***argv, char ***envp);
+int fork_server_exec(dbm_thread *thread_data, char *path, char **argv, char **envp);
+#endif
+#ifdef DBM_ATTACH
+#define ATTACH_BOOT_ARG "--attached"
+void attach_process(pid_t pid);
+void attach_start(char *arg);
+#endif
+enum {
+  DETACH_NONE = 0,
+  DETACH_REQUESTED,
+  DETACH_RELEASED
+};
+int detach_init(void);
+void detach_reset(void);
+int detach_request(void);
+int detach_set_signal(int signo);
+uintptr_t detach_thread(dbm_thread *thread_data);
+uintptr_t detached_signal_handler(int i, siginfo_t *info);
+#ifdef DBM_STATS
+void stats_init(void);
+void stats_reset(dbm_thread *thread_data);
+void stats_request(void);
+void stats_thread_exit(dbm_thread *thread_data);
+void stats_exit(void);
+#endif
 void thread_abort(dbm_thread *thread_data);
+void exit_barrier_notify(void);
+int futex_wait(volatile int *addr, int val, const struct timespec *timeout);
+int futex_wake(volatile int *addr, int count);
 
 extern void dispatcher_trampoline();
 extern void syscall_wrapper();
@@ -306,13 +618,27 @@ extern void th_to_arm();
 extern void th_enter(void *stack, uintptr_t cc_addr);
 extern void send_self_signal();
 extern void syscall_wrapper_svc();
+#ifdef DBM_ATTACH
+extern void attach_thread_entry();
+#endif
+#ifdef DBM_SIGNAL_POLL
+extern void checked_cc_return();
+extern uint32_t th_is_pending;
+#endif
 
-int lock_thread_list(void);
-int unlock_thread_list(void);
-int register_thread(dbm_thread *thread_data, bool caller_has_lock);
-int unregister_thread(dbm_thread *thread_data, bool caller_has_lock);
+int register_thread(dbm_thread *thread_data);
+int unregister_thread(dbm_thread *thread_data);
+int thread_registry_remove(dbm_thread *thread_data);
+dbm_thread *thread_lookup(pid_t tid);
+int thread_registry_read_lock(void);
+void thread_registry_read_unlock(int epoch);
+dbm_thread *thread_registry_next(int *index);
+void thread_registry_synchronize(void);
 bool allocate_thread_data(dbm_thread **thread_data);
 int free_thread_data(dbm_thread *thread_data);
+#ifdef DBM_THREAD_POOL
+int recycle_thread_data(dbm_thread *thread_data);
+#endif
 void init_thread(dbm_thread *thread_data);
 void reset_process(dbm_thread *thread_data);
 
@@ -325,6 +651,19 @@ uint32_t scan_t32(dbm_thread *thread_data, uint16_t *read_address, int basic_blo
 size_t   scan_a64(dbm_thread *thread_data, uint32_t *read_address, int basic_block, cc_type type, uint32_t *write_p);
 int allocate_bb(dbm_thread *thread_data);
 void trace_dispatcher(uintptr_t target, uintptr_t *next_addr, uint32_t source_index, dbm_thread *thread_data);
+#ifdef __aarch64__
+int direct_exit_targets(dbm_code_cache_meta *bb_meta, uintptr_t *targets);
+uintptr_t translated_block(dbm_thread *thread_data, uintptr_t target);
+void link_direct_exit(dbm_thread *thread_data, int basic_block);
+#endif
+#ifdef DBM_PRETRANSLATE
+void pretranslate_successors(dbm_thread *thread_data, uintptr_t block_address);
+#endif
+#ifdef DBM_AOT
+void aot_init(void);
+void aot_add_elf(int fd, uintptr_t addr, off_t offset);
+void aot_translate(dbm_thread *thread_data, bool new_thread);
+#endif
 void flush_code_cache(dbm_thread *thread_data);
 void insert_cond_exit_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int cond);
 void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t target);
@@ -334,9 +673,22 @@ void arm_encode_stub_bb(dbm_thread *thread_data, int basic_block, uint32_t targe
 
 int addr_to_bb_id(dbm_thread *thread_data, uintptr_t addr);
 int addr_to_fragment_id(dbm_thread *thread_data, uintptr_t addr);
+#ifdef DBM_TRACES
+void trace_dir_add(dbm_thread *thread_data, int fragment_id, uintptr_t tpc);
+int trace_dir_lookup(dbm_thread *thread_data, uintptr_t addr);
+#endif
+void pc_map_reset(dbm_thread *thread_data);
+pc_map_builder *pc_map_begin(dbm_thread *thread_data, pc_map_builder *builder, int fragment_id);
+void pc_map_add(dbm_thread *thread_data, uintptr_t tpc, uintptr_t spc);
+void pc_map_continue(dbm_thread *thread_data, int fragment_id, uintptr_t tpc);
+void pc_map_end(dbm_thread *thread_data, pc_map_builder *outer);
+bool cc_addr_to_spc(dbm_thread *thread_data, uintptr_t addr, uintptr_t *spc);
 void record_cc_link(dbm_thread *thread_data, uintptr_t linked_from, uintptr_t linked_to_addr);
 bool is_bb(dbm_thread *thread_data, uintptr_t addr);
 void install_system_sig_handlers();
+#ifdef DBM_SIGNAL_POLL
+bool signal_is_deliverable(dbm_thread *thread_data);
+#endif
 
 #define MAP_INTERP (0x40000000)
 #define MAP_APP (0x20000000)
@@ -358,9 +710,22 @@ inline static uintptr_t adjust_cc_entry(uintptr_t addr) {
 }
 
 extern dbm_global global_data;
+#ifdef DBM_LIVENESS_STATS
+// counted for the process and for the fragment being scanned
+#define liveness_spill_avoided(thread_data) \
+  do { \
+    atomic_increment_u64(&global_data.liveness_spills_avoided, 1); \
+    (thread_data)->liveness_fragment_spills++; \
+  } while (0)
+#endif
 extern uintptr_t page_size;
 extern dbm_thread *disp_thread_data;
 extern uint32_t *th_is_pending_ptr;
+#ifdef DBM_NATIVE_TLS
+extern uintptr_t *th_tls_ptr;
+dbm_thread *native_tls_enter();
+void native_tls_leave(dbm_thread *thread_data);
+#endif
 extern __thread dbm_thread *current_thread;
 
 /* API-related functions */
@@ -418,6 +783,22 @@ int function_watch_add(watched_functions_t *self, char *name, int plugin_id,
                                       + ((trampolines_size_bytes % sizeof(dbm_block)) ? 1 : 0))
 
 #define UNLINK_SIGNAL (SIGILL)
+
+/* With DBM_SIGNAL_POLL, the signal pending flag is kept in the trampolines at
+   the start of the code cache, where translated code can reach it with ADRP */
+#ifdef DBM_SIGNAL_POLL
+  #define th_is_pending_offset        ((uintptr_t)&th_is_pending - (uintptr_t)&start_of_dispatcher_s)
+  #define checked_cc_return_offset    ((uintptr_t)checked_cc_return - (uintptr_t)&start_of_dispatcher_s)
+  #define signal_pending_flag(thread) ((uint32_t *)((uintptr_t)(thread)->code_cache + th_is_pending_offset))
+#else
+  #define signal_pending_flag(thread) (&(thread)->is_signal_pending)
+#endif
+
+/* A vfork child shares global_data with its parent, but it's a separate
+   process which keeps running when the parent exits */
+#define exit_group_pending(thread) (global_data.exit_group && !(thread)->is_vfork_child)
+#define detach_pending(thread) (global_data.detach != DETACH_NONE && !(thread)->is_vfork_child)
+
 #define CPSR_T (0x20)
 
 #ifdef __arm__
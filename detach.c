@@ -0,0 +1,295 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Detaching: returns all application threads to native execution.
+
+  A detacher thread, started by mambo_detach() or mambo_detach_on_signal(),
+  sends UNLINK_SIGNAL to the threads running under MAMBO until each one has
+  stopped where its full application context is known: the signal sent to
+  itself by deliver_signals(), or an inline syscall. It's parked there, in
+  the signal handler, with the context translated to SPCs. Threads blocked
+  in syscalls are considered stopped and are parked once the syscall returns.
+
+  With all threads parked, the plugins receive the post-thread and exit
+  callbacks, as on exit, and the threads are released. Each one frees its
+  MAMBO context and returns from the signal handler to the application code,
+  with the application's TLS pointer. The application's signal handlers are
+  reinstalled once no thread is left running under MAMBO, in the meantime
+  signal_trampoline calls them directly in the threads already detached.
+
+  MAMBO's image, global data and the pthreads created for the application's
+  threads are left dormant.
+*/
+
+#ifdef __aarch64__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <asm/unistd.h>
+
+#include "dbm.h"
+#include "kernel_sigaction.h"
+
+#define DETACH_SIGNAL_RETRY_NS (10 * 1000 * 1000)
+#define DETACH_WAIT_RETRY_NS (500 * 1000 * 1000)
+
+static volatile int detacher_started;
+
+/* Sends UNLINK_SIGNAL to the threads running application code, unless
+   send_signals is false. Returns true once no thread is running application
+   code under MAMBO or, with all_gone, once no thread is left under MAMBO. */
+static bool detach_signal_threads(bool all_gone, bool send_signals) {
+  pid_t pid = getpid();
+  bool done = (global_data.threads_starting == 0);
+
+  int registry_epoch = thread_registry_read_lock();
+  dbm_thread *thread;
+  for (int index = 0; (thread = thread_registry_next(&index)) != NULL;) {
+    if (thread->status == THREAD_RUNNING) {
+      done = false;
+      if (send_signals) {
+        syscall(__NR_tgkill, pid, thread->tid, UNLINK_SIGNAL);
+      }
+    } else if (all_gone) {
+      done = false;
+    }
+  }
+  thread_registry_read_unlock(registry_epoch);
+
+  return done;
+}
+
+// The signals are only sent again if no thread has changed its status in retry
+static void detach_wait_threads(bool all_gone, const struct timespec *retry) {
+  bool send_signals = true;
+  while (true) {
+    int seq = global_data.exit_barrier_seq;
+    asm volatile("DMB SY" ::: "memory");
+    if (detach_signal_threads(all_gone, send_signals)) {
+      break;
+    }
+    send_signals = (futex_wait(&global_data.exit_barrier_seq, seq, retry) == -ETIMEDOUT);
+  }
+}
+
+static void detach_restore_signal_handlers() {
+  int ret = pthread_mutex_lock(&global_data.signal_handlers_mutex);
+  assert(ret == 0);
+
+  for (int i = 1; i < _NSIG; i++) {
+    struct kernel_sigaction act;
+    if (raw_syscall(__NR_rt_sigaction, i, NULL, &act, 8) != 0
+        || act.k_sa_handler != (__sighandler_t)signal_trampoline) {
+      continue;
+    }
+    act.k_sa_handler = (__sighandler_t)global_data.signal_handlers[i];
+    ret = raw_syscall(__NR_rt_sigaction, i, &act, NULL, 8);
+    assert(ret == 0);
+  }
+
+  ret = pthread_mutex_unlock(&global_data.signal_handlers_mutex);
+  assert(ret == 0);
+}
+
+static void *detacher(void *arg) {
+  const struct timespec signal_retry = {0, DETACH_SIGNAL_RETRY_NS};
+  const struct timespec wait_retry = {0, DETACH_WAIT_RETRY_NS};
+  int state;
+
+  while ((state = global_data.detach) == DETACH_NONE) {
+    futex_wait(&global_data.detach, state, NULL);
+  }
+
+  detach_wait_threads(false, &signal_retry);
+
+#ifdef PLUGINS_NEW
+  // the application might have started exiting before all threads were stopped
+  if (!global_data.exit_group) {
+    dbm_thread *thread, *first = NULL;
+    int registry_epoch = thread_registry_read_lock();
+    for (int index = 0; (thread = thread_registry_next(&index)) != NULL;) {
+      mambo_deliver_callbacks(POST_THREAD_C, thread);
+      if (first == NULL) {
+        first = thread;
+      }
+    }
+    if (first != NULL) {
+      current_thread = first;
+      mambo_deliver_callbacks(EXIT_C, first);
+      current_thread = NULL;
+    }
+    thread_registry_read_unlock(registry_epoch);
+  }
+#endif
+
+  asm volatile("DMB SY" ::: "memory");
+  global_data.detach = DETACH_RELEASED;
+  futex_wake(&global_data.detach, INT_MAX);
+
+  detach_wait_threads(true, &wait_retry);
+  detach_restore_signal_handlers();
+
+  return NULL;
+}
+
+// Starts the detacher thread, which waits for a detach request
+int detach_init() {
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t all, old;
+
+  if (atomic_compare_and_swap_i32((int32_t *)&detacher_started, 0, 1) != 0) {
+    return 0;
+  }
+
+  // signals are only handled by the application's threads
+  sigfillset(&all);
+  int ret = pthread_sigmask(SIG_SETMASK, &all, &old);
+  assert(ret == 0);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int create_ret = pthread_create(&thread, &attr, detacher, NULL);
+  pthread_attr_destroy(&attr);
+  ret = pthread_sigmask(SIG_SETMASK, &old, NULL);
+  assert(ret == 0);
+
+  if (create_ret != 0) {
+    detacher_started = 0;
+    return -1;
+  }
+  return 0;
+}
+
+/* After fork, only the calling thread exists in the child. A detach requested
+   in the parent doesn't apply to the child, where the detacher is restarted */
+void detach_reset() {
+  global_data.detach = DETACH_NONE;
+  global_data.threads_starting = 0;
+  if (detacher_started) {
+    detacher_started = 0;
+    int ret = detach_init();
+    assert(ret == 0);
+  }
+}
+
+// Can be called from a signal handler
+int detach_request() {
+  if (!detacher_started || global_data.exit_group) {
+    return -1;
+  }
+  if (atomic_compare_and_swap_i32((int32_t *)&global_data.detach, DETACH_NONE, DETACH_REQUESTED) != DETACH_NONE) {
+    return -1;
+  }
+  futex_wake(&global_data.detach, 1);
+  return 0;
+}
+
+/* The signal is handled by MAMBO even if the application installs its own
+   handler, which isn't called when the signal triggers a detach */
+int detach_set_signal(int signo) {
+  struct sigaction act;
+
+  if (signo <= 0 || signo >= _NSIG || signo == SIGKILL || signo == SIGSTOP || signo == UNLINK_SIGNAL) {
+    return -1;
+  }
+  if (detach_init() != 0) {
+    return -1;
+  }
+
+  int ret = pthread_mutex_lock(&global_data.signal_handlers_mutex);
+  assert(ret == 0);
+  global_data.detach_signal = signo;
+  ret = sigaction(signo, NULL, &act);
+  if (ret == 0 && act.sa_sigaction != signal_trampoline) {
+    act.sa_sigaction = signal_trampoline;
+    act.sa_flags |= SA_SIGINFO;
+    ret = sigaction(signo, &act, NULL);
+  }
+  int unlock_ret = pthread_mutex_unlock(&global_data.signal_handlers_mutex);
+  assert(unlock_ret == 0);
+
+  return (ret == 0) ? 0 : -1;
+}
+
+/* Called from signal_dispatcher() for a thread stopped with its application
+   context translated in the signal frame. Returns once the detacher has
+   released the thread, with the application's TLS pointer, which must be
+   installed before returning from the handler. TLS can't be used afterwards. */
+uintptr_t detach_thread(dbm_thread *thread_data) {
+  int state;
+
+  thread_data->status = THREAD_DETACHED;
+  exit_barrier_notify();
+  while ((state = global_data.detach) != DETACH_RELEASED) {
+    futex_wait(&global_data.detach, state, NULL);
+  }
+
+  /* Signals which MAMBO has received but not delivered yet are sent again, to
+     be delivered natively once the handler returns and restores the mask */
+  uint64_t all = ~0ULL;
+  raw_syscall(__NR_rt_sigprocmask, SIG_BLOCK, &all, NULL, sizeof(all));
+  pid_t pid = raw_syscall(__NR_getpid);
+  for (int i = 1; i < _NSIG; i++) {
+    if (thread_data->pending_signals[i] > 0) {
+      raw_syscall(__NR_tgkill, pid, thread_data->tid, i);
+    }
+  }
+
+  uintptr_t tls = thread_data->tls;
+  int ret = thread_registry_remove(thread_data);
+  assert(ret == 0);
+  thread_registry_synchronize();
+  ret = free_thread_data(thread_data);
+  assert(ret == 0);
+  exit_barrier_notify();
+
+  return tls;
+}
+
+/* Called by signal_trampoline before it uses TLS, which belongs to the
+   application in the threads already detached. Returns 0 for the threads
+   running under MAMBO, otherwise the application's handler, to be called
+   natively, or 1 if the signal must be ignored. */
+uintptr_t detached_signal_handler(int i, siginfo_t *info) {
+  if (global_data.detach != DETACH_RELEASED || thread_lookup(raw_syscall(__NR_gettid)) != NULL) {
+    return 0;
+  }
+
+  uintptr_t handler = global_data.signal_handlers[i];
+  if (handler != (uintptr_t)SIG_IGN && handler != (uintptr_t)SIG_DFL) {
+    return handler;
+  }
+
+  // Either UNLINK_SIGNAL or the detach signal, only a SIGILL raised by an instruction isn't from MAMBO
+  if (i == UNLINK_SIGNAL && info->si_code != SI_TKILL) {
+    struct kernel_sigaction act = {0};
+    act.k_sa_handler = (__sighandler_t)handler;
+    raw_syscall(__NR_rt_sigaction, i, &act, NULL, 8);
+  }
+  return 1;
+}
+
+#endif // __aarch64__
@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include <limits.h>
+#include <time.h>
 
 #include "dbm.h"
 #include "scanner_common.h"
@@ -42,7 +43,19 @@ void dispatcher_aarch32(dbm_thread *thread_data, uint32_t source_index, branch_t
 void dispatcher_aarch64(dbm_thread *thread_data, uint32_t source_index, branch_type exit_type,
                         uintptr_t target, uintptr_t block_address);
 
-void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, dbm_thread *thread_data) {
+#ifdef DBM_STATS
+// Exits which look up their target in the hash table before calling the dispatcher
+static bool is_indirect_exit(branch_type type) {
+#ifdef __arm__
+  return type == uncond_reg_thumb || type == cond_reg_thumb || type == uncond_reg_arm
+         || type == cond_reg_arm || type == tb_indirect;
+#elif __aarch64__
+  return type == uncond_branch_reg;
+#endif
+}
+#endif
+
+static void dispatch(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, dbm_thread *thread_data) {
   uintptr_t   block_address;
   bool        cached;
   branch_type source_branch_type;
@@ -52,6 +65,12 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
      meta-information get overwritten */
   debug("Source block index: %d\n", source_index);
   source_branch_type = thread_data->code_cache_meta[source_index].exit_branch_type;
+  stats_inc(thread_data, STATS_DISPATCHER_ENTRIES);
+#ifdef DBM_STATS
+  if (is_indirect_exit(source_branch_type)) {
+    stats_inc(thread_data, STATS_INLINE_HASH_MISSES);
+  }
+#endif
 
 #ifdef DBM_TRACES
   // Handle trace exits separately
@@ -59,7 +78,10 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 #ifdef __arm__
     if (source_branch_type != tbb && source_branch_type != tbh)
 #endif
+    {
+      stats_inc(thread_data, STATS_TRACE_EARLY_EXITS);
       return trace_dispatcher(target, next_addr, source_index, thread_data);
+    }
   }
 #endif
 
@@ -74,6 +96,17 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
 
   *next_addr = block_address;
 
+#ifdef DBM_PRETRANSLATE
+  if (!cached && !thread_data->was_flushed) {
+    pretranslate_successors(thread_data, block_address);
+    // the flush has discarded block_address, the source isn't linked
+    if (thread_data->was_flushed) {
+      block_address = lookup_or_scan(thread_data, target, NULL);
+      *next_addr = block_address;
+    }
+  }
+#endif
+
   // Bypass any linking
   if (source_index == 0 || thread_data->was_flushed) {
     return;
@@ -86,3 +119,17 @@ void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, d
   dispatcher_aarch64(thread_data, source_index, source_branch_type, target, block_address);
 #endif
 }
+
+void dispatcher(uintptr_t target, uint32_t source_index, uintptr_t *next_addr, dbm_thread *thread_data) {
+#ifdef DBM_STATS_TIMING
+  // the time spent in the dispatcher, including translation and linking
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+  dispatch(target, source_index, next_addr, thread_data);
+#ifdef DBM_STATS_TIMING
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  thread_data->stats[STATS_DISPATCHER_NS] += (end.tv_sec - start.tv_sec) * 1000000000LL
+                                             + (end.tv_nsec - start.tv_nsec);
+#endif
+}
@@ -498,6 +498,10 @@ void elf_run(uintptr_t entry_address, char *filename, int argc, char **argv, cha
   */
   assert((char *)&stack[stack_i] <= stack_strings);
 
+#ifdef DBM_NATIVE_TLS
+  // the application starts with its own TLS pointer, TLS can't be used afterwards
+  native_tls_leave(current_thread);
+#endif
   dbm_client_entry(entry_address, &stack[0]);
 
   // If we return here, something is horribly wrong
@@ -0,0 +1,692 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Fork server: a resident MAMBO process, forked from the first MAMBO process
+  after the plugins have been initialised but before the application is
+  loaded. Instead of re-executing MAMBO on execve, follow_exec sends the new
+  program, its arguments and environment, the working directory, the open
+  file descriptors and the signal state to the server, which forks a child
+  that continues in main() with the new program.
+
+  The process calling execve keeps its PID and becomes a proxy for the new
+  program: it forwards the signals it receives and exits with the same
+  status. The new program's parent is the fork server, which is visible
+  through getppid().
+*/
+
+#ifdef DBM_FORK_SERVER
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <asm/unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "dbm.h"
+
+#ifndef __NR_pidfd_open
+  #define __NR_pidfd_open 434
+#endif
+
+#define FORK_SERVER_MAX_FDS 253 // SCM_MAX_FD
+#define FORK_SERVER_BACKLOG 64
+
+typedef struct {
+  uint32_t size; // of the strings following the request
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t fd_count;
+  uint32_t umask;
+  pid_t pgid;
+  uint64_t sigmask;
+  uint64_t ignored;
+  int fds[FORK_SERVER_MAX_FDS]; // the numbers of the file descriptors passed with SCM_RIGHTS
+} fork_server_request;
+
+typedef struct {
+  pid_t pid;
+  int conn;
+} fork_server_child;
+
+static bool requested;
+static bool running;
+static char server_dir[] = "/tmp/mambo-fork-server-XXXXXX";
+static struct sockaddr_un server_addr;
+static socklen_t server_addr_len;
+static char *mambo_path;
+static volatile pid_t proxied_pid;
+
+// Called by plugins from their constructors, before main()
+void fork_server_enable() {
+  requested = true;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t ret = read(fd, buf + done, size - done);
+    if (ret == 0 || (ret < 0 && errno != EINTR)) {
+      return -1;
+    }
+    if (ret > 0) {
+      done += ret;
+    }
+  }
+  return done;
+}
+
+static ssize_t write_full(int fd, void *buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t ret = write(fd, buf + done, size - done);
+    if (ret < 0 && errno != EINTR) {
+      return -1;
+    }
+    if (ret > 0) {
+      done += ret;
+    }
+  }
+  return done;
+}
+
+/* Calls fn for each open file descriptor other than the one used for the
+   listing. Stops and returns -1 if fn does. */
+static int for_each_fd(int (*fn)(int fd, void *data), void *data) {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == NULL) {
+    return -1;
+  }
+  int ret = 0;
+  struct dirent *entry;
+  while (ret == 0 && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    int fd = atoi(entry->d_name);
+    if (fd != dirfd(dir)) {
+      ret = fn(fd, data);
+    }
+  }
+  closedir(dir);
+  return ret;
+}
+
+static int max_fd(int fd, void *data) {
+  int *max = (int *)data;
+  if (fd > *max) {
+    *max = fd;
+  }
+  return 0;
+}
+
+static int close_below(int fd, void *data) {
+  if (fd < *(int *)data) {
+    close(fd);
+  }
+  return 0;
+}
+
+static int close_unless(int fd, void *data) {
+  if (fd != *(int *)data) {
+    close(fd);
+  }
+  return 0;
+}
+
+static int close_unless_std(int fd, void *data) {
+  if (fd > 2 && fd != *(int *)data) {
+    close(fd);
+  }
+  return 0;
+}
+
+/*
+  Server side
+*/
+
+static void remove_socket() {
+  unlink(server_addr.sun_path);
+  rmdir(server_dir);
+}
+
+// Replaces all file descriptors with the fds received from the client, at their original numbers
+static void child_setup_fds(fork_server_request *req, int *received) {
+  int base = 0;
+  for (int i = 0; i < req->fd_count; i++) {
+    max_fd(req->fds[i], &base);
+  }
+  for_each_fd(max_fd, &base);
+  base++;
+
+  int moved[FORK_SERVER_MAX_FDS];
+  for (int i = 0; i < req->fd_count; i++) {
+    moved[i] = fcntl(received[i], F_DUPFD_CLOEXEC, base);
+    assert(moved[i] >= base);
+  }
+  for_each_fd(close_below, &base);
+
+  for (int i = 0; i < req->fd_count; i++) {
+    int ret = dup2(moved[i], req->fds[i]);
+    assert(ret == req->fds[i]);
+    close(moved[i]);
+  }
+}
+
+/* Checks that the strings received with a request contain the path, the
+   working directory, the arguments and the environment, each terminated
+   within the buffer, and that the fd numbers are valid */
+static bool request_valid(fork_server_request *req, char *strings) {
+  uint64_t expected = 2 + (uint64_t)req->argc + req->envc;
+  uint64_t found = 0;
+  for (uint32_t i = 0; i < req->size && found < expected; i++) {
+    if (strings[i] == '\0') {
+      found++;
+    }
+  }
+  if (found < expected) {
+    return false;
+  }
+  for (int i = 0; i < req->fd_count; i++) {
+    if (req->fds[i] < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void child_setup(fork_server_request *req, int *received, char *strings,
+                        int *argc, char ***argv, char ***envp) {
+  char *path = strings;
+  char *cwd = path + strlen(path) + 1;
+  char *str = cwd + strlen(cwd) + 1;
+
+  // MAMBO's own argv: dbm, the path of the program and its arguments following argv[0]
+  char **new_argv = malloc((req->argc + 2) * sizeof(char *));
+  char **new_envp = malloc((req->envc + 1) * sizeof(char *));
+  assert(new_argv != NULL && new_envp != NULL);
+  int count = 0;
+  new_argv[count++] = mambo_path;
+  new_argv[count++] = path;
+  for (int i = 0; i < req->argc; i++) {
+    if (i > 0) {
+      new_argv[count++] = str;
+    }
+    str += strlen(str) + 1;
+  }
+  new_argv[count] = NULL;
+  for (int i = 0; i < req->envc; i++) {
+    new_envp[i] = str;
+    str += strlen(str) + 1;
+  }
+  new_envp[req->envc] = NULL;
+
+  child_setup_fds(req, received);
+
+  if (chdir(cwd) != 0) {
+    fprintf(stderr, "MAMBO fork server: failed to change directory to %s\n", cwd);
+  }
+  umask(req->umask);
+  // only possible while the application stays in the server's session
+  setpgid(0, req->pgid);
+
+  for (int sig = 1; sig < _NSIG; sig++) {
+    if (req->ignored & (1ULL << (sig - 1))) {
+      signal(sig, SIG_IGN);
+    }
+  }
+  uint64_t mask = req->sigmask;
+  int ret = raw_syscall(__NR_rt_sigprocmask, SIG_SETMASK, &mask, NULL, sizeof(mask));
+  assert(ret == 0);
+
+  *argc = count;
+  *argv = new_argv;
+  *envp = new_envp;
+}
+
+/* Returns the PID of the new child to the server, or 0 in the child, which
+   must continue starting the new program */
+static pid_t handle_request(int conn, int *argc, char ***argv, char ***envp) {
+  fork_server_request req;
+  int received[FORK_SERVER_MAX_FDS];
+  char cmsg_buf[CMSG_SPACE(sizeof(received))];
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cmsg_buf,
+    .msg_controllen = sizeof(cmsg_buf)
+  };
+  pid_t pid = -EINVAL;
+
+  ssize_t ret = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if (ret <= 0) {
+    return -EINVAL;
+  }
+  int fd_count = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(received, CMSG_DATA(cmsg), fd_count * sizeof(int));
+  }
+
+  char *strings = NULL;
+  if (ret < sizeof(req) && read_full(conn, (void *)&req + ret, sizeof(req) - ret) < 0) {
+    goto out;
+  }
+  if (req.fd_count != fd_count || req.size == 0) {
+    goto out;
+  }
+  strings = malloc(req.size);
+  if (strings == NULL || read_full(conn, strings, req.size) < 0) {
+    pid = -ENOMEM;
+    goto out;
+  }
+  strings[req.size - 1] = '\0';
+  if (!request_valid(&req, strings)) {
+    goto out;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    child_setup(&req, received, strings, argc, argv, envp);
+    return 0;
+  } else if (pid < 0) {
+    pid = -errno;
+  }
+
+out:
+  free(strings);
+  for (int i = 0; i < fd_count; i++) {
+    close(received[i]);
+  }
+  return pid;
+}
+
+static void report_status(fork_server_child *children, int count, pid_t pid, int status) {
+  for (int i = 0; i < count; i++) {
+    if (children[i].pid == pid) {
+      if (children[i].conn >= 0) {
+        write_full(children[i].conn, &status, sizeof(status));
+        close(children[i].conn);
+      }
+      children[i].pid = 0;
+      return;
+    }
+  }
+}
+
+static void server_loop(int listen_fd, pid_t top_pid, int *argc, char ***argv, char ***envp) {
+  fork_server_child *children = NULL;
+  int child_count = 0, child_alloc = 0;
+
+  // stdin, stdout and stderr must not be kept open by the server
+  int null_fd = open("/dev/null", O_RDWR);
+  assert(null_fd >= 0);
+  for (int fd = 0; fd <= 2; fd++) {
+    dup2(null_fd, fd);
+  }
+  for_each_fd(close_unless_std, &listen_fd);
+
+  /* All signals stay blocked, the children restore the mask of the client.
+     SIGCHLD is received through a signalfd. */
+  sigset_t all, chld;
+  sigfillset(&all);
+  sigprocmask(SIG_BLOCK, &all, NULL);
+  sigemptyset(&chld);
+  sigaddset(&chld, SIGCHLD);
+  int sig_fd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+  assert(sig_fd >= 0);
+
+  // the server stops accepting new requests once the first MAMBO process has exited
+  int top_fd = raw_syscall(__NR_pidfd_open, top_pid, 0);
+
+  while (listen_fd >= 0 || child_count > 0) {
+    struct pollfd fds[3 + child_count];
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){sig_fd, POLLIN, 0};
+    fds[nfds++] = (struct pollfd){listen_fd, POLLIN, 0};
+    fds[nfds++] = (struct pollfd){(top_fd >= 0) ? top_fd : -1, POLLIN, 0};
+    for (int i = 0; i < child_count; i++) {
+      fds[nfds++] = (struct pollfd){children[i].conn, POLLIN, 0};
+    }
+
+    int ret = poll(fds, nfds, (top_fd < 0 && listen_fd >= 0) ? 1000 : -1);
+    if (ret < 0) {
+      continue;
+    }
+
+    if ((fds[2].revents & POLLIN) || (top_fd < 0 && kill(top_pid, 0) != 0 && errno == ESRCH)) {
+      close(listen_fd);
+      listen_fd = -1;
+      remove_socket();
+      if (top_fd >= 0) {
+        close(top_fd);
+        top_fd = -1;
+      }
+    }
+
+    // a proxy which has been killed can't forward SIGKILL
+    for (int i = 0; i < child_count; i++) {
+      if (fds[3 + i].revents != 0) {
+        close(children[i].conn);
+        children[i].conn = -1;
+        kill(children[i].pid, SIGKILL);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      while (read(sig_fd, &info, sizeof(info)) > 0);
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        report_status(children, child_count, pid, status);
+      }
+    }
+
+    int live = 0;
+    for (int i = 0; i < child_count; i++) {
+      if (children[i].pid != 0) {
+        children[live++] = children[i];
+      }
+    }
+    child_count = live;
+
+    if (listen_fd >= 0 && (fds[1].revents & POLLIN)) {
+      int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0) {
+        continue;
+      }
+      // only processes of the same user are served
+      struct ucred cred;
+      socklen_t cred_len = sizeof(cred);
+      if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != getuid()) {
+        close(conn);
+        continue;
+      }
+      pid_t pid = handle_request(conn, argc, argv, envp);
+      if (pid == 0) {
+        free(children);
+        return;
+      }
+      write_full(conn, &pid, sizeof(pid));
+      if (pid < 0) {
+        close(conn);
+        continue;
+      }
+
+      if (child_count == child_alloc) {
+        child_alloc = (child_alloc == 0) ? 16 : child_alloc * 2;
+        children = realloc(children, child_alloc * sizeof(fork_server_child));
+        assert(children != NULL);
+      }
+      children[child_count++] = (fork_server_child){pid, conn};
+    }
+  }
+
+  _exit(0);
+}
+
+/* Called from main() in the first MAMBO process if a plugin has requested it.
+   It returns normally in the calling process and in each child forked by the
+   server, with the arguments and environment of the new program. */
+void fork_server_start(int *argc, char ***argv, char ***envp) {
+  if (!requested) {
+    return;
+  }
+
+  pid_t top_pid = getpid();
+  mambo_path = (*argv)[0];
+
+  /* The socket is created in a new directory which is only accessible to
+     the user, unlike abstract sockets, which any process can connect to.
+     Its path is inherited by the MAMBO processes through fork(). */
+  if (mkdtemp(server_dir) == NULL) {
+    return;
+  }
+  server_addr.sun_family = AF_UNIX;
+  snprintf(server_addr.sun_path, sizeof(server_addr.sun_path), "%s/socket", server_dir);
+  server_addr_len = sizeof(server_addr);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    rmdir(server_dir);
+    return;
+  }
+  if (bind(listen_fd, (struct sockaddr *)&server_addr, server_addr_len) != 0 ||
+      listen(listen_fd, FORK_SERVER_BACKLOG) != 0) {
+    close(listen_fd);
+    remove_socket();
+    return;
+  }
+
+  // forked twice, so that the server isn't a child of the application
+  running = true;
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (fork() != 0) {
+      _exit(0);
+    }
+    server_loop(listen_fd, top_pid, argc, argv, envp);
+    return;
+  }
+
+  close(listen_fd);
+  if (pid < 0) {
+    running = false;
+    remove_socket();
+    return;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+}
+
+/*
+  Client side
+*/
+
+typedef struct {
+  int conn;
+  fork_server_request *req;
+} fd_collector;
+
+static int collect_fd(int fd, void *data) {
+  fd_collector *collector = (fd_collector *)data;
+  if (fd == collector->conn) {
+    return 0;
+  }
+  int flags = fcntl(fd, F_GETFD);
+  if (flags < 0 || (flags & FD_CLOEXEC)) {
+    return 0;
+  }
+  if (collector->req->fd_count == FORK_SERVER_MAX_FDS) {
+    return -1;
+  }
+  collector->req->fds[collector->req->fd_count++] = fd;
+  return 0;
+}
+
+static void forward_signal(int sig) {
+  kill(proxied_pid, sig);
+}
+
+static size_t copy_strings(char *buf, char **strings, uint32_t *count) {
+  size_t size = 0;
+  for (*count = 0; strings[*count] != NULL; (*count)++) {
+    size_t len = strlen(strings[*count]) + 1;
+    if (buf != NULL) {
+      memcpy(buf + size, strings[*count], len);
+    }
+    size += len;
+  }
+  return size;
+}
+
+// Waits for the new program to exit and exits with the same status
+static void proxy(dbm_thread *thread_data, int conn, pid_t pid) {
+  proxied_pid = pid;
+
+  // execve terminates all other threads
+  stop_other_threads(thread_data);
+
+  /* The new program has its own copies of the fds which survive execve and
+     the others would have been closed. Otherwise, pipes wouldn't reach EOF,
+     e.g. the CLOEXEC pipes used to report exec errors by posix_spawn(). */
+  for_each_fd(close_unless, &conn);
+
+  struct sigaction act;
+  act.sa_handler = forward_signal;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  for (int sig = 1; sig < _NSIG; sig++) {
+    if (sig != SIGKILL && sig != SIGSTOP && sig != UNLINK_SIGNAL) {
+      sigaction(sig, &act, NULL);
+    }
+  }
+  uint64_t mask = 0;
+  raw_syscall(__NR_rt_sigprocmask, SIG_SETMASK, &mask, NULL, sizeof(mask));
+
+  int status;
+  if (read_full(conn, &status, sizeof(status)) < 0) {
+    raw_syscall(__NR_exit_group, 127);
+  }
+
+  if (WIFSIGNALED(status)) {
+    int sig = WTERMSIG(status);
+    signal(sig, SIG_DFL);
+    raw_syscall(__NR_tgkill, getpid(), raw_syscall(__NR_gettid), sig);
+    raw_syscall(__NR_exit_group, 128 + sig);
+  }
+  raw_syscall(__NR_exit_group, WEXITSTATUS(status));
+  while(1);
+}
+
+/* Starts path from the fork server. It only returns, with a negative error
+   code, if the request couldn't be sent, in which case the caller should
+   fall back to executing MAMBO. */
+int fork_server_exec(dbm_thread *thread_data, char *path, char **argv, char **envp) {
+  if (!running) {
+    return -ENOSYS;
+  }
+  /* The proxy never calls execve, so the parent of a vfork child would stay
+     suspended. A child sharing the parent's address space also can't stop
+     the parent's threads or exit without affecting them. */
+  if (thread_data->is_vfork_child || thread_data->parent_in_vfork) {
+    return -ENOSYS;
+  }
+
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0) {
+    return -errno;
+  }
+  if (connect(conn, (struct sockaddr *)&server_addr, server_addr_len) != 0) {
+    int err = -errno;
+    close(conn);
+    return err;
+  }
+
+  fork_server_request req;
+  memset(&req, 0, sizeof(req));
+  fd_collector collector = {conn, &req};
+  if (for_each_fd(collect_fd, &collector) != 0) {
+    close(conn);
+    return -EMFILE;
+  }
+
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL) {
+    close(conn);
+    return -errno;
+  }
+
+  size_t path_len = strlen(path) + 1;
+  size_t cwd_len = strlen(cwd) + 1;
+  size_t argv_size = copy_strings(NULL, argv, &req.argc);
+  size_t envp_size = copy_strings(NULL, envp, &req.envc);
+  req.size = path_len + cwd_len + argv_size + envp_size;
+  char *strings = malloc(req.size);
+  if (strings == NULL) {
+    close(conn);
+    return -ENOMEM;
+  }
+  memcpy(strings, path, path_len);
+  memcpy(strings + path_len, cwd, cwd_len);
+  copy_strings(strings + path_len + cwd_len, argv, &req.argc);
+  copy_strings(strings + path_len + cwd_len + argv_size, envp, &req.envc);
+
+  req.umask = umask(0);
+  umask(req.umask);
+  req.pgid = getpgrp();
+  raw_syscall(__NR_rt_sigprocmask, SIG_SETMASK, NULL, &req.sigmask, sizeof(req.sigmask));
+  for (int sig = 1; sig < _NSIG; sig++) {
+    struct sigaction old;
+    if (sigaction(sig, NULL, &old) == 0 && old.sa_handler == SIG_IGN) {
+      req.ignored |= 1ULL << (sig - 1);
+    }
+  }
+
+  char cmsg_buf[CMSG_SPACE(sizeof(req.fds))];
+  struct iovec iov = {&req, sizeof(req)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = (req.fd_count > 0) ? cmsg_buf : NULL,
+    .msg_controllen = (req.fd_count > 0) ? CMSG_SPACE(req.fd_count * sizeof(int)) : 0
+  };
+  if (req.fd_count > 0) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(req.fd_count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), req.fds, req.fd_count * sizeof(int));
+  }
+
+  pid_t pid = -EIO;
+  ssize_t ret = sendmsg(conn, &msg, MSG_NOSIGNAL);
+  if (ret > 0 && (ret == sizeof(req) || write_full(conn, (void *)&req + ret, sizeof(req) - ret) >= 0) &&
+      write_full(conn, strings, req.size) >= 0) {
+    if (read_full(conn, &pid, sizeof(pid)) < 0) {
+      pid = -EIO;
+    }
+  }
+  free(strings);
+
+  if (pid < 0) {
+    close(conn);
+    return pid;
+  }
+
+  proxy(thread_data, conn, pid);
+  return 0;
+}
+
+#endif // DBM_FORK_SERVER
@@ -0,0 +1,238 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  TPC->SPC maps: the scanner records the code cache address at which the
+  translation of each source instruction starts. The records of a fragment
+  are stored contiguously in the thread's pc_map area, as pairs of signed
+  deltas from the previous record's TPC and SPC, in units of 2 bytes,
+  zigzag and LEB128 encoded. An instruction typically takes 2 bytes.
+
+  The code of a fragment can continue in other basic blocks when it runs
+  out of space. These regions aren't contiguous with the fragment start, so
+  a record is added at the start of each one, for the current instruction.
+  A TPC maps to the last record at a lower or equal address in its region.
+
+  Fragments are found by addr_to_fragment_id(): basic blocks have a fixed
+  size and trace fragments are found through a directory with the first
+  fragment starting in each page of the trace cache.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "dbm.h"
+
+#define PC_MAP_SHIFT 1
+// two 64-bit values, 7 bits per byte
+#define PC_MAP_MAX_RECORD 20
+
+#ifdef DBM_TRACES
+/* Called when the TPC of a trace fragment is set. An aborted trace leaves
+   entries for fragment ids which are allocated again. */
+void trace_dir_add(dbm_thread *thread_data, int fragment_id, uintptr_t tpc) {
+  int page = (tpc - (uintptr_t)thread_data->code_cache->traces) >> TRACE_DIR_SHIFT;
+  assert(page >= 0 && page < TRACE_DIR_SIZE);
+
+  for (int p = page + 1; p <= thread_data->trace_dir_last; p++) {
+    thread_data->trace_dir[p] = 0;
+  }
+  if (thread_data->trace_dir[page] == 0 || thread_data->trace_dir[page] >= fragment_id) {
+    thread_data->trace_dir[page] = fragment_id;
+  }
+  thread_data->trace_dir_last = page;
+}
+
+int trace_dir_lookup(dbm_thread *thread_data, uintptr_t addr) {
+  int last = thread_data->active_trace.id - 1;
+  int page = (addr - (uintptr_t)thread_data->code_cache->traces) >> TRACE_DIR_SHIFT;
+  assert(page >= 0 && page < TRACE_DIR_SIZE);
+
+  // pages without any fragment start are covered by the last fragment of a previous page
+  while (page > 0 && (thread_data->trace_dir[page] == 0 || thread_data->trace_dir[page] > last)) {
+    page--;
+  }
+  int id = thread_data->trace_dir[page];
+  if (id == 0 || id > last) {
+    return -1;
+  }
+
+  if (addr < thread_data->code_cache_meta[id].tpc) {
+    if (id == CODE_CACHE_SIZE) {
+      return -1;
+    }
+    id--;
+  }
+  while (id < last && addr >= thread_data->code_cache_meta[id + 1].tpc) {
+    id++;
+  }
+  return id;
+}
+#endif
+
+// Called when the code cache is flushed, all maps are discarded
+void pc_map_reset(dbm_thread *thread_data) {
+  if (thread_data->pc_map == NULL) {
+    thread_data->pc_map = mmap(NULL, PC_MAP_SIZE, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(thread_data->pc_map != MAP_FAILED);
+  }
+  thread_data->pc_map_free = 0;
+}
+
+static void pc_map_put(uint8_t **o_p, intptr_t delta) {
+  uint8_t *p = *o_p;
+  uintptr_t value = ((uintptr_t)delta << 1) ^ (uintptr_t)(delta >> (sizeof(delta) * 8 - 1));
+  do {
+    *p = value & 0x7F;
+    value >>= 7;
+    if (value != 0) {
+      *p |= 0x80;
+    }
+    p++;
+  } while (value != 0);
+  *o_p = p;
+}
+
+static intptr_t pc_map_get(uint8_t **o_p) {
+  uint8_t *p = *o_p;
+  uintptr_t value = 0;
+  int shift = 0;
+  do {
+    value |= (uintptr_t)(*p & 0x7F) << shift;
+    shift += 7;
+  } while (*(p++) & 0x80);
+  *o_p = p;
+  return (intptr_t)(value >> 1) ^ -(intptr_t)(value & 1);
+}
+
+/* Starts the map of fragment_id, which replaces any previous map of the same
+   fragment. Scans can be nested, returns the builder of the enclosing scan,
+   to be passed to pc_map_end(). */
+pc_map_builder *pc_map_begin(dbm_thread *thread_data, pc_map_builder *builder, int fragment_id) {
+  dbm_code_cache_meta_cold *meta = &thread_data->code_cache_meta_cold[fragment_id];
+  meta->pc_map = thread_data->pc_map_free;
+  meta->pc_map_size = 0;
+
+  builder->fragment_id = fragment_id;
+  builder->tpc = thread_data->code_cache_meta[fragment_id].tpc;
+  builder->spc = 0;
+
+  pc_map_builder *outer = thread_data->pc_map_builder;
+  thread_data->pc_map_builder = builder;
+  return outer;
+}
+
+void pc_map_end(dbm_thread *thread_data, pc_map_builder *outer) {
+  thread_data->pc_map_builder = outer;
+}
+
+/* Records that the translation of the instruction at spc starts at tpc. The
+   first record is placed at the start of the fragment, to include its entry code. */
+void pc_map_add(dbm_thread *thread_data, uintptr_t tpc, uintptr_t spc) {
+  pc_map_builder *builder = thread_data->pc_map_builder;
+  if (builder == NULL || builder->fragment_id < 0) {
+    return;
+  }
+  dbm_code_cache_meta_cold *meta = &thread_data->code_cache_meta_cold[builder->fragment_id];
+  if (meta->pc_map_size == 0) {
+    tpc = builder->tpc;
+  }
+
+  // the map must be contiguous, move it if a nested scan has added another one after it
+  if (meta->pc_map + meta->pc_map_size != thread_data->pc_map_free) {
+    if (thread_data->pc_map_free + meta->pc_map_size + PC_MAP_MAX_RECORD > PC_MAP_SIZE) {
+      meta->pc_map_size = 0;
+      builder->fragment_id = -1;
+      return;
+    }
+    memmove(&thread_data->pc_map[thread_data->pc_map_free],
+            &thread_data->pc_map[meta->pc_map], meta->pc_map_size);
+    meta->pc_map = thread_data->pc_map_free;
+    thread_data->pc_map_free += meta->pc_map_size;
+  }
+
+  // out of space, this fragment is left without a map until the next flush
+  if (thread_data->pc_map_free + PC_MAP_MAX_RECORD > PC_MAP_SIZE) {
+    meta->pc_map_size = 0;
+    builder->fragment_id = -1;
+    return;
+  }
+
+  uint8_t *p = &thread_data->pc_map[thread_data->pc_map_free];
+  uint8_t *start = p;
+  pc_map_put(&p, ((intptr_t)tpc - (intptr_t)builder->tpc) >> PC_MAP_SHIFT);
+  pc_map_put(&p, ((intptr_t)spc - (intptr_t)builder->spc) >> PC_MAP_SHIFT);
+  thread_data->pc_map_free += p - start;
+  meta->pc_map_size += p - start;
+
+  builder->tpc = tpc;
+  builder->spc = spc;
+}
+
+// Called when the code of fragment_id continues in a new region at tpc
+void pc_map_continue(dbm_thread *thread_data, int fragment_id, uintptr_t tpc) {
+  pc_map_builder *builder = thread_data->pc_map_builder;
+  if (builder != NULL && builder->fragment_id == fragment_id
+      && thread_data->code_cache_meta_cold[fragment_id].pc_map_size != 0) {
+    pc_map_add(thread_data, tpc, builder->spc);
+  }
+}
+
+static bool pc_map_same_region(dbm_thread *thread_data, uintptr_t a, uintptr_t b) {
+  uintptr_t traces = (uintptr_t)thread_data->code_cache->traces;
+  if (a >= traces || b >= traces) {
+    return a >= traces && b >= traces;
+  }
+  return addr_to_bb_id(thread_data, a) == addr_to_bb_id(thread_data, b);
+}
+
+/* Returns the SPC of the source instruction whose translation includes addr,
+   or false if addr isn't in a fragment with a map, for example in a trace exit */
+bool cc_addr_to_spc(dbm_thread *thread_data, uintptr_t addr, uintptr_t *spc) {
+  uintptr_t cc_start = (uintptr_t)&thread_data->code_cache->blocks[trampolines_size_bbs];
+  uintptr_t cc_end = (uintptr_t)thread_data->code_cache + MAX_BRANCH_RANGE;
+  bool found = false;
+
+  if (addr < cc_start || addr >= cc_end) {
+    return false;
+  }
+  int fragment_id = addr_to_fragment_id(thread_data, addr);
+  if (fragment_id < 0) {
+    return false;
+  }
+
+  dbm_code_cache_meta_cold *meta = &thread_data->code_cache_meta_cold[fragment_id];
+  uint8_t *p = &thread_data->pc_map[meta->pc_map];
+  uint8_t *end = p + meta->pc_map_size;
+  uintptr_t tpc = thread_data->code_cache_meta[fragment_id].tpc;
+  uintptr_t cur_spc = 0;
+  while (p < end) {
+    tpc += (uintptr_t)pc_map_get(&p) << PC_MAP_SHIFT;
+    cur_spc += (uintptr_t)pc_map_get(&p) << PC_MAP_SHIFT;
+    if (tpc <= addr && pc_map_same_region(thread_data, tpc, addr)) {
+      *spc = cur_spc;
+      found = true;
+    }
+  }
+
+  return found;
+}
@@ -0,0 +1,159 @@
+/*
+  This file is part of PIE, an instruction encoder / decoder generator:
+      https://github.com/beehive-lab/pie
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Differential test and benchmark of the generated decoder against the
+  reference bit by bit decision tree, for the fixed length instruction sets.
+  Built on the host with:
+
+    make test-a64    (or test-arm)
+    make bench-a64   (or bench-arm)
+
+  The test decodes every encoding in the spec with its variable fields set to
+  all zeros, all ones and random values, followed by random words. The
+  benchmark decodes BENCH_WORDS random words, valid encodings from the spec
+  and a block of valid encodings repeated like hot code, with both decoders.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _CONCAT(a, b) a ## b
+#define CONCAT(a, b) _CONCAT(a, b)
+
+#include PIE_DECODER_H
+
+#define instruction_t CONCAT(PIE_ARCH, _instruction)
+#define decode CONCAT(PIE_ARCH, _decode)
+#define decode_reference CONCAT(PIE_ARCH, _decode_reference)
+#define spec CONCAT(PIE_ARCH, _spec)
+#define spec_count CONCAT(PIE_ARCH, _spec_count)
+
+instruction_t decode_reference(uint32_t *address);
+extern const uint32_t spec[][2];
+extern const int spec_count;
+
+#define RANDOM_FILLS 256
+#define RANDOM_WORDS (16 * 1000 * 1000)
+#define BENCH_WORDS (4 * 1000 * 1000)
+#define BENCH_BLOCK 1024
+#define BENCH_RUNS 5
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state >> 16;
+}
+
+static int check(uint32_t word) {
+  instruction_t new = decode(&word);
+  instruction_t ref = decode_reference(&word);
+  if (new != ref) {
+    printf("0x%08x: decoded as %d, expected %d\n", word, new, ref);
+    return 1;
+  }
+  return 0;
+}
+
+static uint32_t spec_word(int i, uint32_t fill) {
+  return spec[i][1] | (fill & ~spec[i][0]);
+}
+
+static int run_test() {
+  int errors = 0;
+
+  for (int i = 0; i < spec_count; i++) {
+    errors += check(spec_word(i, 0));
+    errors += check(spec_word(i, 0xFFFFFFFF));
+    for (int r = 0; r < RANDOM_FILLS; r++) {
+      errors += check(spec_word(i, rng()));
+    }
+  }
+
+  for (int i = 0; i < RANDOM_WORDS; i++) {
+    errors += check(rng());
+  }
+
+  if (errors) {
+    printf("decoder test: %d mismatches\n", errors);
+    return 1;
+  }
+  printf("decoder test: %d encodings, %d random words, passed\n", spec_count, RANDOM_WORDS);
+  return 0;
+}
+
+// best of BENCH_RUNS runs, in ns per decoded word
+static double time_decoder(instruction_t (*decoder)(uint32_t *), uint32_t *words, int count, int *sum) {
+  double best = 0;
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+      *sum += decoder(&words[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double t = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / count;
+    if (run == 0 || t < best) {
+      best = t;
+    }
+  }
+  return best;
+}
+
+static int run_bench() {
+  char *names[] = {"random words", "valid encodings", "repeated block"};
+  int sum = 0;
+  uint32_t *words = malloc(BENCH_WORDS * sizeof(uint32_t));
+  if (words == NULL) return 1;
+
+  for (int pass = 0; pass < 3; pass++) {
+    for (int i = 0; i < BENCH_WORDS; i++) {
+      switch (pass) {
+        case 0:
+          words[i] = rng();
+          break;
+        case 1:
+          words[i] = spec_word(rng() % spec_count, rng());
+          break;
+        case 2:
+          // a block of BENCH_BLOCK valid encodings, decoded repeatedly like hot code
+          words[i] = (i < BENCH_BLOCK) ? spec_word(rng() % spec_count, rng()) : words[i % BENCH_BLOCK];
+          break;
+      }
+    }
+    double ref = time_decoder(decode_reference, words, BENCH_WORDS, &sum);
+    double new = time_decoder(decode, words, BENCH_WORDS, &sum);
+    printf("%-16s reference %6.2f ns/decode, generated %6.2f ns/decode\n", names[pass], ref, new);
+  }
+
+  free(words);
+  return (sum == 0);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    return run_bench();
+  }
+  return run_test();
+}
@@ -21,16 +21,29 @@ limitations under the License.
 
 require './generate_common.rb'
 
+# Widest group of bits tested in a single step by the table decoder, at most
+# 8 which is the size of the field mask in the table entries
+MAX_FIELD_BITS = 6
+# Limit for the total number of copies of the instructions when splitting on
+# a group of bits, relative to the number of instructions
+MAX_DUPLICATION = 2.0
+
 class Node
-  attr_accessor :depth, :instruction, :left, :right
+  attr_accessor :depth, :instruction, :left, :right, :shift, :width, :children, :candidates
   @depth
   @value
   @left
   @right
+  # multi-way nodes: index the children with bits [shift + width - 1 : shift]
+  @shift
+  @width
+  @children
+  # table leaves: [mask, value, name] of the instructions to check in order
+  @candidates
 end
 
-def generate_f_prot(insts, c_ptr)
-  print "#{ARGV[0]}_instruction #{ARGV[0]}_decode(#{c_ptr} *address)"
+def generate_f_prot(insts, c_ptr, suffix = "")
+  print "#{ARGV[0]}_instruction #{ARGV[0]}_decode#{suffix}(#{c_ptr} *address)"
 end
 
 def generate_header(insts, inst_len)
@@ -147,6 +160,180 @@ def build_tree(instructions, remaining_bits, var_inst_len)
   return node
 end
 
+# Returns [shift, width] of the group of consecutive untested bits which
+# splits the instructions into the smallest subsets, or [0, 0] if no group
+# makes any subset smaller. Instructions with variable bits in the group are
+# duplicated in multiple subsets, up to MAX_DUPLICATION times in total.
+def select_field(instructions, remaining_bits, word_len)
+  best_shift = 0
+  best_width = 0
+  best_size = instructions.size
+
+  (1..MAX_FIELD_BITS).each do |width|
+    (0..(word_len - width)).reverse_each do |shift|
+      field_mask = ((1 << width) - 1) << shift
+      next if ((remaining_bits & field_mask) != field_mask)
+
+      copies = 0
+      max_size = 0
+      (0...(1 << width)).each do |value|
+        size = instructions.count { |instruction| field_matches(instruction, shift, width, value) }
+        copies += size
+        max_size = size if size > max_size
+      end
+      next if (copies > instructions.size * MAX_DUPLICATION)
+
+      # prefer narrow fields, then the most significant bits, like select_bit
+      if (max_size < best_size)
+        best_size = max_size
+        best_shift = shift
+        best_width = width
+      end
+    end
+  end
+
+  return [best_shift, best_width]
+end
+
+def field_matches(instruction, shift, width, value)
+  field_mask = ((1 << width) - 1) << shift
+  diff = instruction[:bitmask_value] ^ (value << shift)
+  return (diff & instruction[:bitmask_set_bits] & field_mask) == 0
+end
+
+# Maximum number of overlapping instructions checked in order at a leaf
+MAX_LEAF_INSTS = 15
+
+# Builds a tree of multi-way nodes, each testing a group of bits of the
+# instruction word. A leaf checks the remaining fixed bits of its candidate
+# instructions with one mask and compare each, from the most to the least
+# specific, so the number of steps is bounded by the number of bit groups
+# rather than the number of bits.
+def build_table(instructions, remaining_bits, word_len)
+  if (instructions.size == 0)
+    return nil
+  end
+
+  node = Node.new
+  shift, width = select_field(instructions, remaining_bits, word_len)
+  bit = (width == 0) ? select_bit(instructions, remaining_bits) : -1
+  if (width == 0 and (instructions.size <= MAX_LEAF_INSTS or bit < 0))
+    abort "Too many overlapping instructions: " + instructions.map { |i| i[:name] }.join(", ") if (instructions.size > MAX_LEAF_INSTS)
+    # the most specific instruction matching all its fixed bits wins, stable
+    # for instructions with the same number of fixed bits
+    sorted = instructions.each_with_index.sort_by { |instruction, i| [-instruction[:bitmap].count("01"), i] }
+    node.candidates = sorted.map do |instruction, i|
+      mask = instruction[:bitmask_set_bits] & remaining_bits
+      [mask, instruction[:bitmask_value] & mask, instruction[:name].to_s.upcase]
+    end
+    return node
+  end
+
+  if (width == 0)
+    # split on a single bit which is fixed in some of the instructions,
+    # the others are duplicated on both sides
+    shift = word_len - bit - 1
+    width = 1
+  end
+
+  node.shift = shift
+  node.width = width
+  node.children = []
+  field_mask = ((1 << width) - 1) << shift
+  subtrees = {}
+  (0...(1 << width)).each do |value|
+    subset = instructions.select { |instruction| field_matches(instruction, shift, width, value) }
+    # identical subsets share the same subtree
+    key = subset.map { |instruction| instruction.object_id }
+    subtrees[key] = build_table(subset, remaining_bits & ~field_mask, word_len) unless subtrees.has_key?(key)
+    node.children.push(subtrees[key])
+  end
+
+  return node
+end
+
+LEAF_ENTRY = (1 << 31)
+
+# Assigns each multi-way node a block of 2^width entries in the decode table
+# and returns the entry pointing to node:
+#  * internal nodes: bits [4:0] shift, bits [12:5] field mask, bits [30:13]
+#    offset of the block of children
+#  * leaves: bit 31 set, bits [30:27] number of candidates, bits [26:0]
+#    index of the first candidate in the leaf arrays
+def table_entry(node, table, leaves, entries)
+  if (node == nil or node.candidates)
+    candidates = (node == nil) ? [] : node.candidates
+    unless entries.has_key?(candidates)
+      entries[candidates] = LEAF_ENTRY | (candidates.size << 27) | leaves.size
+      leaves.concat(candidates)
+    end
+    return entries[candidates]
+  end
+
+  return entries[node.object_id] if entries.has_key?(node.object_id)
+
+  offset = table.size
+  abort "Decode table too large" if (offset >= (1 << 18))
+  table.concat([0] * node.children.size)
+  entry = (offset << 13) | (((1 << node.width) - 1) << 5) | node.shift
+  entries[node.object_id] = entry
+
+  node.children.each_with_index do |child, i|
+    table[offset + i] = table_entry(child, table, leaves, entries)
+  end
+
+  return entry
+end
+
+def generate_table_c(tree, c_ptr)
+  table = []
+  leaves = []
+  root = table_entry(tree, table, leaves, {})
+  prefix = ARGV[0]
+  enum_prefix = ARGV[0].upcase
+
+  puts "static const uint32_t #{prefix}_decode_table[#{table.size}] = {"
+  table.each_slice(8) do |slice|
+    puts "  " + slice.map { |entry| "0x%08x," % entry }.join(" ")
+  end
+  puts "};\n\n"
+
+  puts "static const #{c_ptr} #{prefix}_leaf_mask[#{leaves.size}] = {"
+  leaves.each_slice(8) do |slice|
+    puts "  " + slice.map { |leaf| "0x%08x," % leaf[0] }.join(" ")
+  end
+  puts "};\n\n"
+
+  puts "static const #{c_ptr} #{prefix}_leaf_value[#{leaves.size}] = {"
+  leaves.each_slice(8) do |slice|
+    puts "  " + slice.map { |leaf| "0x%08x," % leaf[1] }.join(" ")
+  end
+  puts "};\n\n"
+
+  puts "static const #{prefix}_instruction #{prefix}_leaf_instruction[#{leaves.size}] = {"
+  leaves.each do |leaf|
+    puts "  #{enum_prefix}_#{leaf[2]},"
+  end
+  puts "};\n\n"
+
+  generate_f_prot(nil, c_ptr)
+  puts " {"
+  puts "  #{c_ptr} instruction = *address;"
+  puts "  uint32_t entry = 0x#{root.to_s(16)};"
+  puts "  while ((entry & 0x#{LEAF_ENTRY.to_s(16)}) == 0) {"
+  puts "    entry = #{prefix}_decode_table[(entry >> 13) + ((instruction >> (entry & 0x1f)) & ((entry >> 5) & 0xff))];"
+  puts "  }"
+  puts "  uint32_t first = entry & 0x7ffffff;"
+  puts "  uint32_t last = first + ((entry >> 27) & 0xf);"
+  puts "  for (uint32_t i = first; i < last; i++) {"
+  puts "    if ((instruction & #{prefix}_leaf_mask[i]) == #{prefix}_leaf_value[i]) {"
+  puts "      return #{prefix}_leaf_instruction[i];"
+  puts "    }"
+  puts "  }"
+  puts "  return #{enum_prefix}_INVALID;"
+  puts "}"
+end
+
 def indent(depth)
  (0..depth).each do |i|
     print "  "
@@ -238,7 +425,17 @@ def handle_cond_field(inst)
   return results
 end
 
-def generate_decoder(raw_insts, inst_len)
+# Array of {mask, value} pairs for each encoding in the spec, for testing
+def generate_spec_table(insts, c_ptr)
+  puts "const #{c_ptr} #{ARGV[0]}_spec[][2] = {"
+  insts.each do |inst|
+    puts "  {0x#{inst[:bitmask_set_bits].to_s(16)}, 0x#{inst[:bitmask_value].to_s(16)}}, // #{inst[:name]}"
+  end
+  puts "};"
+  puts "const int #{ARGV[0]}_spec_count = #{insts.size};\n\n"
+end
+
+def generate_decoder(raw_insts, inst_len, reference)
   max_word_length = get_max_inst_len(raw_insts)
   if (inst_len != max_word_length && inst_len*2 != max_word_length)
     abort "Unsupported configuration (#{inst_len}, #{max_word_length})"
@@ -267,7 +464,18 @@ def generate_decoder(raw_insts, inst_len)
 
   c_ptr = inst_len_to_cptr(inst_len)
   puts "#include \"pie-#{ARGV[0]}-decoder.h\"\n\n"
-  generate_f_prot(insts, c_ptr)
+  # the reference decoder is the original bit by bit decision tree
+  if (reference)
+    generate_spec_table(insts, c_ptr) unless var_inst_len
+    generate_f_prot(insts, c_ptr, "_reference")
+  elsif (!var_inst_len)
+    tree = build_table(insts, (1 << max_word_length) - 1, max_word_length)
+    generate_table_c(tree, c_ptr)
+    return
+  else
+    # the table decoder doesn't support variable length instructions (Thumb) yet
+    generate_f_prot(insts, c_ptr)
+  end
   puts " {"
   puts "  #{c_ptr} instruction = *address;"
   tree = build_tree(insts, (1 << max_word_length) - 1, var_inst_len)
@@ -276,6 +484,7 @@ def generate_decoder(raw_insts, inst_len)
 end
 
 is_header = ARGV[1...ARGV.size].include?("header")
+is_reference = ARGV[1...ARGV.size].include?("reference")
 swaphw = ARGV[1...ARGV.size].include?("swaphw")
 
 insts = process_insts(ARGV[0] + ".txt", swaphw)
@@ -285,6 +494,6 @@ inst_len = get_min_inst_len(insts)
 if (is_header)
   generate_header(insts, inst_len)
 else
-  generate_decoder(insts, inst_len)
+  generate_decoder(insts, inst_len, is_reference)
 end
 
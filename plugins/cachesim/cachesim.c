@@ -149,6 +149,19 @@ cachesim_model_t global_l1d;
 cachesim_model_t l2_model;
 
 extern void cachesim_buf_write(uintptr_t value, cachesim_trace_t *trace);
+#ifdef __aarch64__
+// doesn't preserve the flags
+extern void cachesim_buf_write_nf(uintptr_t value, cachesim_trace_t *trace);
+#endif
+
+static void *cachesim_buf_writer(mambo_context *ctx) {
+#ifdef __aarch64__
+  if (!mambo_are_flags_live(ctx)) {
+    return cachesim_buf_write_nf;
+  }
+#endif
+  return cachesim_buf_write;
+}
 
 void cachesim_proc_buf(cachesim_trace_t *trace_buf) {
   cachesim_model_t *model = trace_buf->model;
@@ -171,7 +184,7 @@ void inst_code(mambo_context *ctx, cachesim_thread_t *cachesim_thread) {
   emit_set_reg(ctx, 1, 0);
 
   emit_set_reg_ptr(ctx, 2, &cachesim_thread->inst_trace_buf.entries);
-  emit_fcall(ctx, cachesim_buf_write);
+  emit_fcall(ctx, cachesim_buf_writer(ctx));
 
   emit_pop(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << lr));
 }
@@ -197,7 +210,8 @@ int cachesim_pre_inst_handler(mambo_context *ctx) {
       assert(ret == 0);
     }
 
-    emit_push(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << lr));    
+    uint32_t to_push = ((1 << 0) | (1 << 1) | (1 << 2) | (1 << lr)) & ~mambo_get_dead_regs(ctx);
+    emit_push(ctx, to_push);
 
     ret = mambo_calc_ld_st_addr(ctx, 0);
     assert(ret == 0);
@@ -207,9 +221,9 @@ int cachesim_pre_inst_handler(mambo_context *ctx) {
     uintptr_t info = (size << 1) | (is_store ? 1 : 0);
     emit_set_reg(ctx, 1, info);
     emit_set_reg_ptr(ctx, 2, &cachesim_thread->data_trace_buf.entries);
-    emit_fcall(ctx, cachesim_buf_write);
+    emit_fcall(ctx, cachesim_buf_writer(ctx));
 
-    emit_pop(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << lr));
+    emit_pop(ctx, to_push);
 
     if (cond != AL) {
       ret = emit_local_branch_cond(ctx, &skip_br, invert_cond(cond));
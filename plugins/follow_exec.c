@@ -20,6 +20,9 @@
 /*
   This plugin will make MAMBO 'follow' into any new process started by the
   application under its control by prepending a call to itself on every execve
+
+  When MAMBO is built with -DDBM_FORK_SERVER, new programs are started by a
+  resident MAMBO process instead, with the plugins already initialised
 */
 
 #ifdef PLUGINS_NEW
@@ -69,6 +72,11 @@ int follow_exec_syscall(mambo_context *ctx) {
       return 0;
     }
 
+#ifdef DBM_FORK_SERVER
+    // only returns if the fork server isn't available
+    fork_server_exec(ctx->thread_data, (char *)args[0], (char **)args[1], (char **)args[2]);
+#endif
+
     // copy argv
     int arg_count = count_args((uintptr_t *)args[1]);
     uintptr_t *tmp_argv = alloca((arg_count+1) * sizeof(uintptr_t));
@@ -97,5 +105,10 @@ __attribute__((constructor)) void follow_exec_init_plugin() {
   self_exe[ret] = '\0';
 
   mambo_register_pre_syscall_cb(ctx, &follow_exec_syscall);
+  mambo_syscall_subscribe(ctx, __NR_execve);
+
+#ifdef DBM_FORK_SERVER
+  fork_server_enable();
+#endif
 }
 #endif
@@ -117,6 +117,9 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_BR:
   case A64_BLR:
   case A64_RET:
+  case A64_BRA:
+  case A64_BLRA:
+  case A64_RETA:
     inst_counter = &counters->branch;
     break;
 
@@ -157,6 +160,9 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
   case A64_LDX_STX_MULTIPLE_POST:
   case A64_LDX_STX_SINGLE:
   case A64_LDX_STX_SINGLE_POST:
+  case A64_LDRA:
+  case A64_ATOMIC_MEMORY:
+  case A64_LDAPR_STLR_UNSCALED:
     if (mambo_is_load(ctx)) {
       inst_counter = &counters->load;
     } else if (mambo_is_store(ctx)) {
@@ -176,6 +182,8 @@ int instruction_count_pre_inst_handler(mambo_context *ctx) {
     break;
 
   case A64_DATA_PROC_REG1:
+  case A64_POINTER_AUTH:
+  case A64_ADDG_SUBG:
   case A64_CCMP_CCMN_IMMED:
   case A64_CCMP_CCMN_REG:
   case A64_COND_SELECT:
@@ -46,6 +46,10 @@ extern void memcheck_malloc_post();
 extern void memcheck_free_pre();
 extern void memcheck_free_post();
 extern void memcheck_unalloc();
+#ifdef __aarch64__
+// doesn't preserve the flags
+extern void memcheck_unalloc_nf();
+#endif
 
 mambo_ht_t allocs;
 
@@ -305,6 +309,15 @@ bool memcheck_should_ignore(mambo_context *ctx) {
   return false;
 }
 
+static void *memcheck_unalloc_fn(mambo_context *ctx) {
+#ifdef __aarch64__
+  if (!mambo_are_flags_live(ctx)) {
+    return memcheck_unalloc_nf;
+  }
+#endif
+  return memcheck_unalloc;
+}
+
 int memcheck_pre_inst_handler(mambo_context *ctx) {
   int ret;
   if (mambo_is_load_or_store(ctx)) {
@@ -328,7 +341,8 @@ int memcheck_pre_inst_handler(mambo_context *ctx) {
     int access_size = mambo_get_ld_st_size(ctx);
     bool is_store = mambo_is_store(ctx);
     
-    emit_push(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3));
+    uint32_t dead_regs = mambo_get_dead_regs(ctx);
+    emit_push(ctx, ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3)) & ~dead_regs);
 
     mambo_calc_ld_st_addr(ctx, 0);
     __memcheck_inst_aarch64(ctx, min(access_size, 56));
@@ -339,14 +353,14 @@ int memcheck_pre_inst_handler(mambo_context *ctx) {
   #endif
     mambo_reserve_branch_cbz(ctx, &zbr);
 
-    emit_push(ctx, (1 << 4) | (1 << lr));
+    emit_push(ctx, ((1 << 4) | (1 << lr)) & ~dead_regs);
 
     emit_set_reg(ctx, 1, access_size | (is_store ? IS_STORE : 0));
     emit_set_reg(ctx, 2, (uintptr_t)mambo_get_source_addr(ctx));
     set_in_malloc_ptr(ctx, 3);
-    emit_fcall(ctx, memcheck_unalloc);
+    emit_fcall(ctx, memcheck_unalloc_fn(ctx));
 
-    emit_pop(ctx, (1 << 4) | (1 << lr));
+    emit_pop(ctx, ((1 << 4) | (1 << lr)) & ~dead_regs);
 
     emit_local_branch_cbz(ctx, &zbr, 1);
   #ifdef __arm__
@@ -360,7 +374,7 @@ int memcheck_pre_inst_handler(mambo_context *ctx) {
     ctx->code.inst_type = type;
   #endif
 
-    emit_pop(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3));
+    emit_pop(ctx, ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3)) & ~dead_regs);
     if (cond != AL) {
       ret = emit_local_branch_cond(ctx, &cond_br, invert_cond(cond));
       assert(ret == 0);
@@ -378,13 +392,14 @@ int memcheck_pre_inst_handler(mambo_context *ctx) {
 
     mambo_reserve_branch_cbz(ctx, &cbz);
 
-    emit_push(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << lr));
+    uint32_t to_push = ((1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << lr)) & ~mambo_get_dead_regs(ctx);
+    emit_push(ctx, to_push);
     emit_mov(ctx, 0, regs[0]);
     emit_set_reg(ctx, 1, mambo_get_ld_st_size(ctx) | (mambo_is_store(ctx) ? IS_STORE : 0));
     emit_set_reg(ctx, 2, (uintptr_t)mambo_get_source_addr(ctx));
     set_in_malloc_ptr(ctx, 3);
-    emit_fcall(ctx, memcheck_unalloc);
-    emit_pop(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << 3) | (1 << 4) | (1 << lr));
+    emit_fcall(ctx, memcheck_unalloc_fn(ctx));
+    emit_pop(ctx, to_push);
 
     emit_local_branch_cbz(ctx, &zbr, regs[1]);
 
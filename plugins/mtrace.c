@@ -38,6 +38,10 @@ struct mtrace {
 
 extern void mtrace_print_buf_trampoline(struct mtrace *trace);
 extern void mtrace_buf_write(uintptr_t value, struct mtrace *trace);
+#ifdef __aarch64__
+// doesn't preserve the flags
+extern void mtrace_buf_write_nf(uintptr_t value, struct mtrace *trace);
+#endif
 
 void mtrace_print_buf(struct mtrace *mtrace_buf) {
   for (int i = 0; i < mtrace_buf->len; i++) {
@@ -64,7 +68,8 @@ int mtrace_pre_inst_handler(mambo_context *ctx) {
       assert(ret == 0);
     }
 
-    emit_push(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << lr));    
+    uint32_t to_push = ((1 << 0) | (1 << 1) | (1 << 2) | (1 << lr)) & ~mambo_get_dead_regs(ctx);
+    emit_push(ctx, to_push);
 
     ret = mambo_calc_ld_st_addr(ctx, 0);
     assert(ret == 0);
@@ -74,9 +79,15 @@ int mtrace_pre_inst_handler(mambo_context *ctx) {
     uintptr_t info = (size << 1) | (is_store ? 1 : 0);
     emit_set_reg(ctx, 1, info);
     emit_set_reg_ptr(ctx, 2, &mtrace_buf->entries);
-    emit_fcall(ctx, mtrace_buf_write);
+    void *buf_write = mtrace_buf_write;
+#ifdef __aarch64__
+    if (!mambo_are_flags_live(ctx)) {
+      buf_write = mtrace_buf_write_nf;
+    }
+#endif
+    emit_fcall(ctx, buf_write);
 
-    emit_pop(ctx, (1 << 0) | (1 << 1) | (1 << 2) | (1 << lr));
+    emit_pop(ctx, to_push);
 
     if (cond != AL) {
       ret = emit_local_branch_cond(ctx, &skip_br, invert_cond(cond));
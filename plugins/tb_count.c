@@ -38,7 +38,7 @@ int tb_cnt_pre_inst_handler(mambo_context *ctx) {
     }
 
     emit_thumb_push16(ctx, (1 << r0) | (1 << r1) | (1 << r2)); // PUSH {R0-R2}
-    emit_thumb_push_cpsr(ctx, r0);                  // MRS  R0, CPSR; PUSH {R0}
+    emit_push_flags(ctx, r0);                       // MRS  R0, CPSR; PUSH {R0}
     // MOVW R0, #(ptr_to_ctr & 0xFFFF)
     // MOVT R0, #(ptr_to_ctr >> 16)
     emit_thumb_copy_to_reg_32bit(ctx, r0, (uint32_t)mambo_get_thread_plugin_data(ctx));
@@ -46,7 +46,7 @@ int tb_cnt_pre_inst_handler(mambo_context *ctx) {
     emit_thumb_addi16(ctx, 1, r1, r1);              // ADDS R1, R1, #1
     emit_thumb_adci32(ctx, 0, 0, r2, 0, r2, 0);     // ADC  R2, R2, #0
     emit_thumb_strd32(ctx, 1, 1, 0, r0, r1, r2, 0); // STRD R1, R2, [R0, #0]
-    emit_thumb_pop_cpsr(ctx, r0);                   // POP {R0}; MSR CPSR, R0
+    emit_pop_flags(ctx, r0);                        // POP {R0}; MSR CPSR, R0
     emit_thumb_pop16(ctx, (1 << r0) | (1 << r1) | (1 << r2));  // POP {R0-R2}
 
     if (skip_branch != NULL) {
@@ -85,7 +85,24 @@ void a64_tbz_helper(uint32_t *write_p, uint64_t target, enum reg reg, uint32_t b
 void a64_tbnz_helper(uint32_t *write_p, uint64_t target, enum reg reg, uint32_t bit);
 void a64_cc_branch(dbm_thread *thread_data, uint32_t *write_p, uint64_t target);
 void a64_inline_hash_lookup(dbm_thread *thread_data, int basic_block, uint32_t **o_write_p,
-                            uint32_t *read_address, enum reg rn, bool link, bool set_meta);
+                            uint32_t *read_address, enum reg rn, bool link, bool set_meta,
+                            bool pac, uint32_t **o_stub_p);
+
+#define A64_ALL_REGS (0x7FFFFFFF) // X0 - X30
+#define A64_NZCV (1U << 31) // the condition flags, in place of X31
+#define A64_LIVENESS_MAX_INSTS 128
+typedef struct {
+  uint32_t *start;
+  int count;
+  // live[i] is the set of registers live before the i-th instruction
+  uint32_t live[A64_LIVENESS_MAX_INSTS + 1];
+} a64_liveness_t;
+
+void a64_reg_usage(uint32_t *read_address, int inst, uint32_t *o_reads, uint32_t *o_writes);
+void a64_liveness(uint32_t *read_address, a64_liveness_t *liveness);
+uint32_t a64_dead_regs(a64_liveness_t *liveness, uint32_t *address);
+bool a64_is_nzcv_live(a64_liveness_t *liveness, uint32_t *address);
+bool a64_is_independent_ld_st(uint32_t *read_address, int inst, uint32_t regs);
 #endif
 
 extern void inline_hash_lookup();
@@ -72,10 +72,20 @@ void install_system_sig_handlers() {
 int deliver_signals(uintptr_t spc, self_signal *s) {
   uint64_t sigmask;
 
-  if (global_data.exit_group) {
+  if (exit_group_pending(current_thread)) {
     thread_abort(current_thread);
   }
 
+#ifdef __aarch64__
+  // stop at send_self_signal, where signal_dispatcher() detaches the thread
+  if (detach_pending(current_thread)) {
+    s->pid = syscall(__NR_getpid);
+    s->tid = syscall(__NR_gettid);
+    s->signo = UNLINK_SIGNAL;
+    return 1;
+  }
+#endif
+
   int ret = syscall(__NR_rt_sigprocmask, 0, NULL, &sigmask, sizeof(sigmask));
   assert (ret == 0);
 
@@ -85,7 +95,7 @@ int deliver_signals(uintptr_t spc, self_signal *s) {
       s->pid = syscall(__NR_getpid);
       s->tid = syscall(__NR_gettid);
       s->signo = i;
-      atomic_increment_u32(&current_thread->is_signal_pending, -1);
+      atomic_increment_u32(signal_pending_flag(current_thread), -1);
       return 1;
     }
   }
@@ -93,6 +103,28 @@ int deliver_signals(uintptr_t spc, self_signal *s) {
   return 0;
 }
 
+#ifdef DBM_SIGNAL_POLL
+// Returns true if deliver_signals() would currently deliver a signal
+bool signal_is_deliverable(dbm_thread *thread_data) {
+  uint64_t sigmask;
+
+  if (exit_group_pending(thread_data) || detach_pending(thread_data)) {
+    return true;
+  }
+
+  int ret = syscall(__NR_rt_sigprocmask, 0, NULL, &sigmask, sizeof(sigmask));
+  assert (ret == 0);
+
+  for (int i = 0; i < _NSIG; i++) {
+    if ((sigmask & (1 << i)) == 0 && thread_data->pending_signals[i] > 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+#endif
+
 typedef int (*inst_decoder)(void *);
 #ifdef __arm__
   #define inst_size(inst, is_thumb) (((is_thumb) && ((inst) < THUMB_ADC32)) ? 2 : 4)
@@ -203,7 +235,7 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
       if (inst == TRAP_INST_TYPE) {
         return false;
       }
-      memcpy(&bb_meta->saved_exit, write_p, offset);
+      memcpy(&current_thread->code_cache_meta_cold[fragment_id].saved_exit, write_p, offset);
       for (int i = 0; i < offset; i += inst_size(TRAP_INST_TYPE, is_thumb)) {
         write_trap(SIGNAL_TRAP_DB);
       }
@@ -222,6 +254,8 @@ bool unlink_direct_branch(dbm_code_cache_meta *bb_meta, void **o_write_p, int fr
 void unlink_fragment(int fragment_id, uintptr_t pc) {
   dbm_code_cache_meta *bb_meta;
 
+  stats_inc(current_thread, STATS_SIGNAL_UNLINKS);
+
 #ifdef DBM_TRACES
   // Skip over trace fragments with elided unconditional branches
   branch_type type;
@@ -355,6 +389,28 @@ void translate_svc_frame(ucontext_t *cont) {
   cont->sp_field = (uintptr_t)sp;
 }
 
+#ifdef DBM_INLINE_SYSCALLS
+/* Returns true if pc is the address of an SVC executed directly from the code
+   cache or of the instruction following it, see a64_inline_syscall(). In the
+   first case, the kernel has set the PC to restart the interrupted syscall.
+   Unlike syscalls going through syscall_handler_pre(), the thread stays in
+   THREAD_RUNNING during an inline syscall, which is counted in STATS_SYSCALLS
+   by the translated code. The exit_group and detach barriers keep sending it
+   UNLINK_SIGNAL, which interrupts a blocking inline syscall. */
+bool inline_syscall_spc(uintptr_t pc, uintptr_t *spc) {
+  uint32_t *inst = (uint32_t *)pc;
+  if (a64_decode(inst) == A64_SVC && a64_decode(inst + 1) == A64_B_BL) {
+    *spc = *(uint64_t *)(inst + 2) - 4;
+    return true;
+  }
+  if (a64_decode(inst - 1) == A64_SVC && a64_decode(inst) == A64_B_BL) {
+    *spc = *(uint64_t *)(inst + 1);
+    return true;
+  }
+  return false;
+}
+#endif
+
 #define PSTATE_N (1 << 31)
 #define PSTATE_Z (1 << 30)
 #define PSTATE_C (1 << 29)
@@ -438,7 +494,7 @@ void restore_exit(dbm_thread *thread_data, int fragment_id, void **o_write_p) {
   dbm_code_cache_meta *bb_meta = &thread_data->code_cache_meta[fragment_id];
 
   int restore_sz = get_direct_branch_exit_trap_sz(bb_meta, fragment_id);
-  memcpy(write_p, &bb_meta->saved_exit, restore_sz);
+  memcpy(write_p, &thread_data->code_cache_meta_cold[fragment_id].saved_exit, restore_sz);
   write_p += restore_sz;
 
   *o_write_p = write_p;
@@ -500,9 +556,27 @@ void sigret_dispatcher_call(dbm_thread *thread_data, ucontext_t *cont, uintptr_t
 
 /* If type == indirect && pc >= exit, read the pc and deliver the signal */
 /* If pc < <type specific>, unlink the fragment and resume execution */
+/* With DBM_SIGNAL_POLL, the code cache isn't modified: the signal is only
+   recorded and translated code checks for it at back-edges and indirect branches */
+#ifdef __aarch64__
+/* Called with the application context restored in the signal frame, which
+   becomes the native context of the thread when the handler returns */
+static uintptr_t signal_detach_thread() {
+  uintptr_t tls = detach_thread(current_thread);
+#ifndef DBM_NATIVE_TLS
+  // with DBM_NATIVE_TLS, signal_trampoline restores the interrupted TLS pointer
+  asm volatile("MSR TPIDR_EL0, %0" : : "r" (tls) : "memory");
+#endif
+  return 0;
+}
+#endif
+
 uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   uintptr_t handler = 0;
   bool deliver_now = false;
+#ifdef DBM_INLINE_SYSCALLS
+  uintptr_t spc;
+#endif
 
   assert(i >= 0 && i < _NSIG);
   ucontext_t *cont = (ucontext_t *)context;
@@ -511,18 +585,61 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
   uintptr_t cc_start = (uintptr_t)&current_thread->code_cache->blocks[trampolines_size_bbs];
   uintptr_t cc_end = cc_start + MAX_BRANCH_RANGE;
 
-  if (global_data.exit_group > 0) {
+  if (exit_group_pending(current_thread)) {
     if (pc >= cc_start && pc < cc_end) {
       int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
       dbm_code_cache_meta *bb_meta = &current_thread->code_cache_meta[fragment_id];
       if (pc >= (uintptr_t)bb_meta->exit_branch_addr) {
         thread_abort(current_thread);
       }
+#ifndef DBM_SIGNAL_POLL
       unlink_fragment(fragment_id, pc);
+#endif
+    }
+    atomic_increment_u32(signal_pending_flag(current_thread), 1);
+    return 0;
+  }
+
+#ifdef DBM_STATS
+  // The stats signal isn't delivered to the application
+  if (i == global_data.stats_signal) {
+    stats_request();
+    return 0;
+  }
+#endif
+
+#ifdef __aarch64__
+  /* The detach signal isn't delivered to the application. Threads are detached
+     once they reach a point where their application context is known */
+  if (i == global_data.detach_signal) {
+    detach_request();
+  }
+  if (detach_pending(current_thread) && (i == UNLINK_SIGNAL || i == global_data.detach_signal)) {
+    if (pc == ((uintptr_t)current_thread->code_cache + self_send_signal_offset)) {
+      translate_delayed_signal_frame(cont);
+      return signal_detach_thread();
     }
-    atomic_increment_u32(&current_thread->is_signal_pending, 1);
+#ifdef DBM_INLINE_SYSCALLS
+    if (pc >= cc_start && pc < cc_end && inline_syscall_spc(pc, &spc)) {
+      cont->pc_field = spc;
+      return signal_detach_thread();
+    }
+#endif
+    // a SIGILL raised by a trap is handled below
+    if (i == global_data.detach_signal || info->si_code == SI_TKILL) {
+#ifndef DBM_SIGNAL_POLL
+      if (pc >= cc_start && pc < cc_end) {
+        int fragment_id = addr_to_fragment_id(current_thread, (uintptr_t)pc);
+        unlink_fragment(fragment_id, pc);
+      }
+#endif
+      atomic_increment_u32(signal_pending_flag(current_thread), 1);
+      return 0;
+    }
+  } else if (i == global_data.detach_signal) {
     return 0;
   }
+#endif
 
   if (pc == ((uintptr_t)current_thread->code_cache + self_send_signal_offset)) {
     translate_delayed_signal_frame(cont);
@@ -531,6 +648,12 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
     translate_svc_frame(cont);
     deliver_now = true;
   }
+#ifdef DBM_INLINE_SYSCALLS
+  else if (pc >= cc_start && pc < cc_end && inline_syscall_spc(pc, &spc)) {
+    cont->pc_field = spc;
+    deliver_now = true;
+  }
+#endif
 
   if (deliver_now) {
     handler = lookup_or_scan(current_thread, global_data.signal_handlers[i], NULL);
@@ -623,13 +746,17 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
         }
       } // i == UNLINK_SIGNAL
     } // if (pc >= (uintptr_t)bb_meta->exit_branch_addr)
+#ifndef DBM_SIGNAL_POLL
     unlink_fragment(fragment_id, pc);
+#endif
   }
 
   /* Call the handlers of synchronous signals immediately
-     The SPC of the instruction is unknown, so sigreturning to addresses derived
-     from the PC value in the signal frame is not supported.
-     We mangle the PC in the context to hopefully trap such attempts.
+     The PC in the context is set to the SPC of the instruction whose translation
+     raised the signal. The other registers are only those of the application
+     if it was raised by the copy of the application's instruction. Without a
+     TPC->SPC map, we mangle the PC in the context to hopefully trap attempts
+     to sigreturn to addresses derived from it.
   */
   if (i == SIGSEGV || i == SIGBUS || i == SIGFPE || i == SIGTRAP || i == SIGILL || i == SIGSYS) {
     handler = global_data.signal_handlers[i];
@@ -654,13 +781,14 @@ uintptr_t signal_dispatcher(int i, siginfo_t *info, void *context) {
       return 0;
     }
 
-    cont->pc_field = 0;
+    uintptr_t fault_spc;
+    cont->pc_field = cc_addr_to_spc(current_thread, pc, &fault_spc) ? fault_spc : 0;
     handler = lookup_or_scan(current_thread, handler, NULL);
     return handler;
   }
 
   atomic_increment_int(&current_thread->pending_signals[i], 1);
-  atomic_increment_u32(&current_thread->is_signal_pending, 1);
+  atomic_increment_u32(signal_pending_flag(current_thread), 1);
 
   return handler;
 }
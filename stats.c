@@ -0,0 +1,250 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Runtime statistics: each thread counts events of the DBM core in its
+  dbm_thread, with plain increments. The counters of the threads which have
+  exited are added to global totals.
+
+  Dumps are enabled by environment variables:
+    MAMBO_STATS=1            at exit
+    MAMBO_STATS_SIGNAL=N     when the process receives signal N, which isn't
+                             delivered to the application
+    MAMBO_STATS_INTERVAL=MS  every MS milliseconds
+  The signal and interval dumps are written by a helper thread. Each dump is
+  written to stderr in the JSON Lines format: one line for each thread
+  running under MAMBO, followed by a line with the totals of the process,
+  including the exited threads. The counters of running threads are read
+  while they are updated, so the values are approximate.
+*/
+
+#ifdef DBM_STATS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbm.h"
+
+#define STATS_LINE_SIZE 1024
+
+static const char *stats_names[STATS_COUNTER_NO] = {
+  [STATS_DISPATCHER_ENTRIES] = "dispatcher_entries",
+  [STATS_TRANSLATIONS]       = "translations",
+  [STATS_LINKS]              = "links",
+  [STATS_INLINE_HASH_MISSES] = "inline_hash_misses",
+  [STATS_TRACE_CREATIONS]    = "trace_creations",
+  [STATS_TRACE_EARLY_EXITS]  = "trace_early_exits",
+  [STATS_SIGNAL_UNLINKS]     = "signal_unlinks",
+  [STATS_SYSCALLS]           = "syscalls",
+  [STATS_CACHE_FLUSHES]      = "cache_flushes",
+  [STATS_PRETRANSLATIONS]    = "pretranslations",
+  [STATS_MERGED_PUSH_POPS]   = "merged_push_pops",
+#ifdef DBM_STATS_TIMING
+  [STATS_DISPATCHER_NS]      = "dispatcher_ns",
+#endif
+};
+
+static bool stats_at_exit;
+static int stats_interval_ms;
+static volatile int stats_requests;
+
+// protects the totals of the exited threads
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stats_retired[STATS_COUNTER_NO];
+static uint64_t stats_retired_threads;
+
+static int stats_env(const char *name) {
+  char *value = getenv(name);
+  return (value == NULL) ? 0 : atoi(value);
+}
+
+static void stats_write_line(char *line, const char *event, const char *scope,
+                             pid_t pid, const char *id_name, uint64_t id, const uint64_t *counters) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int len = snprintf(line, STATS_LINE_SIZE,
+                 "{\"event\":\"%s\",\"scope\":\"%s\",\"time_ns\":%" PRIu64 ",\"pid\":%d,\"%s\":%" PRIu64,
+                 event, scope, (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec, pid, id_name, id);
+  for (int i = 0; i < STATS_COUNTER_NO; i++) {
+    len += snprintf(line + len, STATS_LINE_SIZE - len, ",\"%s\":%" PRIu64, stats_names[i], counters[i]);
+  }
+  len += snprintf(line + len, STATS_LINE_SIZE - len, "}\n");
+  assert(len < STATS_LINE_SIZE);
+
+  // a single write keeps the lines of concurrent dumps separate
+  int ret = write(2, line, len);
+  (void)ret;
+}
+
+// Writes the counters of each running thread and the totals of the process
+static void stats_dump(const char *event) {
+  char line[STATS_LINE_SIZE];
+  uint64_t total[STATS_COUNTER_NO];
+  uint64_t threads = 0;
+  pid_t pid = getpid();
+
+  int ret = pthread_mutex_lock(&stats_mutex);
+  assert(ret == 0);
+
+  int registry_epoch = thread_registry_read_lock();
+  dbm_thread *thread;
+  memcpy(total, stats_retired, sizeof(total));
+  for (int index = 0; (thread = thread_registry_next(&index)) != NULL;) {
+    // already included in the totals, while it's being removed from the registry
+    if (thread->stats_retired) {
+      continue;
+    }
+    uint64_t counters[STATS_COUNTER_NO];
+    for (int i = 0; i < STATS_COUNTER_NO; i++) {
+      counters[i] = ((volatile uint64_t *)thread->stats)[i];
+      total[i] += counters[i];
+    }
+    threads++;
+    stats_write_line(line, event, "thread", pid, "tid", thread->tid, counters);
+  }
+  thread_registry_read_unlock(registry_epoch);
+
+  stats_write_line(line, event, "total", pid, "threads", threads + stats_retired_threads, total);
+
+  ret = pthread_mutex_unlock(&stats_mutex);
+  assert(ret == 0);
+}
+
+/* Called by a thread which is leaving the registry, before it's removed,
+   so that each dump counts it exactly once */
+void stats_thread_exit(dbm_thread *thread_data) {
+  int ret = pthread_mutex_lock(&stats_mutex);
+  assert(ret == 0);
+
+  if (!thread_data->stats_retired) {
+    for (int i = 0; i < STATS_COUNTER_NO; i++) {
+      stats_retired[i] += thread_data->stats[i];
+    }
+    stats_retired_threads++;
+    thread_data->stats_retired = true;
+  }
+
+  ret = pthread_mutex_unlock(&stats_mutex);
+  assert(ret == 0);
+}
+
+static void *stats_dumper(void *arg) {
+  struct timespec interval;
+  struct timespec *timeout = NULL;
+
+  if (stats_interval_ms > 0) {
+    interval.tv_sec = stats_interval_ms / 1000;
+    interval.tv_nsec = (stats_interval_ms % 1000) * 1000 * 1000;
+    timeout = &interval;
+  }
+
+  int seq = stats_requests;
+  while (true) {
+    int ret = futex_wait(&stats_requests, seq, timeout);
+    if (ret == -ETIMEDOUT) {
+      stats_dump("interval");
+    } else if (stats_requests != seq) {
+      seq = stats_requests;
+      stats_dump("signal");
+    }
+  }
+
+  return NULL;
+}
+
+static void stats_start_dumper() {
+  pthread_t thread;
+  pthread_attr_t attr;
+  sigset_t all, old;
+
+  if (stats_interval_ms <= 0 && global_data.stats_signal == 0) {
+    return;
+  }
+
+  // signals are only handled by the application's threads
+  sigfillset(&all);
+  int ret = pthread_sigmask(SIG_SETMASK, &all, &old);
+  assert(ret == 0);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  ret = pthread_create(&thread, &attr, stats_dumper, NULL);
+  assert(ret == 0);
+  pthread_attr_destroy(&attr);
+  ret = pthread_sigmask(SIG_SETMASK, &old, NULL);
+  assert(ret == 0);
+}
+
+// Reads the configuration from the environment, called once at startup
+void stats_init() {
+  stats_at_exit = (stats_env("MAMBO_STATS") != 0);
+  stats_interval_ms = stats_env("MAMBO_STATS_INTERVAL");
+
+  int signo = stats_env("MAMBO_STATS_SIGNAL");
+  if (signo > 0 && signo < _NSIG && signo != SIGKILL && signo != SIGSTOP && signo != UNLINK_SIGNAL) {
+    struct sigaction act;
+    int ret = sigaction(signo, NULL, &act);
+    assert(ret == 0);
+    act.sa_sigaction = signal_trampoline;
+    act.sa_flags |= SA_SIGINFO;
+    ret = sigaction(signo, &act, NULL);
+    assert(ret == 0);
+    global_data.stats_signal = signo;
+  } else if (signo != 0) {
+    fprintf(stderr, "MAMBO: invalid MAMBO_STATS_SIGNAL %d\n", signo);
+  }
+
+  stats_start_dumper();
+}
+
+/* After fork, the child counts its own events. Only the calling thread
+   exists in the child, the dumper is restarted. */
+void stats_reset(dbm_thread *thread_data) {
+  int ret = pthread_mutex_init(&stats_mutex, NULL);
+  assert(ret == 0);
+
+  memset(stats_retired, 0, sizeof(stats_retired));
+  stats_retired_threads = 0;
+  memset(thread_data->stats, 0, sizeof(thread_data->stats));
+  stats_requests = 0;
+
+  stats_start_dumper();
+}
+
+// Can be called from a signal handler
+void stats_request() {
+  atomic_increment_int((int32_t *)&stats_requests, 1);
+  futex_wake(&stats_requests, 1);
+}
+
+// Called by dbm_exit()
+void stats_exit() {
+  if (stats_at_exit) {
+    stats_dump("exit");
+  }
+}
+
+#endif // DBM_STATS
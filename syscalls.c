@@ -85,13 +85,28 @@ void *dbm_start_thread_pth(void *ptr, void *mambo_sp) {
   child_stack += 2;
 #endif
 
-  // Release the lock
+  /* Release the parent. set_tid is on its stack and may be reused as soon as
+     it's set, which doesn't matter for FUTEX_WAKE */
   asm volatile("DMB SY" ::: "memory");
   *(thread_data->set_tid) = tid;
+  futex_wake(thread_data->set_tid, 1);
 
-  assert(register_thread(thread_data, false) == 0);
+  assert(register_thread(thread_data) == 0);
+  // the detacher can now find this thread in the registry
+  asm volatile("DMB SY" ::: "memory");
+  atomic_increment_int((int32_t *)&global_data.threads_starting, -1);
+  exit_barrier_notify();
 
   uintptr_t addr = scan(thread_data, thread_data->clone_ret_addr, ALLOCATE_BB);
+#ifdef DBM_AOT
+  aot_translate(thread_data, true);
+  if (thread_data->was_flushed) {
+    addr = lookup_or_scan(thread_data, (uintptr_t)thread_data->clone_ret_addr, NULL);
+  }
+#endif
+#ifdef DBM_NATIVE_TLS
+  native_tls_leave(thread_data);
+#endif
   th_enter(child_stack, addr);
 
   return NULL;
@@ -119,11 +134,87 @@ dbm_thread *dbm_create_thread(dbm_thread *thread_data, void *next_inst, sys_clon
      Also see man pthread_attr_setguardsize BUGS. */
   pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + 4096);
   pthread_attr_setguardsize(&attr, 4096);
+  atomic_increment_int((int32_t *)&global_data.threads_starting, 1);
   pthread_create(&thread, &attr, new_thread_trampoline, new_thread_data);
 
   return new_thread_data;
 }
 
+#ifdef __aarch64__
+/* With CLONE_VM | CLONE_VFORK, the child shares the parent's address space
+   while the parent is blocked until the child calls execve or exits. Instead
+   of copying the whole process, the child runs from a separate MAMBO context,
+   which is reused by all vfork children of a thread and isn't registered as
+   one of the parent's threads. Plugins still see each child as a new thread:
+   PRE_THREAD_C and POST_THREAD_C are delivered for every child, in the parent. */
+bool vfork_shares_vm(sys_clone_args *clone_args) {
+#ifdef DBM_NATIVE_TLS
+  // native_tls_enter() can't find the context of an unregistered child
+  return false;
+#else
+  return (clone_args->flags & CLONE_VM) && !(clone_args->flags & CLONE_SETTLS);
+#endif
+}
+
+void vfork_prepare(dbm_thread *thread_data, uintptr_t *args) {
+  if (thread_data->vfork_child == NULL) {
+    dbm_thread *child;
+    if (!allocate_thread_data(&child)) {
+      fprintf(stderr, "Failed to allocate vfork context\n");
+      while(1);
+    }
+    init_thread(child);
+    child->is_vfork_child = true;
+    thread_data->vfork_child = child;
+  } else if (thread_data->vfork_child->vfork_parent_generation != thread_data->cache_generation
+             || thread_data->vfork_child->vfork_exec_allocs_generation != global_data.exec_allocs_generation) {
+    /* The code cache of the parent has been flushed or executable code has been
+       unmapped since the previous child ran, so its translations might be stale */
+    flush_code_cache(thread_data->vfork_child);
+  }
+  thread_data->vfork_child->vfork_parent_generation = thread_data->cache_generation;
+  thread_data->vfork_child->vfork_exec_allocs_generation = global_data.exec_allocs_generation;
+  mambo_deliver_callbacks(PRE_THREAD_C, thread_data->vfork_child);
+
+  mambo_memcpy(thread_data->vfork_frame, args + SYSCALL_WRAPPER_STACK_OFFSET - SYSCALL_WRAPPER_FRAME_SIZE,
+               sizeof(thread_data->vfork_frame));
+  thread_data->in_vfork = true;
+}
+
+/* Runs in the child, which must not write to the parent's thread_data. It
+   returns to the child's own code cache through the parent's syscall wrapper. */
+dbm_thread *vfork_child_start(dbm_thread *thread_data, uintptr_t *args, void *next_inst) {
+  dbm_thread *child = thread_data->vfork_child;
+  current_thread = child;
+  child->tid = syscall(__NR_gettid);
+  child->tls = thread_data->tls;
+
+  args[SYSCALL_WRAPPER_TPC_OFFSET] = lookup_or_scan(child, (uintptr_t)next_inst, NULL);
+
+  return child;
+}
+
+// Runs in the parent once the child has called execve or exited
+void vfork_parent_resume(dbm_thread *thread_data, uintptr_t *args, void *next_inst) {
+  uintptr_t ret = args[0];
+  mambo_memcpy(args + SYSCALL_WRAPPER_STACK_OFFSET - SYSCALL_WRAPPER_FRAME_SIZE, thread_data->vfork_frame,
+               sizeof(thread_data->vfork_frame));
+  args[0] = ret;
+
+  // the child has been using the same TLS block
+  current_thread = thread_data;
+  thread_data->in_vfork = false;
+
+  mambo_deliver_callbacks(POST_THREAD_C, thread_data->vfork_child);
+
+  // the child has unmapped executable code, which the parent might have translated
+  if (thread_data->vfork_child->vfork_exec_allocs_generation != global_data.exec_allocs_generation) {
+    flush_code_cache(thread_data);
+    args[SYSCALL_WRAPPER_TPC_OFFSET] = lookup_or_scan(thread_data, (uintptr_t)next_inst, NULL);
+  }
+}
+#endif
+
 uintptr_t emulate_brk(uintptr_t addr) {
   int ret;
 
@@ -184,11 +275,70 @@ ssize_t readlink_handler(char *sys_path, char *sys_buf, ssize_t bufsize) {
   return -1;
 }
 
+// the syscalls handled by syscall_handler_pre() and syscall_handler_post()
+static const uintptr_t emulated_syscalls[] = {
+  __NR_brk, __NR_clone, __NR_exit, __NR_rt_sigaction, __NR_exit_group, __NR_close,
+  __NR_readlinkat, __NR_mprotect, __NR_munmap, __NR_shmat, __NR_shmdt, __NR_rt_sigreturn,
+#ifdef __arm__
+  __NR_sigaction, __NR_mmap2, __NR_sigreturn, __NR_vfork, __ARM_NR_cacheflush,
+  __ARM_NR_set_tls, __NR_readlink,
+#elif __aarch64__
+  __NR_mmap,
+#endif
+};
+
+void syscall_filter_set(uint32_t *filter, uintptr_t syscall_no) {
+  if (syscall_no >= SYSCALL_FILTER_SIZE) {
+    return;
+  }
+  int32_t *word = (int32_t *)&filter[syscall_no / 32];
+  int32_t bit = (int32_t)(1U << (syscall_no % 32));
+  int32_t val;
+  do {
+    val = *word;
+  } while ((val & bit) == 0 && atomic_compare_and_swap_i32(word, val, val | bit) != val);
+}
+
+/* Called before the application starts, once the plugins have registered their
+   callbacks. Plugins which haven't subscribed to specific syscalls receive all. */
+void syscall_filter_init(void) {
+  for (int i = 0; i < sizeof(emulated_syscalls) / sizeof(emulated_syscalls[0]); i++) {
+    syscall_filter_set(global_data.syscall_filter, emulated_syscalls[i]);
+  }
+
+#ifdef PLUGINS_NEW
+  for (int i = 0; i < global_data.free_plugin; i++) {
+    mambo_plugin *plugin = &global_data.plugins[i];
+    if ((plugin->cbs[PRE_SYSCALL_C] != NULL || plugin->cbs[POST_SYSCALL_C] != NULL)
+        && !plugin->syscall_subscribed) {
+      memset(global_data.syscall_filter, 0xFF, sizeof(global_data.syscall_filter));
+    }
+  }
+#endif
+}
+
 int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_inst, dbm_thread *thread_data) {
   int do_syscall = 1;
   sys_clone_args *clone_args;
   debug("syscall pre %d\n", syscall_no);
 
+#ifdef DBM_SIGNAL_POLL
+  /* Signals received in the code cache are only delivered at the next back-edge
+     or indirect branch, which could be after a blocking syscall they should
+     interrupt (e.g. alarm() followed by read()). Instead, deliver them now,
+     before anything is done for the syscall: checked_cc_return is entered
+     with the SVC as the SPC and the syscall is restarted when the handler
+     returns, or straight away if no signal is delivered after all. */
+  if (*signal_pending_flag(thread_data) && signal_is_deliverable(thread_data)) {
+    uintptr_t svc_spc = (uintptr_t)next_inst - 4;
+    args[SYSCALL_WRAPPER_TPC_OFFSET] = lookup_or_scan(thread_data, svc_spc, NULL);
+    args[SYSCALL_WRAPPER_SPC_OFFSET] = svc_spc;
+    return 0;
+  }
+#endif
+
+  stats_inc(thread_data, STATS_SYSCALLS);
+
 #ifdef PLUGINS_NEW
   mambo_context ctx;
 
@@ -205,6 +355,10 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
 
   switch(syscall_no) {
     case __NR_brk:
+#ifdef DBM_ATTACH
+      // the application's heap was set up by the kernel and it's shared with MAMBO's libc
+      if (global_data.attached) break;
+#endif
       args[0] = emulate_brk(args[0]);
       do_syscall = 0;
       break;
@@ -220,7 +374,10 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
 
         volatile pid_t child_tid = 0;
         dbm_create_thread(thread_data, next_inst, clone_args, &child_tid);
-        while(child_tid == 0);
+        // the child stores its TID and wakes us up once it has copied clone_args
+        while (child_tid == 0) {
+          futex_wait(&child_tid, 0, NULL);
+        }
         asm volatile("DMB SY" ::: "memory");
         args[0] = child_tid;
 
@@ -228,11 +385,20 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
         break;
       }
 
-      if (clone_args->flags & CLONE_VFORK) {
+      thread_data->clone_vm = false;
+      bool shared_vm = false;
+#ifdef __aarch64__
+      if ((clone_args->flags & CLONE_VFORK) && vfork_shares_vm(clone_args)) {
+        vfork_prepare(thread_data, args);
+        shared_vm = true;
+      }
+#endif
+      if ((clone_args->flags & CLONE_VFORK) && !shared_vm) {
         clone_args->flags &= ~CLONE_VM;
       }
-      assert((clone_args->flags & CLONE_VM) == 0);
-      thread_data->clone_vm = false;
+      // only kept by the child, see syscall_handler_post()
+      thread_data->parent_in_vfork = (clone_args->flags & CLONE_VFORK) && !shared_vm;
+      assert((clone_args->flags & CLONE_VM) == 0 || shared_vm);
 
       thread_data->child_tls = (clone_args->flags & CLONE_SETTLS) ? clone_args->tls : thread_data->tls;
       clone_args->flags &= ~CLONE_SETTLS;
@@ -249,10 +415,18 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       } // if child_stack != NULL
       break;
     case __NR_exit:
+      // the context of a vfork child is reused by the parent's next vfork
+      if (thread_data->is_vfork_child) {
+        break;
+      }
       debug("thread exit\n");
       void *sp = thread_data->mambo_sp;
-      assert(unregister_thread(thread_data, false) == 0);
+      assert(unregister_thread(thread_data) == 0);
+#ifdef DBM_THREAD_POOL
+      assert(recycle_thread_data(thread_data) == 0);
+#else
       assert(free_thread_data(thread_data) == 0);
+#endif
 
       return_with_sp(sp); // this should never return
       while(1); 
@@ -266,11 +440,17 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       uintptr_t handler = 0xdead;
       assert(args[3] == 8 && args[0] >= 0 && args[0] < _NSIG);
 
+      /* The handler table is shared with the parent of a vfork child, so the
+         handlers installed by the child run untranslated until it calls execve */
       struct kernel_sigaction *act = (struct kernel_sigaction *)args[1];
-      if (act != NULL) {
+      if (act != NULL && !thread_data->is_vfork_child) {
         handler = (uintptr_t)act->k_sa_handler;
-        // Never remove the UNLINK_SIGNAL handler, which is used internally by MAMBO
-        if (args[0] == UNLINK_SIGNAL || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)) {
+        // Never remove the UNLINK_SIGNAL, detach and stats signal handlers, which are used internally by MAMBO
+        if (args[0] == UNLINK_SIGNAL || args[0] == global_data.detach_signal
+#ifdef DBM_STATS
+            || args[0] == global_data.stats_signal
+#endif
+            || (act->k_sa_handler != SIG_IGN && act->k_sa_handler != SIG_DFL)) {
           act->k_sa_handler = (__sighandler_t)signal_trampoline;
           act->sa_flags |= SA_SIGINFO;
         }
@@ -287,7 +467,7 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
           oldact->k_sa_handler = (void *)global_data.signal_handlers[args[0]];
         }
 
-        if (act != NULL) {
+        if (act != NULL && !thread_data->is_vfork_child) {
           global_data.signal_handlers[args[0]] = handler;
         }
       }
@@ -301,6 +481,10 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
       break;
     }
     case __NR_exit_group:
+      // the parent's threads keep running
+      if (thread_data->is_vfork_child) {
+        break;
+      }
       dbm_exit(thread_data, args[0]);
       break;
     case __NR_close:
@@ -479,15 +663,29 @@ int syscall_handler_pre(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_in
 
   if (do_syscall) {
     thread_data->status = THREAD_SYSCALL;
+    exit_barrier_notify();
   }
 
   return do_syscall;
 }
 
 void syscall_handler_post(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_inst, dbm_thread *thread_data) {
+  bool vfork_child = false;
   debug("syscall post %d\n", syscall_no);
 
-  if (global_data.exit_group) {
+#ifdef __aarch64__
+  // both the vfork child and the parent, once released, return here
+  if (syscall_no == __NR_clone && thread_data->in_vfork) {
+    if (args[0] == 0) {
+      thread_data = vfork_child_start(thread_data, args, next_inst);
+      vfork_child = true;
+    } else {
+      vfork_parent_resume(thread_data, args, next_inst);
+    }
+  }
+#endif
+
+  if (exit_group_pending(thread_data)) {
     thread_abort(thread_data);
   }
   thread_data->status = THREAD_RUNNING;
@@ -495,16 +693,25 @@ void syscall_handler_post(uintptr_t syscall_no, uintptr_t *args, uint16_t *next_
   switch(syscall_no) {
     case __NR_clone:
       debug("r0 (tid): %d\n", args[0]);
-      if (args[0] == 0) { // the child
+      if (args[0] == 0 && !vfork_child) { // the child
         assert(!thread_data->clone_vm);
         /* Without CLONE_VM, the child runs in a separate memory space,
            no synchronisation is needed.*/
         thread_data->tls = thread_data->child_tls;
         reset_process(thread_data);
+      } else if (!vfork_child) {
+        thread_data->parent_in_vfork = false;
       }
       break;
   }
 
+#ifdef __aarch64__
+  // detach through checked_cc_return, on the way out of the syscall wrapper
+  if (detach_pending(thread_data)) {
+    atomic_increment_u32(signal_pending_flag(thread_data), 1);
+  }
+#endif
+
 #ifdef PLUGINS_NEW
   mambo_context ctx;
 
@@ -17,6 +17,11 @@
   limitations under the License.
 */
 
+#ifndef __DBM_SYSCALLS_H__
+#define __DBM_SYSCALLS_H__
+
+#include <stdint.h>
+
 /* Defined as a multiple of <native register width> (i.e. 4 bytes on AArch32
    and 8 bytes on AArch64), not bytes
 */
@@ -34,4 +39,22 @@
   */
   #define SYSCALL_WRAPPER_STACK_OFFSET (2 + 2 + 22)
   #define SYSCALL_WRAPPER_FRAME_SIZE   (SYSCALL_WRAPPER_STACK_OFFSET + 2*32)
+  // the code cache address returned to after the syscall, following X0-X21
+  #define SYSCALL_WRAPPER_TPC_OFFSET   (22)
+  // and the SPC passed to checked_cc_return with it
+  #define SYSCALL_WRAPPER_SPC_OFFSET   (23)
+#endif
+
+/* Bitmaps of syscall numbers, one bit per syscall. Syscalls with a number
+   of SYSCALL_FILTER_SIZE or higher are always treated as being set. */
+#define SYSCALL_FILTER_SHIFT (10)
+#define SYSCALL_FILTER_SIZE  (1 << SYSCALL_FILTER_SHIFT)
+#define SYSCALL_FILTER_WORDS (SYSCALL_FILTER_SIZE / 32)
+
+#define syscall_filter_test(filter, no) \
+  ((no) >= SYSCALL_FILTER_SIZE || (((filter)[(no) / 32] >> ((no) % 32)) & 1))
+
+void syscall_filter_set(uint32_t *filter, uintptr_t syscall_no);
+void syscall_filter_init(void);
+
 #endif
@@ -0,0 +1,204 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Regression test for the A64 decoder generated by PIE. It checks a corpus of
+  ARMv8.0 - v8.6, LSE, PAC, MTE and SVE encodings against the expected
+  instruction types, then decodes every word in the executable sections of
+  the ELF files given as arguments (by default, this program, which includes
+  the SVE code in a64_decode_sve.c) and fails if any of them is A64_INVALID.
+  Zero words are skipped, they are used as padding between functions.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include <sys/auxv.h>
+
+#include "../pie/pie-a64-decoder.h"
+
+struct encoding {
+  uint32_t inst;
+  a64_instruction type;
+  char *text;
+};
+
+struct encoding corpus[] = {
+  {0xf8210062, A64_ATOMIC_MEMORY, "ldadd x1, x2, [x3]"},
+  {0xb8e403e5, A64_ATOMIC_MEMORY, "ldaddal w4, w5, [sp]"},
+  {0xf8608041, A64_ATOMIC_MEMORY, "swpl x0, x1, [x2]"},
+  {0x38a11062, A64_ATOMIC_MEMORY, "ldclrab w1, w2, [x3]"},
+  {0xf821005f, A64_ATOMIC_MEMORY, "stadd x1, [x2]"},
+  {0xc8a07c41, A64_LDX_STX, "cas x0, x1, [x2]"},
+  {0x48207c82, A64_LDX_STX, "casp x0, x1, x2, x3, [x4]"},
+  {0xf8bfc020, A64_ATOMIC_MEMORY, "ldapr x0, [x1]"},
+  {0x995fc020, A64_LDAPR_STLR_UNSCALED, "ldapur w0, [x1, #-4]"},
+  {0xd9008062, A64_LDAPR_STLR_UNSCALED, "stlur x2, [x3, #8]"},
+  {0xf87ff420, A64_LDRA, "ldraa x0, [x1, #-8]"},
+  {0xf8a02c20, A64_LDRA, "ldrab x0, [x1, #16]!"},
+  {0xdac10020, A64_POINTER_AUTH, "pacia x0, x1"},
+  {0xdac137e3, A64_POINTER_AUTH, "autizb x3"},
+  {0xdac143e4, A64_POINTER_AUTH, "xpaci x4"},
+  {0x9ac23020, A64_DATA_PROC_REG2, "pacga x0, x1, x2"},
+  {0xd71f0a11, A64_BRA, "braa x16, x17"},
+  {0xd61f0c3f, A64_BRA, "brabz x1"},
+  {0xd73f085f, A64_BLRA, "blraa x2, sp"},
+  {0xd63f0c7f, A64_BLRA, "blrabz x3"},
+  {0xd65f0bff, A64_RETA, "retaa"},
+  {0xd65f0fff, A64_RETA, "retab"},
+  {0xd69f0bff, A64_ERETA, "eretaa"},
+  {0xd503233f, A64_HINT, "paciasp"},
+  {0xd50323bf, A64_HINT, "autiasp"},
+  {0xd503245f, A64_HINT, "bti c"},
+  {0xd50330ff, A64_SB, "sb"},
+  {0xba018425, A64_RMIF, "rmif x1, #3, #5"},
+  {0x3a00084d, A64_SETF, "setf8 w2"},
+  {0x3a00486d, A64_SETF, "setf16 w3"},
+  {0xd500401f, A64_MSR_IMMED, "cfinv"},
+  {0x9adf13e0, A64_DATA_PROC_REG2, "irg x0, sp"},
+  {0x91810820, A64_ADDG_SUBG, "addg x0, x1, #16, #2"},
+  {0xd18207ff, A64_ADDG_SUBG, "subg sp, sp, #32, #1"},
+  {0xd9200820, A64_LD_ST_TAGS, "stg x0, [x1]"},
+  {0xd9601062, A64_LD_ST_TAGS, "ldg x2, [x3, #16]"},
+  {0x4e829420, A64_SIMD_THREE_SAME_EXTRA, "sdot v0.4s, v1.16b, v2.16b"},
+  {0x4e829c20, A64_SIMD_THREE_SAME_EXTRA, "usdot v0.4s, v1.16b, v2.16b"},
+  {0x6e42ec20, A64_SIMD_THREE_SAME_EXTRA, "bfmmla v0.4s, v1.8h, v2.8h"},
+  {0x6e82cc20, A64_SIMD_THREE_SAME_EXTRA, "fcmla v0.4s, v1.4s, v2.4s, #90"},
+  {0x4e421420, A64_SIMD_THREE_SAME_FP16, "fadd v0.8h, v1.8h, v2.8h"},
+  {0x4ef8f820, A64_SIMD_TWO_REG_FP16, "fabs v0.8h, v1.8h"},
+  {0x7e428420, A64_SIMD_SCALAR_THREE_SAME_EXTRA, "sqrdmlah h0, h1, h2"},
+  {0x7ec21420, A64_SIMD_SCALAR_THREE_SAME_FP16, "fabd h0, h1, h2"},
+  {0x5ef9d820, A64_SIMD_SCALAR_TWO_REG_FP16, "frecpe h0, h1"},
+  {0xce020c20, A64_CRYPTO_REG4, "eor3 v0.16b, v1.16b, v2.16b, v3.16b"},
+  {0xce628020, A64_CRYPTO_SHA512_REG3, "sha512h q0, q1, v2.2d"},
+  {0xcec08020, A64_CRYPTO_SHA512_REG2, "sha512su0 v0.2d, v1.2d"},
+  {0xce429020, A64_CRYPTO_SM3_IMM2, "sm3tt1a v0.4s, v1.4s, v2.s[1]"},
+  {0xce820c20, A64_CRYPTO_XAR, "xar v0.2d, v1.2d, v2.2d, #3"},
+  {0x1e284020, A64_FLOAT_REG1, "frint32z s0, s1"},
+  {0x1e7e0020, A64_FLOAT_CVT_INT, "fjcvtzs w0, d1"},
+  {0x1e634020, A64_FLOAT_REG1, "bfcvt h0, s1"},
+  {0xa5e14000, A64_SVE, "ld1d { z0.d }, p0/z, [x0, x1, lsl #3]"},
+  {0xe540e441, A64_SVE, "st1w { z1.s }, p1, [x2]"},
+  {0x04a20020, A64_SVE, "add z0.s, z1.s, z2.s"},
+  {0x25a21c20, A64_SVE, "whilelo p0.s, x1, x2"},
+  {0x2518e3e0, A64_SVE, "ptrue p0.b"},
+  {0x65e20020, A64_SVE, "fmla z0.d, p0/m, z1.d, z2.d"},
+  {0x04e0e3e0, A64_SVE, "cntd x0"},
+  {0x91000420, A64_ADD_SUB_IMMED, "add x0, x1, #1"},
+  {0xf9400420, A64_LDR_STR_UNSIGNED_IMMED, "ldr x0, [x1, #8]"},
+  {0x14000002, A64_B_BL, "b #8"},
+  {0x97fffffe, A64_B_BL, "bl #-8"},
+  {0xd61f0000, A64_BR, "br x0"},
+  {0xd63f0020, A64_BLR, "blr x1"},
+  {0xd65f03c0, A64_RET, "ret"},
+  {0xd4000001, A64_SVC, "svc #0"},
+  {0xc85ffc20, A64_LDX_STX, "ldaxr x0, [x1]"},
+  {0xc802fc20, A64_LDX_STX, "stlxr w2, x0, [x1]"},
+  {0xd53bd040, A64_MRS_MSR_REG, "mrs x0, tpidr_el0"},
+};
+
+void saxpy(float *y, float *x, float a, int n);
+
+int check_corpus() {
+  int errors = 0;
+  for (int i = 0; i < sizeof(corpus) / sizeof(corpus[0]); i++) {
+    a64_instruction type = a64_decode(&corpus[i].inst);
+    if (type != corpus[i].type) {
+      printf("0x%08x (%s) decoded as %d, expected %d\n",
+             corpus[i].inst, corpus[i].text, type, corpus[i].type);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+int check_elf(char *path) {
+  int errors = 0;
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  size_t size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *elf = malloc(size);
+  if (elf == NULL || fread(elf, 1, size, f) != size) {
+    fprintf(stderr, "Failed to read %s\n", path);
+    fclose(f);
+    return 1;
+  }
+  fclose(f);
+
+  Elf64_Ehdr *ehdr = (Elf64_Ehdr *)elf;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_machine != EM_AARCH64) {
+    fprintf(stderr, "%s is not an AArch64 ELF file\n", path);
+    free(elf);
+    return 1;
+  }
+
+  Elf64_Shdr *shdr = (Elf64_Shdr *)(elf + ehdr->e_shoff);
+  for (int s = 0; s < ehdr->e_shnum; s++) {
+    if (shdr[s].sh_type != SHT_PROGBITS || (shdr[s].sh_flags & SHF_EXECINSTR) == 0) continue;
+
+    uint32_t *inst = (uint32_t *)(elf + shdr[s].sh_offset);
+    size_t count = shdr[s].sh_size / sizeof(uint32_t);
+    for (size_t i = 0; i < count; i++) {
+      if (inst[i] != 0 && a64_decode(&inst[i]) == A64_INVALID) {
+        printf("%s: unknown instruction 0x%08x at 0x%lx\n",
+               path, inst[i], shdr[s].sh_addr + i * sizeof(uint32_t));
+        errors++;
+      }
+    }
+  }
+
+  free(elf);
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  if (getauxval(AT_HWCAP) & HWCAP_SVE) {
+    float x[100], y[100];
+    for (int i = 0; i < 100; i++) {
+      x[i] = i;
+      y[i] = 1;
+    }
+    saxpy(y, x, 2, 100);
+    if (y[99] != 199) {
+      printf("a64_decode: saxpy failed\n");
+      return 1;
+    }
+  }
+
+  int errors = check_corpus();
+  if (argc == 1) {
+    errors += check_elf("/proc/self/exe");
+  }
+  for (int i = 1; i < argc; i++) {
+    errors += check_elf(argv[i]);
+  }
+
+  if (errors) {
+    printf("a64_decode: %d errors\n", errors);
+    return 1;
+  }
+  printf("a64_decode: passed\n");
+  return 0;
+}
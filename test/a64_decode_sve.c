@@ -0,0 +1,29 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Built with -march=armv8.5-a+sve, separately from a64_decode.c, so that
+  SVE instructions are only emitted here. a64_decode always decodes this
+  code, but only runs it if the CPU implements SVE.
+*/
+
+// auto-vectorized with SVE at -O3
+void saxpy(float *y, float *x, float a, int n) {
+  for (int i = 0; i < n; i++) {
+    y[i] += a * x[i];
+  }
+}
@@ -0,0 +1,107 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Contended atomic counters implemented with exclusive load / store loops.
+  Intended to be run under plugins which instrument loads and stores, such
+  as mtrace and cachesim: instrumentation inserted between the exclusive
+  load and store could make the loops livelock.
+
+  add_exclusive() is the LDAXR / ADD / STLXR loop which can be translated to
+  LSE atomics, cas_exclusive() is a compare and swap loop in which the
+  exclusive region spans two basic blocks.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define ITERATIONS (200 * 1000)
+
+uint64_t add_counter;
+uint64_t cas_counter;
+
+#ifdef __aarch64__
+uint64_t add_exclusive(uint64_t *counter) {
+  uint64_t value;
+  uint32_t status;
+  asm volatile(
+    "1:\n"
+    "ldaxr %0, [%2]\n"
+    "add %0, %0, #1\n"
+    "stlxr %w1, %0, [%2]\n"
+    "cbnz %w1, 1b\n"
+    : "=&r" (value), "=&r" (status)
+    : "r" (counter)
+    : "memory");
+  return value;
+}
+
+void cas_exclusive(uint64_t *counter) {
+  uint64_t expected, value;
+  uint32_t status;
+  do {
+    expected = *(volatile uint64_t *)counter;
+    asm volatile(
+      "1:\n"
+      "ldaxr %0, [%3]\n"
+      "cmp %0, %4\n"
+      "b.ne 2f\n"
+      "stlxr %w1, %5, [%3]\n"
+      "cbnz %w1, 1b\n"
+      "2:\n"
+      "clrex\n"
+      : "=&r" (value), "=&r" (status), "+m" (*counter)
+      : "r" (counter), "r" (expected), "r" (expected + 1)
+      : "cc", "memory");
+  } while (value != expected);
+}
+#endif
+
+void *run(void *arg) {
+#ifdef __aarch64__
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint64_t value = add_exclusive(&add_counter);
+    assert(value > 0 && value <= THREADS * ITERATIONS);
+    cas_exclusive(&cas_counter);
+  }
+#endif
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[THREADS];
+
+  for (int i = 0; i < THREADS; i++) {
+    int ret = pthread_create(&threads[i], NULL, run, NULL);
+    assert(ret == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    int ret = pthread_join(threads[i], NULL);
+    assert(ret == 0);
+  }
+
+#ifdef __aarch64__
+  assert(add_counter == THREADS * ITERATIONS);
+  assert(cas_counter == THREADS * ITERATIONS);
+#endif
+  printf("atomic_counter: %d threads, %d increments each, passed\n", THREADS, ITERATIONS);
+
+  return 0;
+}
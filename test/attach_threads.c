@@ -0,0 +1,231 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Attach test, for MAMBO built with -DDBM_ATTACH. It isn't executed under
+  MAMBO: it starts a multithreaded child, with threads which are computing,
+  sleeping and blocked in read(), and runs dbm --attach on it. It then checks
+  that MAMBO's image has been mapped in the child, that all its threads keep
+  running correctly and that the child exits normally.
+
+  Usage: attach_threads path_to_dbm
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <elf.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#define WORKERS 4
+
+typedef struct {
+  volatile int running;
+  volatile int done;
+  volatile uint64_t counters[WORKERS];
+  volatile int sleeps;
+  volatile int read_value;
+} shared_state;
+
+shared_state *state;
+int read_pipe[2];
+int stop_pipe[2];
+
+/* Child */
+
+void *worker(void *arg) {
+  int id = (uintptr_t)arg;
+  uint64_t sum = 0;
+
+  __atomic_add_fetch(&state->running, 1, __ATOMIC_SEQ_CST);
+  while (!state->done) {
+    // the counter must follow the local sum, including across the attach
+    sum++;
+    state->counters[id] = sum;
+    assert(state->counters[id] == sum);
+  }
+  return NULL;
+}
+
+void *sleeper(void *arg) {
+  struct timespec ts = {0, 1000 * 1000};
+
+  __atomic_add_fetch(&state->running, 1, __ATOMIC_SEQ_CST);
+  while (!state->done) {
+    int ret = nanosleep(&ts, NULL);
+    assert(ret == 0);
+    state->sleeps++;
+  }
+  return NULL;
+}
+
+void *reader(void *arg) {
+  char c;
+
+  __atomic_add_fetch(&state->running, 1, __ATOMIC_SEQ_CST);
+  int ret = read(read_pipe[0], &c, 1);
+  assert(ret == 1);
+  state->read_value = c;
+  return NULL;
+}
+
+void child() {
+  pthread_t threads[WORKERS + 2];
+  char c;
+
+  // allow the attach under Yama's restricted ptrace scope
+  prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+
+  for (int i = 0; i < WORKERS; i++) {
+    int ret = pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)i);
+    assert(ret == 0);
+  }
+  int ret = pthread_create(&threads[WORKERS], NULL, sleeper, NULL);
+  assert(ret == 0);
+  ret = pthread_create(&threads[WORKERS + 1], NULL, reader, NULL);
+  assert(ret == 0);
+
+  // the main thread is blocked in read() during the attach
+  ret = read(stop_pipe[0], &c, 1);
+  assert(ret == 1);
+  state->done = 1;
+
+  for (int i = 0; i < WORKERS + 2; i++) {
+    ret = pthread_join(threads[i], NULL);
+    assert(ret == 0);
+  }
+  exit(0);
+}
+
+/* Parent */
+
+uintptr_t first_segment(char *path) {
+  Elf64_Ehdr ehdr;
+  Elf64_Phdr phdr;
+
+  FILE *file = fopen(path, "r");
+  assert(file != NULL);
+  size_t ret = fread(&ehdr, sizeof(ehdr), 1, file);
+  assert(ret == 1 && memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0);
+
+  for (int i = 0; i < ehdr.e_phnum; i++) {
+    int err = fseek(file, ehdr.e_phoff + i * ehdr.e_phentsize, SEEK_SET);
+    assert(err == 0);
+    ret = fread(&phdr, sizeof(phdr), 1, file);
+    assert(ret == 1);
+    if (phdr.p_type == PT_LOAD) {
+      fclose(file);
+      return phdr.p_vaddr & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    }
+  }
+  assert(0);
+}
+
+int is_mapped(pid_t pid, uintptr_t addr) {
+  char path[64];
+  char line[512];
+  int found = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  FILE *maps = fopen(path, "r");
+  assert(maps != NULL);
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    if (strtoull(line, NULL, 16) == addr) {
+      found = 1;
+    }
+  }
+  fclose(maps);
+  return found;
+}
+
+void run_attach(char *dbm, pid_t target) {
+  char pid_arg[16];
+  int status;
+
+  snprintf(pid_arg, sizeof(pid_arg), "%d", target);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    execl(dbm, dbm, "--attach", pid_arg, NULL);
+    _exit(127);
+  }
+  pid_t ret = waitpid(pid, &status, 0);
+  assert(ret == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char **argv) {
+  uint64_t before[WORKERS];
+  int status;
+
+  if (argc != 2) {
+    printf("Usage: %s path_to_dbm\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  state = mmap(NULL, sizeof(*state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  assert(state != MAP_FAILED);
+  int ret = pipe(read_pipe);
+  assert(ret == 0);
+  ret = pipe(stop_pipe);
+  assert(ret == 0);
+
+  pid_t target = fork();
+  assert(target >= 0);
+  if (target == 0) {
+    child();
+  }
+  while (state->running < WORKERS + 2);
+  // let the reader block
+  usleep(100 * 1000);
+
+  uintptr_t mambo_addr = first_segment(argv[1]);
+  assert(!is_mapped(target, mambo_addr));
+  run_attach(argv[1], target);
+  assert(is_mapped(target, mambo_addr));
+
+  // all the threads must still be making progress
+  for (int i = 0; i < WORKERS; i++) {
+    before[i] = state->counters[i];
+  }
+  int sleeps = state->sleeps;
+  usleep(500 * 1000);
+  for (int i = 0; i < WORKERS; i++) {
+    assert(state->counters[i] > before[i]);
+  }
+  assert(state->sleeps > sleeps);
+
+  // the thread blocked in read() at the time of the attach
+  char c = 42;
+  ret = write(read_pipe[1], &c, 1);
+  assert(ret == 1);
+  while (state->read_value != 42);
+
+  ret = write(stop_pipe[1], &c, 1);
+  assert(ret == 1);
+  pid_t pid = waitpid(target, &status, 0);
+  assert(pid == target && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  printf("attach test passed\n");
+  return 0;
+}
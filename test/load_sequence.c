@@ -0,0 +1,174 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Runs sequences of back to back loads, to be used with a plugin which
+  instruments every load, such as mtrace or cachesim. The pop emitted after
+  each load's instrumentation is merged with the push of the next one, which
+  must not change the loaded values. This includes loads based on SP and on
+  the registers saved by the plugins, which prevent merging.
+
+  Every load in sum_independent() except the first must have its push
+  merged with the previous pop. When MAMBO_STATS_SIGNAL is set, which needs
+  MAMBO built with -DDBM_STATS and a load instrumentation plugin such as
+  cachesim, this is checked through the merged_push_pops counter. The test
+  sends itself the signal and reads the stats dump from its own stderr,
+  before and after sum_independent() is translated.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define LOADS 16
+#define INDEPENDENT_LOADS 8
+#define STATS_LINE_SIZE 1024
+#define MERGED_KEY "\"merged_push_pops\":"
+
+uint64_t data[LOADS];
+
+#ifdef __aarch64__
+uint64_t sum_independent(uint64_t *p) {
+  uint64_t sum;
+  asm volatile(
+    "mov x9, %1\n"
+    "ldr x10, [x9, #0]\n"
+    "ldr x11, [x9, #8]\n"
+    "ldr x12, [x9, #16]\n"
+    "ldr x13, [x9, #24]\n"
+    "ldp x14, x15, [x9, #32]\n"
+    "ldr w16, [x9, #48]\n"
+    "ldr x17, [x9, #56]\n"
+    "add %0, x10, x11\n"
+    "add %0, %0, x12\n"
+    "add %0, %0, x13\n"
+    "add %0, %0, x14\n"
+    "add %0, %0, x15\n"
+    "add %0, %0, x16\n"
+    "add %0, %0, x17\n"
+    : "=r" (sum)
+    : "r" (p)
+    : "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "x17", "memory");
+  return sum;
+}
+
+// Returns the process total of merged_push_pops, from a stats dump written to stderr
+long merged_push_pops(int signo) {
+  char line[STATS_LINE_SIZE];
+  size_t len = 0;
+  long merged = -1;
+  int fds[2];
+
+  int ret = pipe(fds);
+  assert(ret == 0);
+  int saved_stderr = dup(2);
+  assert(saved_stderr >= 0);
+  ret = dup2(fds[1], 2);
+  assert(ret == 2);
+  ret = kill(getpid(), signo);
+  assert(ret == 0);
+
+  // the dump ends with the line of the totals
+  while (merged < 0) {
+    char c;
+    ssize_t n = read(fds[0], &c, 1);
+    assert(n == 1);
+    if (c != '\n') {
+      if (len < sizeof(line) - 1) {
+        line[len++] = c;
+      }
+      continue;
+    }
+    line[len] = '\0';
+    len = 0;
+    if (strstr(line, "\"scope\":\"total\"") != NULL) {
+      char *counter = strstr(line, MERGED_KEY);
+      assert(counter != NULL);
+      merged = atol(counter + strlen(MERGED_KEY));
+    }
+  }
+
+  ret = dup2(saved_stderr, 2);
+  assert(ret == 2);
+  close(saved_stderr);
+  close(fds[0]);
+  close(fds[1]);
+  return merged;
+}
+
+// loads which use the registers saved by the plugins, or SP
+uint64_t sum_dependent(uint64_t *p) {
+  uint64_t sum;
+  asm volatile(
+    "stp %1, xzr, [sp, #-16]!\n"
+    "ldr x9, [sp]\n"
+    "ldr x0, [x9, #0]\n"
+    "ldr x1, [x0, #0]\n"
+    "ldr x2, [x9, #16]\n"
+    "ldr x10, [x9, x1]\n"
+    "ldr x11, [sp, #8]\n"
+    "add sp, sp, #16\n"
+    "add %0, x0, x1\n"
+    "add %0, %0, x2\n"
+    "add %0, %0, x10\n"
+    "add %0, %0, x11\n"
+    : "=r" (sum)
+    : "r" (p)
+    : "x0", "x1", "x2", "x9", "x10", "x11", "memory");
+  return sum;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifdef __aarch64__
+  uint64_t expected = 0;
+  long merged = 0;
+  char *stats_signal = getenv("MAMBO_STATS_SIGNAL");
+
+  for (int i = 0; i < LOADS; i++) {
+    data[i] = i + 1;
+  }
+  for (int i = 0; i < INDEPENDENT_LOADS; i++) {
+    expected += (i == 6) ? (uint32_t)data[i] : data[i];
+  }
+  if (stats_signal != NULL) {
+    merged = merged_push_pops(atoi(stats_signal));
+  }
+  assert(sum_independent(data) == expected);
+  if (stats_signal != NULL) {
+    merged = merged_push_pops(atoi(stats_signal)) - merged;
+    if (merged < INDEPENDENT_LOADS - 1) {
+      fprintf(stderr, "%ld push / pop pairs merged in sum_independent(), expected %d\n",
+              merged, INDEPENDENT_LOADS - 1);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // x0 = &data[3], x1 = data[3] = 8, x2 = data[2], x10 = data[1], x11 = 0
+  data[0] = (uintptr_t)&data[3];
+  data[3] = 8;
+  expected = (uintptr_t)&data[3] + data[3] + data[2] + data[1];
+  assert(sum_dependent(data) == expected);
+
+  printf("load_sequence: passed\n");
+#endif
+  return 0;
+}
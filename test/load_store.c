@@ -24,6 +24,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#ifdef __aarch64__
+#include <sys/auxv.h>
+#endif
 
 #ifdef __arm__
 #include "../pie/pie-thumb-encoder.h"
@@ -59,6 +62,8 @@ extern void *end_test_a32;
 #elif __aarch64__
 extern void test_a64(void *, void *);
 extern void *end_test_a64;
+extern void test_a64_lse(void *, void *);
+extern void *end_test_a64_lse;
 
 #define ucontext_pc uc_mcontext.pc
 #endif
@@ -176,5 +181,8 @@ int main(int argc, char **argv) {
   test_wrapper("a32", test_a32, (void *)&end_test_a32, heap, stack+STACK_SIZE);
 #elif __aarch64__
   test_wrapper("a64", test_a64, (void *)&end_test_a64, heap, stack+STACK_SIZE);
+  if (getauxval(AT_HWCAP) & HWCAP_ATOMICS) {
+    test_wrapper("a64_lse", test_a64_lse, (void *)&end_test_a64_lse, heap, stack+STACK_SIZE);
+  }
 #endif
 }
@@ -0,0 +1,133 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Checks the PC reported for synchronous faults: loads and stores to an
+  unmapped address, at the start and in the middle of basic blocks, in code
+  executed once and in hot loops which MAMBO turns into traces. The SIGSEGV
+  handler checks that the PC in the signal frame is the address of the
+  faulting instruction and skips it.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <signal.h>
+#include <ucontext.h>
+
+#define ITERATIONS 200000
+#define FAULT_INTERVAL 1000
+
+// set by each faulting site, with ADR, to the address of the instruction which can fault
+volatile uintptr_t expected_pc;
+volatile int faults;
+uint64_t * const bad_addr = (uint64_t *)16;
+
+void handler(int i, siginfo_t *info, void *context) {
+  ucontext_t *cont = (ucontext_t *)context;
+
+  assert(info->si_addr == (void *)bad_addr);
+  if (cont->uc_mcontext.pc != expected_pc) {
+    fprintf(stderr, "Fault reported at %p, expected %p\n", (void *)cont->uc_mcontext.pc, (void *)expected_pc);
+    exit(EXIT_FAILURE);
+  }
+  cont->uc_mcontext.pc += 4;
+  faults++;
+}
+
+// the fault is the first instruction of the block starting at the label
+uint64_t __attribute__((noinline)) load_first(uint64_t *addr) {
+  uint64_t val, label;
+  asm volatile(
+    "ADR %1, 1f\n"
+    "STR %1, [%2]\n"
+    "MOV %0, #0\n"
+    "B 1f\n"
+    "1: LDR %0, [%3]\n"
+    : "=&r" (val), "=&r" (label)
+    : "r" (&expected_pc), "r" (addr)
+    : "memory");
+  return val;
+}
+
+void __attribute__((noinline)) store_middle(uint64_t *addr, uint64_t val) {
+  uint64_t label;
+  asm volatile(
+    "ADR %0, 1f\n"
+    "STR %0, [%1]\n"
+    "ADD %0, %2, #1\n"
+    "SUB %0, %0, #1\n"
+    "1: STR %0, [%3]\n"
+    : "=&r" (label)
+    : "r" (&expected_pc), "r" (val), "r" (addr)
+    : "memory");
+}
+
+uint64_t __attribute__((noinline)) load_pair(uint64_t *addr) {
+  uint64_t val1, val2, label;
+  asm volatile(
+    "ADR %2, 1f\n"
+    "STR %2, [%3]\n"
+    "MOV %0, #0\n"
+    "MOV %1, #0\n"
+    "1: LDP %0, %1, [%4]\n"
+    : "=&r" (val1), "=&r" (val2), "=&r" (label)
+    : "r" (&expected_pc), "r" (addr)
+    : "memory");
+  return val1 + val2;
+}
+
+int main(int argc, char **argv) {
+  uint64_t data[2] = {1, 2};
+  uint64_t sum = 0;
+  int expected_faults = 0;
+
+  struct sigaction act;
+  act.sa_sigaction = handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_SIGINFO;
+  int ret = sigaction(SIGSEGV, &act, NULL);
+  assert(ret == 0);
+
+  // code executed once
+  assert(load_first(bad_addr) == 0);
+  store_middle(bad_addr, 42);
+  assert(load_pair(bad_addr) == 0);
+  assert(faults == 3);
+  expected_faults = 3;
+
+  // hot code
+  for (int i = 0; i < ITERATIONS; i++) {
+    uint64_t *addr = data;
+    if ((i % FAULT_INTERVAL) == (FAULT_INTERVAL - 1)) {
+      addr = bad_addr;
+      expected_faults += 3;
+    }
+    sum += load_first(addr);
+    store_middle(addr, 1);
+    sum += load_pair(addr);
+  }
+
+  assert(faults == expected_faults);
+  uint64_t good = ITERATIONS - ITERATIONS / FAULT_INTERVAL;
+  // data[0] is 1 from the first store, and stays 1
+  assert(sum == good * (1 + 1 + 2));
+
+  printf("sync_fault_spc test passed, %d faults\n", faults);
+  return 0;
+}
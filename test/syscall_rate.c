@@ -0,0 +1,126 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Syscall throughput benchmark: reports the rate of getppid() and of
+  FUTEX_WAKE calls without waiters, which are cheap in the kernel, so the
+  results are dominated by the cost of getting in and out of it. Compare
+  the results under MAMBO built with and without -DDBM_INLINE_SYSCALLS.
+
+  It also checks that a signal which interrupts a blocked read() is
+  delivered before read() returns.
+
+  Usage: syscall_rate [calls]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CALLS 1000000
+
+volatile int handled;
+volatile int reading;
+
+double now() {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(ret == 0);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void handler(int i) {
+  handled = 1;
+}
+
+void *interrupt(void *arg) {
+  while (!reading);
+  // give the main thread time to block in read()
+  usleep(100 * 1000);
+  int ret = pthread_kill(*(pthread_t *)arg, SIGUSR1);
+  assert(ret == 0);
+  return NULL;
+}
+
+void check_interrupted_read() {
+  int fds[2];
+  char c;
+  pthread_t self = pthread_self(), thread;
+
+  struct sigaction act;
+  act.sa_handler = handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = 0;
+  int ret = sigaction(SIGUSR1, &act, NULL);
+  assert(ret == 0);
+
+  ret = pipe(fds);
+  assert(ret == 0);
+  ret = pthread_create(&thread, NULL, interrupt, &self);
+  assert(ret == 0);
+
+  reading = 1;
+  ret = read(fds[0], &c, 1);
+  assert(ret == -1 && errno == EINTR && handled);
+
+  ret = pthread_join(thread, NULL);
+  assert(ret == 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+double run_getppid(int count) {
+  pid_t ppid = getppid();
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    pid_t ret = syscall(__NR_getppid);
+    assert(ret == ppid);
+  }
+  return count / (now() - start);
+}
+
+double run_futex_wake(int count) {
+  int word = 0;
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    long ret = syscall(__NR_futex, &word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    assert(ret == 0);
+  }
+  return count / (now() - start);
+}
+
+int main(int argc, char **argv) {
+  int count = (argc > 1) ? atoi(argv[1]) : CALLS;
+  assert(count > 0);
+
+  check_interrupted_read();
+
+  printf("getppid:    %.0f calls/s\n", run_getppid(count));
+  printf("futex wake: %.0f calls/s\n", run_futex_wake(count));
+
+  return 0;
+}
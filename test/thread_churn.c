@@ -0,0 +1,109 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Thread creation stress test: creates and joins 10,000 short-lived threads,
+  up to BATCH at a time, and reports the latency of pthread_create().
+
+  It then exits while BUSY threads are still running a busy loop, so the run
+  time of the whole process also includes the exit of the running threads.
+
+  Usage: thread_churn [threads]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define THREADS 10000
+#define BATCH 16
+#define BUSY 8
+
+uint64_t ran;
+
+void *run(void *arg) {
+  __atomic_add_fetch(&ran, 1, __ATOMIC_RELAXED);
+  return arg;
+}
+
+void *busy(void *arg) {
+  volatile uint64_t i = 0;
+  while (1) {
+    i++;
+  }
+  return NULL;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(ret == 0);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+  int count = (argc > 1) ? atoi(argv[1]) : THREADS;
+  uint64_t *latency = malloc(count * sizeof(uint64_t));
+  pthread_t threads[BATCH];
+  assert(latency != NULL && count > 0);
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < count; i += BATCH) {
+    int batch = (count - i < BATCH) ? count - i : BATCH;
+    for (int t = 0; t < batch; t++) {
+      uint64_t before = now_ns();
+      int ret = pthread_create(&threads[t], NULL, run, (void *)(uintptr_t)(i + t));
+      latency[i + t] = now_ns() - before;
+      assert(ret == 0);
+    }
+    for (int t = 0; t < batch; t++) {
+      void *ret_val;
+      int ret = pthread_join(threads[t], &ret_val);
+      assert(ret == 0 && ret_val == (void *)(uintptr_t)(i + t));
+    }
+  }
+  uint64_t total = now_ns() - start;
+  assert(ran == count);
+
+  uint64_t sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += latency[i];
+  }
+  qsort(latency, count, sizeof(uint64_t), compare_u64);
+
+  printf("%d threads created and joined in %.3f s\n", count, total / 1e9);
+  printf("pthread_create latency: avg %.1f us, median %.1f us, p99 %.1f us, max %.1f us\n",
+         sum / 1e3 / count, latency[count / 2] / 1e3,
+         latency[count - 1 - count / 100] / 1e3, latency[count - 1] / 1e3);
+
+  for (int t = 0; t < BUSY; t++) {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, busy, NULL);
+    assert(ret == 0);
+  }
+  printf("exiting with %d running threads\n", BUSY);
+
+  return 0;
+}
@@ -0,0 +1,82 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  Microbenchmark for TLS accesses: each iteration reads TPIDR_EL0 to increment a
+  __thread counter. Compare the native run time against MAMBO, built with and
+  without -DDBM_NATIVE_TLS.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define ITERATIONS (100 * 1000 * 1000)
+#define THREADS 4
+
+__thread uint64_t counter;
+
+/* Not inlined and not optimised into a single addition, so the TLS address
+   is recomputed on every call, as it would be for an extern __thread variable */
+void __attribute__((noinline)) increment() {
+  counter++;
+  asm volatile("" ::: "memory");
+}
+
+void *run(void *arg) {
+  uint64_t iterations = (uintptr_t)arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    increment();
+  }
+  assert(counter == iterations);
+  return NULL;
+}
+
+double now() {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(ret == 0);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  uint64_t iterations = (argc > 1) ? strtoull(argv[1], NULL, 0) : ITERATIONS;
+  pthread_t threads[THREADS];
+
+  double start = now();
+  run((void *)(uintptr_t)iterations);
+  double single = now() - start;
+
+  start = now();
+  for (int i = 0; i < THREADS; i++) {
+    int ret = pthread_create(&threads[i], NULL, run, (void *)(uintptr_t)iterations);
+    assert(ret == 0);
+  }
+  for (int i = 0; i < THREADS; i++) {
+    int ret = pthread_join(threads[i], NULL);
+    assert(ret == 0);
+  }
+  double multi = now() - start;
+
+  printf("1 thread:  %.3f s, %.2f ns/increment\n", single, single * 1e9 / iterations);
+  printf("%d threads: %.3f s, %.2f ns/increment\n", THREADS, multi, multi * 1e9 / iterations);
+
+  return 0;
+}
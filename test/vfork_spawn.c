@@ -0,0 +1,105 @@
+/*
+  This file is part of MAMBO, a low-overhead dynamic binary modification tool:
+      https://github.com/beehive-lab/mambo
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+      http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  vfork test: checks that a vfork child shares the address space of its
+  parent, then measures the rate at which children can be started with
+  vfork() + execve() and with posix_spawn().
+
+  Usage: vfork_spawn [children]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define CHILDREN 1000
+#define PROGRAM "/bin/true"
+
+extern char **environ;
+
+double now() {
+  struct timespec ts;
+  int ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+  assert(ret == 0);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void wait_child(pid_t pid) {
+  int status;
+  pid_t ret = waitpid(pid, &status, 0);
+  assert(ret == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+void check_shared_vm() {
+  volatile int value = 0;
+
+  pid_t pid = vfork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    value = 42;
+    _exit(0);
+  }
+  wait_child(pid);
+  assert(value == 42);
+}
+
+double run_vfork(int count) {
+  char *argv[] = {PROGRAM, NULL};
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    pid_t pid = vfork();
+    assert(pid >= 0);
+    if (pid == 0) {
+      execve(PROGRAM, argv, environ);
+      _exit(127);
+    }
+    wait_child(pid);
+  }
+  return count / (now() - start);
+}
+
+double run_posix_spawn(int count) {
+  char *argv[] = {PROGRAM, NULL};
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    pid_t pid;
+    int ret = posix_spawn(&pid, PROGRAM, NULL, NULL, argv, environ);
+    assert(ret == 0);
+    wait_child(pid);
+  }
+  return count / (now() - start);
+}
+
+int main(int argc, char **argv) {
+  int count = (argc > 1) ? atoi(argv[1]) : CHILDREN;
+  assert(count > 0);
+
+  check_shared_vm();
+
+  printf("vfork + execve: %.1f children/s\n", run_vfork(count));
+  printf("posix_spawn:    %.1f children/s\n", run_posix_spawn(count));
+
+  return 0;
+}
@@ -64,7 +64,7 @@ uintptr_t active_trace_lookup(dbm_thread *thread_data, uintptr_t target) {
   if (target == spc) {
     return adjust_cc_entry(thread_data->active_trace.entry_addr);
   }
-  uintptr_t return_tpc = hash_lookup(&thread_data->entry_address, target);
+  uintptr_t return_tpc = hash_lookup(thread_data->entry_address, target);
   if (return_tpc >= (uintptr_t)thread_data->code_cache->traces)
     return adjust_cc_entry(return_tpc);
   return UINT_MAX;
@@ -101,10 +101,13 @@ uint32_t scan_trace(dbm_thread *thread_data, void *address, cc_type type, int *s
   }
 
   debug("Trace scan: %p to %p, id %d\n", address, write_p, trace_id);
+  stats_inc(thread_data, STATS_TRANSLATIONS);
 
   thread_data->code_cache_meta[trace_id].source_addr = address;
   thread_data->code_cache_meta[trace_id].tpc = (uintptr_t)write_p;
   thread_data->code_cache_meta[trace_id].branch_cache_status = 0;
+  thread_data->code_cache_meta_cold[trace_id].pc_map_size = 0;
+  trace_dir_add(thread_data, trace_id, (uintptr_t)write_p);
 
 #ifdef __arm__
   unsigned long thumb = (unsigned long)address & THUMB;
@@ -250,7 +253,7 @@ void install_trace(dbm_thread *thread_data) {
   assert(thread_data->active_trace.active);
   thread_data->active_trace.active = false;
 
-  cc_link = thread_data->code_cache_meta[bb_source].linked_from;
+  cc_link = thread_data->code_cache_meta_cold[bb_source].linked_from;
   while(cc_link != NULL) {
     debug("Link from: 0x%lx, update to: 0x%lx\n", cc_link->data, tpc);
     orig_branch = cc_link->data;
@@ -274,7 +277,7 @@ void install_trace(dbm_thread *thread_data) {
     __clear_cache((void *)orig_branch, (void *)orig_branch + 4);
   }
 
-  hash_add(&thread_data->entry_address, spc, tpc);
+  hash_add(thread_data->entry_address, spc, tpc);
 
 #ifdef __arm__
   thread_data->trace_id = thread_data->active_trace.id;
@@ -348,12 +351,14 @@ void install_trace(dbm_thread *thread_data) {
       // Give the exit a number and set metadata
       int const exit_id = allocate_trace_fragment(thread_data);
       thread_data->code_cache_meta[exit_id].tpc = (uintptr_t)exit_start;
+      thread_data->code_cache_meta_cold[exit_id].pc_map_size = 0;
+      trace_dir_add(thread_data, exit_id, (uintptr_t)exit_start);
       thread_data->code_cache_meta[exit_id].exit_branch_type = trace_exit;
       thread_data->code_cache_meta[exit_id].branch_cache_status = BRANCH_LINKED;
 
       // Record the exit id used in the trace fragment
       int const fragment_id = thread_data->active_trace.exits[i].fragment_id;
-      thread_data->code_cache_meta[fragment_id].free_b = exit_id;
+      thread_data->code_cache_meta_cold[fragment_id].free_b = exit_id;
 
       uintptr_t target_offset = 0;
       for (size_t j = 0; j < 2; j++) {
@@ -509,6 +514,7 @@ void create_trace(dbm_thread *thread_data, uint32_t bb_source, cc_addr_pair *ret
 
     debug("bb: %d, source: %p, ret to: 0x%x\n", bb_source, source_addr, ret_addr->tpc);
     hot_bb_cnt++;
+    stats_inc(thread_data, STATS_TRACE_CREATIONS);
 
     trace_entry = (uintptr_t)thread_data->trace_cache_next;
     trace_entry |= ((uintptr_t)source_addr) & THUMB;
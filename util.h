@@ -26,6 +26,7 @@ extern void dbm_client_entry(uintptr_t addr, uintptr_t *stack_top);
 extern uint32_t atomic_increment_u32(uint32_t *loc, uint32_t inc);
 extern uint64_t atomic_increment_u64(uint64_t *loc, uint64_t inc);
 extern int32_t atomic_decrement_if_positive_i32(int32_t *loc, int32_t inc);
+extern int32_t atomic_compare_and_swap_i32(int32_t *loc, int32_t old, int32_t new);
 
 static inline int32_t atomic_increment_i32(int32_t *loc, int32_t inc)
 {
@@ -48,6 +49,9 @@ extern uintptr_t raw_syscall(long number, ...);
 void signal_trampoline(int i, siginfo_t *, void *);
 
 void safe_fcall_trampoline();
+#ifdef DBM_NATIVE_TLS
+void native_tls_fcall_trampoline();
+#endif
 void *new_thread_trampoline();
 void return_with_sp(void *sp);
 #endif